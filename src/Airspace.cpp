@@ -19,11 +19,152 @@
  ***************************************************************************/
 
 #include <QJsonArray>
+#include <QtMath>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include "AviationUnits.h"
 
 #include "Airspace.h"
 
+
+// Converts a coordinate to the Web Mercator projection. This is the same
+// computation that QGeoPolygon::contains() uses internally.
+static void toMercator(const QGeoCoordinate &coordinate, double &x, double &y)
+{
+    x = coordinate.longitude() / 360.0 + 0.5;
+    y = 0.5 - (std::log(std::tan((M_PI / 4.0) + (M_PI / 2.0) * coordinate.latitude() / 180.0)) / M_PI) / 2.0;
+    y = qBound(0.0, y, 1.0);
+}
+
+
+// QGeoPolygon::contains() hands Web Mercator coordinates to clipper as 64 bit
+// integers, scaled by 2^48 and truncated. This method performs the same
+// conversion. The result is returned as a double, which represents these
+// integers exactly.
+static double toClipperGrid(double mercatorCoordinate)
+{
+    return static_cast<double>(static_cast<qint64>(mercatorCoordinate * 281474976710656.0));
+}
+
+
+// Point-in-polygon test for the point (px, py), which gives exactly the same
+// result as clipper's PointInPolygon() as used by QGeoPolygon::contains(). The
+// arrays xs and ys hold numEdges+1 vertices on the clipper grid; edge number i
+// runs from vertex i to vertex i+1.
+//
+// Points on the boundary count as contained, as with clipper. An edge that
+// ends at the height of the point, or that is horizontal at that height,
+// contains the point if it touches or covers it. Edges that cross the
+// horizontal line through the point are counted in the half-open way of
+// clipper. Where the crossing is not obviously to the left or to the right of
+// the point, the sign of a cross product decides, and a cross product of zero
+// means that the point lies on the edge. The cross product is computed with
+// the same floating point operations as in clipper. The SIMD variants perform
+// exactly the same operations as the scalar loop, so all variants give
+// identical results.
+static bool pointInPolygon(const double *xs, const double *ys, int numEdges, double px, double py)
+{
+    // Like clipper, polygons with fewer than three vertices contain nothing
+    if (numEdges < 3)
+        return false;
+
+    int i = 0;
+    int parity = 0;
+
+#if defined(__SSE2__)
+    const __m128d vpx = _mm_set1_pd(px);
+    const __m128d vpy = _mm_set1_pd(py);
+    const __m128d zero = _mm_setzero_pd();
+    __m128d boundary = _mm_setzero_pd();
+    for(; i+2 <= numEdges; i += 2) {
+        __m128d x0 = _mm_loadu_pd(xs+i);
+        __m128d x1 = _mm_loadu_pd(xs+i+1);
+        __m128d y0 = _mm_loadu_pd(ys+i);
+        __m128d y1 = _mm_loadu_pd(ys+i+1);
+
+        __m128d onHorizontal = _mm_andnot_pd(_mm_xor_pd(_mm_cmpgt_pd(x1, vpx), _mm_cmplt_pd(x0, vpx)), _mm_cmpeq_pd(y0, vpy));
+        __m128d onVertexOrHorizontal = _mm_and_pd(_mm_cmpeq_pd(y1, vpy), _mm_or_pd(_mm_cmpeq_pd(x1, vpx), onHorizontal));
+
+        __m128d straddles = _mm_xor_pd(_mm_cmplt_pd(y0, vpy), _mm_cmplt_pd(y1, vpy));
+        __m128d right0 = _mm_cmpge_pd(x0, vpx);
+        __m128d right1 = _mm_cmpgt_pd(x1, vpx);
+        __m128d undecided = _mm_and_pd(straddles, _mm_xor_pd(right0, right1));
+        __m128d d = _mm_sub_pd(_mm_mul_pd(_mm_sub_pd(x0, vpx), _mm_sub_pd(y1, vpy)), _mm_mul_pd(_mm_sub_pd(x1, vpx), _mm_sub_pd(y0, vpy)));
+        __m128d onEdge = _mm_and_pd(undecided, _mm_cmpeq_pd(d, zero));
+        __m128d crossesBySign = _mm_andnot_pd(_mm_xor_pd(_mm_cmpgt_pd(d, zero), _mm_cmpgt_pd(y1, y0)), undecided);
+        __m128d crosses = _mm_or_pd(_mm_and_pd(straddles, _mm_and_pd(right0, right1)), crossesBySign);
+
+        boundary = _mm_or_pd(boundary, _mm_or_pd(onVertexOrHorizontal, onEdge));
+        parity ^= _mm_movemask_pd(crosses);
+    }
+    if (_mm_movemask_pd(boundary) != 0)
+        return true;
+    parity = (parity ^ (parity >> 1)) & 1;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float64x2_t vpx = vdupq_n_f64(px);
+    const float64x2_t vpy = vdupq_n_f64(py);
+    const float64x2_t zero = vdupq_n_f64(0.0);
+    uint64x2_t lanes = vdupq_n_u64(0);
+    uint64x2_t boundary = vdupq_n_u64(0);
+    for(; i+2 <= numEdges; i += 2) {
+        float64x2_t x0 = vld1q_f64(xs+i);
+        float64x2_t x1 = vld1q_f64(xs+i+1);
+        float64x2_t y0 = vld1q_f64(ys+i);
+        float64x2_t y1 = vld1q_f64(ys+i+1);
+
+        uint64x2_t onHorizontal = vbicq_u64(vceqq_f64(y0, vpy), veorq_u64(vcgtq_f64(x1, vpx), vcltq_f64(x0, vpx)));
+        uint64x2_t onVertexOrHorizontal = vandq_u64(vceqq_f64(y1, vpy), vorrq_u64(vceqq_f64(x1, vpx), onHorizontal));
+
+        uint64x2_t straddles = veorq_u64(vcltq_f64(y0, vpy), vcltq_f64(y1, vpy));
+        uint64x2_t right0 = vcgeq_f64(x0, vpx);
+        uint64x2_t right1 = vcgtq_f64(x1, vpx);
+        uint64x2_t undecided = vandq_u64(straddles, veorq_u64(right0, right1));
+        float64x2_t d = vsubq_f64(vmulq_f64(vsubq_f64(x0, vpx), vsubq_f64(y1, vpy)), vmulq_f64(vsubq_f64(x1, vpx), vsubq_f64(y0, vpy)));
+        uint64x2_t onEdge = vandq_u64(undecided, vceqq_f64(d, zero));
+        uint64x2_t crossesBySign = vbicq_u64(undecided, veorq_u64(vcgtq_f64(d, zero), vcgtq_f64(y1, y0)));
+        uint64x2_t crosses = vorrq_u64(vandq_u64(straddles, vandq_u64(right0, right1)), crossesBySign);
+
+        boundary = vorrq_u64(boundary, vorrq_u64(onVertexOrHorizontal, onEdge));
+        lanes = veorq_u64(lanes, crosses);
+    }
+    if ((vgetq_lane_u64(boundary, 0) | vgetq_lane_u64(boundary, 1)) != 0)
+        return true;
+    parity = static_cast<int>((vgetq_lane_u64(lanes, 0) ^ vgetq_lane_u64(lanes, 1)) & 1);
+#endif
+
+    // Scalar fallback, also used for the remaining edges. This is a
+    // transcription of clipper's PointInPolygon().
+    for(; i < numEdges; i++) {
+        double x0 = xs[i];
+        double x1 = xs[i+1];
+        double y0 = ys[i];
+        double y1 = ys[i+1];
+        if ((y1 == py) && ((x1 == px) || ((y0 == py) && ((x1 > px) == (x0 < px)))))
+            return true;
+        if ((y0 < py) == (y1 < py))
+            continue;
+        if ((x0 >= px) && (x1 > px)) {
+            parity ^= 1;
+            continue;
+        }
+        if ((x0 < px) && (x1 <= px))
+            continue;
+        double d = (x0-px)*(y1-py) - (x1-px)*(y0-py);
+        if (d == 0.0)
+            return true;
+        if ((d > 0.0) == (y1 > y0))
+            parity ^= 1;
+    }
+
+    return parity != 0;
+}
+
 Airspace::Airspace(QObject *parent) : QObject(parent) {}
 
 Airspace::Airspace(const QJsonObject &geoJSONObject, QObject *parent) : QObject(parent) {
@@ -49,6 +190,7 @@ Airspace::Airspace(const QJsonObject &geoJSONObject, QObject *parent) : QObject(
                 QGeoCoordinate(coordinateArray[1].toDouble(), coordinateArray[0].toDouble());
         _polygon.addCoordinate(geoCoordinate);
     }
+    setUpPackedPolygon();
 
     // Get properties
     if (!geoJSONObject.contains("properties"))
@@ -71,6 +213,72 @@ Airspace::Airspace(const QJsonObject &geoJSONObject, QObject *parent) : QObject(
     _lowerBound = properties["BOT"].toString();
 }
 
+bool Airspace::contains(const QGeoCoordinate &position) const {
+    // Paranoid safety checks
+    if (_mercatorX.size() < 2)
+        return false;
+
+    double x, y;
+    toMercator(position, x, y);
+    if (x < _leftBound)
+        x += 1.0;
+
+    // Points outside of the bounding box are never contained in the polygon.
+    // The comparison is done on the clipper grid, because points just outside
+    // of the box might lie on its boundary once they are moved to the grid.
+    x = toClipperGrid(x);
+    y = toClipperGrid(y);
+    if ((x < toClipperGrid(_minX)) || (x > toClipperGrid(_maxX)) || (y < toClipperGrid(_minY)) || (y > toClipperGrid(_maxY)))
+        return false;
+
+    return pointInPolygon(_gridX.constData(), _gridY.constData(), _gridX.size()-1, x, y);
+}
+
+
+QVector<double> Airspace::intersections(const QGeoCoordinate &start, const QGeoCoordinate &end) const {
+    QVector<double> result;
+
+    // Paranoid safety checks
+    if (_mercatorX.size() < 2)
+        return result;
+
+    double x0, y0, x1, y1;
+    toMercator(start, x0, y0);
+    toMercator(end, x1, y1);
+    if (x0 < _leftBound)
+        x0 += 1.0;
+    if (x1 < _leftBound)
+        x1 += 1.0;
+
+    // Segments outside of the bounding box never intersect the polygon
+    if ((qMax(x0, x1) < _minX) || (qMin(x0, x1) > _maxX) || (qMax(y0, y1) < _minY) || (qMin(y0, y1) > _maxY))
+        return result;
+
+    double dx = x1-x0;
+    double dy = y1-y0;
+    for(int i=0; i<_mercatorX.size()-1; i++) {
+        double ex = _mercatorX[i+1]-_mercatorX[i];
+        double ey = _mercatorY[i+1]-_mercatorY[i];
+        double denominator = dx*ey - dy*ex;
+        if (denominator == 0.0)
+            continue;
+
+        double ax = _mercatorX[i]-x0;
+        double ay = _mercatorY[i]-y0;
+        double t = (ax*ey - ay*ex)/denominator;
+        double u = (ax*dy - ay*dx)/denominator;
+
+        // The edge parameter u lies in the half-open interval [0, 1), so that
+        // segments passing exactly through a vertex are counted once.
+        if ((t >= 0.0) && (t <= 1.0) && (u >= 0.0) && (u < 1.0))
+            result.append(t);
+    }
+
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+
 double Airspace::estimatedLowerBoundInFtMSL() const {
     double result = 0.0;
     bool ok;
@@ -116,3 +324,64 @@ bool Airspace::isUpper() const {
 
     return fl >= 100.0;
 }
+
+
+void Airspace::setUpPackedPolygon() {
+    auto path = _polygon.path();
+    if (path.isEmpty())
+        return;
+    _boundingRectangle = _polygon.boundingGeoRectangle();
+
+    // Find the left bound of the polygon, in the same way that QGeoPolygon does
+    // it: walk along the path, unwrap longitudes that jump by more than 180°
+    // and take the vertex with the smallest unwrapped longitude.
+    double unwrappedLongitude = path[0].longitude();
+    double minUnwrappedLongitude = unwrappedLongitude;
+    int minId = 0;
+    for(int i=1; i<path.size(); i++) {
+        double longitudeFrom = path[i-1].longitude();
+        double longitudeTo = path[i].longitude();
+        double deltaLongitude = longitudeTo - longitudeFrom;
+        if (qAbs(deltaLongitude) > 180.0) {
+            if (longitudeTo > 0.0)
+                longitudeTo -= 360.0;
+            else
+                longitudeTo += 360.0;
+            deltaLongitude = longitudeTo - longitudeFrom;
+        }
+        unwrappedLongitude += deltaLongitude;
+        if (unwrappedLongitude < minUnwrappedLongitude) {
+            minUnwrappedLongitude = unwrappedLongitude;
+            minId = i;
+        }
+    }
+    _leftBound = path[minId].longitude() / 360.0 + 0.5;
+
+    // Pack vertices, repeat the first vertex at the end
+    _mercatorX.reserve(path.size()+1);
+    _mercatorY.reserve(path.size()+1);
+    foreach(auto coordinate, path) {
+        double x, y;
+        toMercator(coordinate, x, y);
+        if (x < _leftBound)
+            x += 1.0;
+        _mercatorX.append(x);
+        _mercatorY.append(y);
+    }
+    _mercatorX.append(_mercatorX.first());
+    _mercatorY.append(_mercatorY.first());
+
+    // Move vertices to the clipper grid
+    _gridX.reserve(_mercatorX.size());
+    _gridY.reserve(_mercatorY.size());
+    for(int i=0; i<_mercatorX.size(); i++) {
+        _gridX.append(toClipperGrid(_mercatorX[i]));
+        _gridY.append(toClipperGrid(_mercatorY[i]));
+    }
+
+    // Compute bounding box
+    _minX = *std::min_element(_mercatorX.constBegin(), _mercatorX.constEnd());
+    _maxX = *std::max_element(_mercatorX.constBegin(), _mercatorX.constEnd());
+    _minY = *std::min_element(_mercatorY.constBegin(), _mercatorY.constEnd());
+    _maxY = *std::max_element(_mercatorY.constBegin(), _mercatorY.constEnd());
+}
@@ -22,7 +22,9 @@
 #define AIRSPACE_H
 
 #include <QGeoPolygon>
+#include <QGeoRectangle>
 #include <QJsonObject>
+#include <QVector>
 
 /*! \brief A very simple class that describes an airspace */
 
@@ -63,6 +65,49 @@ public:
     // Standard destructor
     ~Airspace() override = default;
 
+    /*! \brief Checks if a given position lies within the lateral limits of the
+     *  airspace
+     *
+     * This method is much faster than polygon().contains(position). It works
+     * on a packed copy of the polygon vertices that is set up in the
+     * constructor, and tests several polygon edges per instruction on
+     * processors that support SSE2 or NEON.
+     *
+     * The result is exactly the same as polygon().contains(position). In
+     * particular, positions on the boundary of the airspace count as inside.
+     *
+     * @param position Position that is tested
+     *
+     * @returns True if the position lies inside the airspace
+     */
+    bool contains(const QGeoCoordinate &position) const;
+
+    /*! \brief Rectangle that bounds the lateral limits of the airspace
+     *
+     * @returns The bounding rectangle of polygon(), as computed in the
+     * constructor
+     */
+    QGeoRectangle boundingRectangle() const { return _boundingRectangle; }
+
+    /*! \brief Intersections of a line segment with the airspace boundary
+     *
+     * This method computes the points where the line segment from start to end
+     * crosses the boundary of the airspace. The segment is taken to be a
+     * straight line in the Web Mercator projection, that is, a rhumb line. For
+     * the short segments used in navigation, this is very close to the great
+     * circle.
+     *
+     * @param start Start point of the segment
+     *
+     * @param end End point of the segment
+     *
+     * @returns A sorted list of numbers t in the interval [0, 1]. Each number
+     * describes one intersection, where 0 stands for start, 1 stands for end,
+     * and intermediate numbers describe the linearly interpolated point in
+     * between.
+     */
+    QVector<double> intersections(const QGeoCoordinate &start, const QGeoCoordinate &end) const;
+
     /*! \brief Estimates the lower limit of the airspace, in feet above MSL
      *
      * This method gives a rought estimate for the lower limit of the airspace
@@ -157,11 +202,40 @@ public:
     QString upperBound() const { return _upperBound; }
 
 private:
+    // Fills the members _mercatorX, _mercatorY and the bounding box with data
+    // from _polygon. This method is called from the constructor.
+    void setUpPackedPolygon();
+
     QString _name{};
     QString _CAT{};
     QString _upperBound{};
     QString _lowerBound{};
     QGeoPolygon _polygon{};
+
+    // Packed copy of the polygon vertices, used by the method intersections().
+    // The coordinates are given in the Web Mercator projection, exactly as
+    // QGeoPolygon::contains() uses them internally. The first vertex is
+    // repeated at the end of the lists, so that edge number i runs from vertex
+    // i to vertex i+1.
+    QVector<double> _mercatorX{};
+    QVector<double> _mercatorY{};
+
+    // The same vertices, moved to the integer grid that QGeoPolygon::contains()
+    // uses with clipper. Used by the method contains().
+    QVector<double> _gridX{};
+    QVector<double> _gridY{};
+
+    // Bounding box of the packed vertices, in Web Mercator coordinates. Points
+    // with x-coordinate smaller than _leftBound are shifted by one full turn,
+    // in order to handle polygons that cross the date line.
+    double _leftBound{0.0};
+    double _minX{0.0};
+    double _maxX{0.0};
+    double _minY{0.0};
+    double _maxY{0.0};
+
+    // Bounding rectangle of _polygon
+    QGeoRectangle _boundingRectangle{};
 };
 
 #endif
@@ -0,0 +1,116 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <QtMath>
+
+#include "AirspaceLookahead.h"
+#include "AviationUnits.h"
+
+
+AirspaceLookahead::AirspaceLookahead(SatNav *satNav, GeoMapProvider *geoMapProvider, QObject *parent)
+    : QObject(parent), _satNav(satNav), _geoMapProvider(geoMapProvider)
+{
+    connect(_satNav, &SatNav::update, this, &AirspaceLookahead::update);
+    connect(_geoMapProvider, &GeoMapProvider::geoJSONChanged, this, &AirspaceLookahead::invalidateCandidates);
+}
+
+
+void AirspaceLookahead::setLookaheadInMinutes(int minutes)
+{
+    minutes = qBound(1, minutes, 60);
+    if (minutes == _lookaheadInMinutes)
+        return;
+
+    _lookaheadInMinutes = minutes;
+    emit lookaheadInMinutesChanged();
+    invalidateCandidates();
+}
+
+
+void AirspaceLookahead::invalidateCandidates()
+{
+    _searchBox = QGeoRectangle();
+    _candidates.clear();
+    update();
+}
+
+
+void AirspaceLookahead::rebuildCandidates(const QGeoCoordinate &position, double lookaheadDistanceInM)
+{
+    // One degree of latitude corresponds to 60 nautical miles
+    auto heightInDEG = 2.0*AviationUnits::Distance::fromM(2.0*lookaheadDistanceInM).toNM()/60.0;
+    auto widthInDEG  = heightInDEG/qMax(qCos(qDegreesToRadians(position.latitude())), 0.1);
+    _searchBox = QGeoRectangle(position, qMin(widthInDEG, 360.0), qMin(heightInDEG, 180.0));
+
+    _candidates.clear();
+    foreach(auto airspace, _geoMapProvider->allAirspaces()) {
+        if (airspace.isNull())
+            continue;
+        if (airspace->boundingRectangle().intersects(_searchBox))
+            _candidates.append(airspace);
+    }
+}
+
+
+void AirspaceLookahead::update()
+{
+    // Paranoid safety checks
+    if (_satNav.isNull() || _geoMapProvider.isNull())
+        return;
+
+    QVariantList result;
+
+    auto position = _satNav->coordinate();
+    auto track    = _satNav->track();
+    auto GSInMPS  = _satNav->groundSpeedInMetersPerSecond();
+    if (position.isValid() && (track >= 0) && (GSInMPS > 0.0)) {
+        auto lookaheadInS = 60.0*_lookaheadInMinutes;
+        auto lookaheadDistanceInM = GSInMPS*lookaheadInS;
+        auto end = position.atDistanceAndAzimuth(lookaheadDistanceInM, track);
+
+        // Rebuild the list of candidates only if the segment leaves the search box
+        if (!_searchBox.isValid() || !_searchBox.contains(position) || !_searchBox.contains(end))
+            rebuildCandidates(position, lookaheadDistanceInM);
+
+        foreach(auto airspace, _candidates) {
+            if (airspace.isNull())
+                continue;
+            if (airspace->contains(position))
+                continue;
+            auto crossings = airspace->intersections(position, end);
+            if (crossings.isEmpty())
+                continue;
+
+            QVariantMap entry;
+            entry.insert("airspace", QVariant::fromValue(static_cast<QObject*>(airspace.data())));
+            entry.insert("entryTimeInS", crossings.first()*lookaheadInS);
+            entry.insert("entryDistanceInNM", AviationUnits::Distance::fromM(crossings.first()*lookaheadDistanceInM).toNM());
+            result.append(entry);
+        }
+
+        // Sort airspaces according to entry time
+        std::sort(result.begin(), result.end(), [](const QVariant &a, const QVariant &b) {return a.toMap()["entryTimeInS"].toDouble() < b.toMap()["entryTimeInS"].toDouble(); });
+    }
+
+    if (result == _upcomingAirspaces)
+        return;
+    _upcomingAirspaces = result;
+    emit upcomingAirspacesChanged();
+}
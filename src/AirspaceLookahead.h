@@ -0,0 +1,160 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef AIRSPACELOOKAHEAD_H
+#define AIRSPACELOOKAHEAD_H
+
+#include <QGeoRectangle>
+#include <QPointer>
+#include <QVariantList>
+
+#include "Airspace.h"
+#include "GeoMapProvider.h"
+#include "SatNav.h"
+
+
+/*! \brief Airspaces ahead of the aircraft
+ *
+ * This class continuously computes the list of airspaces that the aircraft will
+ * enter within the next few minutes, if it continues on its present track at
+ * its present ground speed. Position, track and ground speed are taken from a
+ * SatNav object, airspaces are taken from a GeoMapProvider. The list is updated
+ * whenever the SatNav reports a new fix.
+ *
+ * The computation is incremental. The class keeps a list of candidate
+ * airspaces whose bounding rectangles intersect a search box around the
+ * current position, which is considerably larger than the distance covered
+ * within the lookahead time. The list of candidates is only rebuilt if the
+ * aircraft leaves the search box, if the lookahead time changes or if the
+ * airspace data changes. In between, every SatNav update intersects a single
+ * line segment with the few candidate polygons.
+ */
+
+class AirspaceLookahead : public QObject
+{
+    Q_OBJECT
+
+public:
+    /*! \brief Standard constructor
+     *
+     * @param satNav SatNav object that provides position, track and ground
+     * speed. The SatNav shall exist for the lifetime of this object.
+     *
+     * @param geoMapProvider GeoMapProvider object that provides the
+     * airspaces. The GeoMapProvider shall exist for the lifetime of this
+     * object.
+     *
+     * @param parent The standard QObject parent pointer
+     */
+    explicit AirspaceLookahead(SatNav *satNav, GeoMapProvider *geoMapProvider, QObject *parent = nullptr);
+
+    // No copy constructor
+    AirspaceLookahead(AirspaceLookahead const&) = delete;
+
+    // No assign operator
+    AirspaceLookahead& operator =(AirspaceLookahead const&) = delete;
+
+    // No move constructor
+    AirspaceLookahead(AirspaceLookahead&&) = delete;
+
+    // No move assignment operator
+    AirspaceLookahead& operator=(AirspaceLookahead&&) = delete;
+
+    // Standard destructor
+    ~AirspaceLookahead() override = default;
+
+    /*! \brief Lookahead time in minutes
+     *
+     * This property holds the time span, in minutes, for which airspaces ahead
+     * are computed. It is a number between 1 and 60, the default is 10.
+     */
+    Q_PROPERTY(int lookaheadInMinutes READ lookaheadInMinutes WRITE setLookaheadInMinutes NOTIFY lookaheadInMinutesChanged)
+
+    /*! \brief Getter function for the property with the same name
+     *
+     * @returns Property lookaheadInMinutes
+     */
+    int lookaheadInMinutes() const { return _lookaheadInMinutes; }
+
+    /*! \brief Setter function for the property with the same name
+     *
+     * @param minutes Property lookaheadInMinutes
+     */
+    void setLookaheadInMinutes(int minutes);
+
+    /*! \brief Airspaces that the aircraft will enter within the lookahead time
+     *
+     * This property holds a list of airspaces that the aircraft will enter
+     * within the next lookaheadInMinutes minutes, sorted by entry time.
+     * Airspaces that contain the current position are not listed.  For better
+     * cooperation with QML, each entry is a QVariantMap with the following
+     * members.
+     *
+     * - "airspace": Pointer to the Airspace, as a QObject*
+     *
+     * - "entryTimeInS": Time until the airspace is entered, in seconds
+     *
+     * - "entryDistanceInNM": Distance to the point of entry, in nautical miles
+     *
+     * The list is empty if no position, track or ground speed is known.
+     */
+    Q_PROPERTY(QVariantList upcomingAirspaces READ upcomingAirspaces NOTIFY upcomingAirspacesChanged)
+
+    /*! \brief Getter function for the property with the same name
+     *
+     * @returns Property upcomingAirspaces
+     */
+    QVariantList upcomingAirspaces() const { return _upcomingAirspaces; }
+
+signals:
+    /*! \brief Notification signal for the property with the same name */
+    void lookaheadInMinutesChanged();
+
+    /*! \brief Notification signal for the property with the same name */
+    void upcomingAirspacesChanged();
+
+private slots:
+    // Invalidates the list of candidate airspaces and recomputes
+    void invalidateCandidates();
+
+    // Recomputes the property upcomingAirspaces from the last SatNav fix
+    void update();
+
+private:
+    // Rebuilds _candidates and _searchBox, so that the search box covers a
+    // circle of radius 2*lookaheadDistanceInM around the position
+    void rebuildCandidates(const QGeoCoordinate &position, double lookaheadDistanceInM);
+
+    QPointer<SatNav> _satNav;
+    QPointer<GeoMapProvider> _geoMapProvider;
+
+    int _lookaheadInMinutes {10};
+
+    // Airspaces whose bounding rectangle intersects _searchBox
+    QList<QPointer<Airspace>> _candidates;
+
+    // Search box used to construct _candidates. An invalid rectangle means
+    // that _candidates needs to be rebuilt.
+    QGeoRectangle _searchBox;
+
+    QVariantList _upcomingAirspaces;
+};
+
+#endif
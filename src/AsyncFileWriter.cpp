@@ -0,0 +1,125 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <QtConcurrent/QtConcurrentRun>
+
+#include "AsyncFileWriter.h"
+
+
+AsyncFileWriter::AsyncFileWriter(const QString &fileName, QObject *parent)
+    : QObject(parent), _file(fileName) {
+    connect(&_watcher, &QFutureWatcher<bool>::finished, this, &AsyncFileWriter::batchWritten);
+}
+
+
+AsyncFileWriter::~AsyncFileWriter() {
+    waitForQueue();
+}
+
+
+bool AsyncFileWriter::open() {
+    waitForQueue();
+    _error = false;
+    _peakPendingBytes = 0;
+    return _file.open(QIODevice::WriteOnly|QIODevice::Append);
+}
+
+
+void AsyncFileWriter::close() {
+    waitForQueue();
+    _file.close();
+}
+
+
+void AsyncFileWriter::flush() {
+    waitForQueue();
+    _file.flush();
+}
+
+
+bool AsyncFileWriter::resize(qint64 size) {
+    waitForQueue();
+    return _file.resize(size);
+}
+
+
+qint64 AsyncFileWriter::size() {
+    waitForQueue();
+    return _file.size();
+}
+
+
+void AsyncFileWriter::write(const QByteArray &data) {
+    if (data.isEmpty())
+        return;
+    _queue.append(data);
+    _pendingBytes += data.size();
+    _peakPendingBytes = qMax(_peakPendingBytes, _pendingBytes);
+    startBatch();
+}
+
+
+void AsyncFileWriter::startBatch() {
+    if (_watcher.isRunning() || _queue.isEmpty())
+        return;
+
+    auto batch = _queue;
+    _queue.clear();
+    _batchBytes = 0;
+    foreach(auto data, batch)
+        _batchBytes += data.size();
+
+    auto file = &_file;
+    _watcher.setFuture(QtConcurrent::run([file, batch]() {
+        foreach(auto data, batch)
+            if (file->write(data) != data.size())
+                return false;
+        return true;
+    }));
+}
+
+
+void AsyncFileWriter::batchWritten() {
+    // batchWritten() might be called after waitForQueue() has already taken
+    // care of the batch, possibly after a new batch has been started
+    if ((_batchBytes == 0) || _watcher.isRunning())
+        return;
+
+    if (!_watcher.result())
+        _error = true;
+    _pendingBytes -= _batchBytes;
+    _batchBytes = 0;
+    emit bytesWritten();
+    startBatch();
+}
+
+
+void AsyncFileWriter::waitForQueue() {
+    while(_watcher.isRunning() || !_queue.isEmpty()) {
+        _watcher.waitForFinished();
+        if (_batchBytes > 0) {
+            if (!_watcher.result())
+                _error = true;
+            _pendingBytes -= _batchBytes;
+            _batchBytes = 0;
+        }
+        startBatch();
+    }
+}
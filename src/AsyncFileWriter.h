@@ -0,0 +1,155 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef ASYNCFILEWRITER_H
+#define ASYNCFILEWRITER_H
+
+#include <QFile>
+#include <QFutureWatcher>
+
+
+/*! \brief Appends data to a file in a separate thread
+ *
+ * This class offers a small subset of the QFile interface. Calls to write()
+ * return immediately; the data is queued and written to disk in a separate
+ * thread, so that slow storage does not block the GUI thread. Writes are
+ * executed one batch at a time, in the order in which they were queued. All
+ * other methods wait until the queue has been written.
+ *
+ * The number of queued bytes is available via pendingBytes(). Callers are
+ * expected to stop producing data when that number gets large, and to continue
+ * when the signal bytesWritten() is emitted. Together with a limited read
+ * buffer of the QNetworkReply, this propagates backpressure from the disk to
+ * the network.
+ */
+
+class AsyncFileWriter : public QObject {
+    Q_OBJECT
+
+public:
+    /*! \brief Standard constructor
+     *
+     * @param fileName Name of the file
+     *
+     * @param parent The standard QObject parent pointer.
+     */
+    explicit AsyncFileWriter(const QString &fileName, QObject *parent = nullptr);
+
+    // No copy constructor
+    AsyncFileWriter(AsyncFileWriter const &) = delete;
+
+    // No assign operator
+    AsyncFileWriter &operator=(AsyncFileWriter const &) = delete;
+
+    // No move constructor
+    AsyncFileWriter(AsyncFileWriter &&) = delete;
+
+    // No move assignment operator
+    AsyncFileWriter &operator=(AsyncFileWriter &&) = delete;
+
+    /*! \brief Standard destructor
+     *
+     * The destructor waits until all queued data has been written.
+     */
+    ~AsyncFileWriter() override;
+
+    /*! \brief Opens the file for writing, in append mode
+     *
+     * @returns True on success
+     */
+    bool open();
+
+    /*! \brief Waits until all queued data has been written, and closes the
+     * file */
+    void close();
+
+    /*! \brief Waits until all queued data has been written, and flushes the
+     * file */
+    void flush();
+
+    /*! \brief Waits until all queued data has been written, and truncates or
+     * extends the file
+     *
+     * @param size New size of the file
+     *
+     * @returns True on success
+     */
+    bool resize(qint64 size);
+
+    /*! \brief Waits until all queued data has been written, and returns the
+     * file size
+     *
+     * @returns Size of the file, in bytes
+     */
+    qint64 size();
+
+    /*! \brief Queues data for writing
+     *
+     * @param data Data that is appended to the file
+     */
+    void write(const QByteArray &data);
+
+    /*! \brief Number of bytes that are queued but not yet written
+     *
+     * @returns Number of bytes
+     */
+    qint64 pendingBytes() const { return _pendingBytes; }
+
+    /*! \brief Largest number of pending bytes since the file was opened
+     *
+     * @returns Number of bytes
+     */
+    qint64 peakPendingBytes() const { return _peakPendingBytes; }
+
+    /*! \brief Indicates if a write operation has failed
+     *
+     * @returns True if any write operation failed since the file was opened
+     */
+    bool hasError() const { return _error; }
+
+signals:
+    /*! \brief Emitted whenever a batch of queued data has been written */
+    void bytesWritten();
+
+private slots:
+    // Called when the write thread is done. Updates the counters, emits
+    // bytesWritten() and starts writing the next batch.
+    void batchWritten();
+
+private:
+    // Starts writing all queued data in a separate thread, unless a write
+    // thread is already running or the queue is empty
+    void startBatch();
+
+    // Waits until the queue is empty
+    void waitForQueue();
+
+    // The file is accessed by the write thread only while _watcher is running
+    QFile _file;
+
+    QList<QByteArray> _queue;
+    qint64 _pendingBytes{0};
+    qint64 _peakPendingBytes{0};
+    qint64 _batchBytes{0};
+    bool _error{false};
+    QFutureWatcher<bool> _watcher;
+};
+
+#endif
@@ -0,0 +1,226 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QFile>
+#include <QMultiHash>
+
+#include "BlockManifest.h"
+#include "FileView.h"
+
+
+quint32 BlockManifest::weakChecksum(const char* data, qint64 length)
+{
+    quint32 a = 0;
+    quint32 b = 0;
+    for(qint64 i=0; i<length; i++) {
+        auto x = static_cast<quint8>(data[i]);
+        a += x;
+        b += static_cast<quint32>(length-i)*x;
+    }
+    return (a & 0xffff) | ((b & 0xffff) << 16);
+}
+
+
+QByteArray BlockManifest::create(const QString& fileName, int blockSize)
+{
+    // Paranoid safety checks
+    if (blockSize <= 0)
+        return QByteArray();
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    QCryptographicHash sha256(QCryptographicHash::Sha256);
+    QVector<quint32> weakChecksums;
+    QVector<QByteArray> strongChecksums;
+    while(!file.atEnd()) {
+        auto block = file.read(blockSize);
+        if (block.isEmpty())
+            return QByteArray();
+        sha256.addData(block);
+        weakChecksums << weakChecksum(block.constData(), block.size());
+        strongChecksums << QCryptographicHash::hash(block, QCryptographicHash::Md5);
+    }
+
+    QByteArray result;
+    QDataStream stream(&result, QIODevice::WriteOnly);
+    stream << magic << formatVersion << static_cast<qint32>(blockSize) << file.size() << sha256.result();
+    stream << static_cast<qint32>(weakChecksums.size());
+    for(int i=0; i<weakChecksums.size(); i++) {
+        stream << weakChecksums[i];
+        stream.writeRawData(strongChecksums[i].constData(), strongChecksums[i].size());
+    }
+    return result;
+}
+
+
+bool BlockManifest::read(const QByteArray& data)
+{
+    *this = BlockManifest();
+
+    QDataStream stream(data);
+    quint32 fileMagic = 0;
+    quint16 fileVersion = 0;
+    qint32 blockSize = 0;
+    qint64 fileSize = -1;
+    QByteArray sha256;
+    qint32 numBlocks = 0;
+    stream >> fileMagic >> fileVersion >> blockSize >> fileSize >> sha256 >> numBlocks;
+    if ((stream.status() != QDataStream::Ok) || (fileMagic != magic) || (fileVersion != formatVersion))
+        return false;
+
+    // Paranoid safety checks
+    if ((blockSize <= 0) || (fileSize < 0) || (numBlocks < 0))
+        return false;
+    if (numBlocks != (fileSize+blockSize-1)/blockSize)
+        return false;
+
+    QVector<quint32> weakChecksums(numBlocks);
+    QVector<QByteArray> strongChecksums(numBlocks);
+    for(int i=0; i<numBlocks; i++) {
+        stream >> weakChecksums[i];
+        strongChecksums[i].resize(16);
+        if (stream.readRawData(strongChecksums[i].data(), 16) != 16)
+            return false;
+    }
+    if (stream.status() != QDataStream::Ok)
+        return false;
+
+    _blockSize = blockSize;
+    _fileSize = fileSize;
+    _sha256 = sha256;
+    _weakChecksums = weakChecksums;
+    _strongChecksums = strongChecksums;
+    return true;
+}
+
+
+QVector<qint64> BlockManifest::findBlocks(const QString& localFileName, const QAtomicInt *canceled) const
+{
+    QVector<qint64> result(numberOfBlocks(), -1);
+
+    FileView local(localFileName);
+    if (!local.isValid() || (local.size() < _blockSize))
+        return result;
+    auto data = local.data();
+    auto size = local.size();
+
+    // Index of blocks by weak checksum. The last block is included only if it
+    // has full length, because the scan below only looks at windows of full
+    // length.
+    QMultiHash<quint32, int> blocksByChecksum;
+    for(int i=0; i<numberOfBlocks(); i++)
+        if (blockLength(i) == _blockSize)
+            blocksByChecksum.insert(_weakChecksums[i], i);
+    if (blocksByChecksum.isEmpty())
+        return result;
+
+    // Slide a window of size _blockSize over the local file. The weak checksum
+    // is updated in constant time when the window moves by one byte. Only if
+    // the weak checksum matches, the MD5 checksum of the window is computed.
+    qint64 position = 0;
+    quint32 checksum = weakChecksum(data, _blockSize);
+    quint32 a = checksum & 0xffff;
+    quint32 b = checksum >> 16;
+    forever {
+        if ((canceled != nullptr) && (canceled->load() != 0))
+            break;
+
+        bool matched = false;
+        auto candidates = blocksByChecksum.values((a & 0xffff) | ((b & 0xffff) << 16));
+        if (!candidates.isEmpty()) {
+            auto md5 = QCryptographicHash::hash(QByteArray::fromRawData(data+position, _blockSize), QCryptographicHash::Md5);
+            foreach(auto index, candidates) {
+                if (_strongChecksums[index] != md5)
+                    continue;
+                if (result[index] < 0)
+                    result[index] = position;
+                matched = true;
+            }
+        }
+
+        if (matched) {
+            // Continue with the window that follows the block just found
+            position += _blockSize;
+            if (position+_blockSize > size)
+                break;
+            checksum = weakChecksum(data+position, _blockSize);
+            a = checksum & 0xffff;
+            b = checksum >> 16;
+            continue;
+        }
+
+        // Move the window by one byte
+        if (position+_blockSize >= size)
+            break;
+        auto out = static_cast<quint8>(data[position]);
+        auto in = static_cast<quint8>(data[position+_blockSize]);
+        a = (a - out + in) & 0xffff;
+        b = (b - static_cast<quint32>(_blockSize)*out + a) & 0xffff;
+        position++;
+    }
+
+    return result;
+}
+
+
+bool BlockManifest::assemble(const QString& localFileName, const QVector<qint64>& localOffsets, const QString& missingBlocksFileName, const QString& outputFileName, const QAtomicInt *canceled) const
+{
+    // Paranoid safety checks
+    if (!isValid() || (localOffsets.size() != numberOfBlocks()))
+        return false;
+
+    FileView local(localFileName);
+    QFile missingBlocks(missingBlocksFileName);
+    if (!missingBlocks.open(QIODevice::ReadOnly))
+        return false;
+    QFile output(outputFileName);
+    if (!output.open(QIODevice::WriteOnly|QIODevice::Truncate))
+        return false;
+
+    QCryptographicHash sha256(QCryptographicHash::Sha256);
+    for(int i=0; i<numberOfBlocks(); i++) {
+        if ((canceled != nullptr) && (canceled->load() != 0))
+            return false;
+
+        auto length = blockLength(i);
+        QByteArray block;
+        if (localOffsets[i] >= 0) {
+            if (!local.isValid() || (localOffsets[i]+length > local.size()))
+                return false;
+            block = QByteArray::fromRawData(local.data()+localOffsets[i], static_cast<int>(length));
+        } else
+            block = missingBlocks.read(length);
+        if (block.size() != length)
+            return false;
+        sha256.addData(block);
+        if (output.write(block) != length)
+            return false;
+    }
+    output.close();
+
+    // All data from the missing blocks file must have been used
+    if (!missingBlocks.atEnd())
+        return false;
+    return sha256.result() == _sha256;
+}
@@ -0,0 +1,175 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef BLOCKMANIFEST_H
+#define BLOCKMANIFEST_H
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+
+/*! \brief Block checksums of a file, used for block-level delta sync
+ *
+ * This class implements the data structure that makes zsync-style updates
+ * possible. The server cuts a file into blocks of equal size and publishes a
+ * manifest that lists, for every block, a weak rolling checksum (as in rsync)
+ * and an MD5 checksum, together with the SHA-256 checksum of the whole file.
+ * A client that has an older version of the file scans its local copy for
+ * blocks with matching checksums, at any offset. Only blocks that are not
+ * found locally need to be downloaded, using HTTP range requests.
+ *
+ * The manifest is a binary file, written with QDataStream. It contains the
+ * magic number, the format version, the block size, the file size, the
+ * SHA-256 checksum, the number of blocks, and then for every block the weak
+ * checksum and the 16 bytes of the MD5 checksum.
+ */
+
+class BlockManifest {
+public:
+    /*! \brief Constructs an invalid manifest */
+    BlockManifest() = default;
+
+    /*! \brief Creates the manifest for a file
+     *
+     * @param fileName Name of the file
+     *
+     * @param blockSize Size of the blocks, in bytes
+     *
+     * @returns The manifest, in the binary format described above, or an
+     * empty array if the file cannot be read
+     */
+    static QByteArray create(const QString& fileName, int blockSize = defaultBlockSize);
+
+    /*! \brief Reads a manifest
+     *
+     * @param data Manifest, in the binary format described above
+     *
+     * @returns True if the manifest could be read
+     */
+    bool read(const QByteArray& data);
+
+    /*! \brief Validity
+     *
+     * @returns True if a manifest has been read successfully
+     */
+    bool isValid() const { return _blockSize > 0; }
+
+    /*! \brief Size of the file described by the manifest
+     *
+     * @returns File size in bytes
+     */
+    qint64 fileSize() const { return _fileSize; }
+
+    /*! \brief SHA-256 checksum of the file described by the manifest
+     *
+     * @returns Checksum, or an empty array if no manifest has been read
+     */
+    QByteArray sha256() const { return _sha256; }
+
+    /*! \brief Number of blocks
+     *
+     * @returns Number of blocks. The last block might be shorter than the
+     * others.
+     */
+    int numberOfBlocks() const { return _weakChecksums.size(); }
+
+    /*! \brief Byte range of a block
+     *
+     * @param index Number of the block
+     *
+     * @returns Offset of the block in the file
+     */
+    qint64 blockOffset(int index) const { return static_cast<qint64>(index)*_blockSize; }
+
+    /*! \brief Length of a block
+     *
+     * @param index Number of the block
+     *
+     * @returns Length of the block in bytes
+     */
+    qint64 blockLength(int index) const { return qMin(static_cast<qint64>(_blockSize), _fileSize-blockOffset(index)); }
+
+    /*! \brief Finds blocks in a local file
+     *
+     * This method scans the local file with a rolling checksum and looks for
+     * blocks of the manifest, at any offset. The local file is accessed via a
+     * FileView, so that it cannot be replaced during the scan. It can take a
+     * while for large files and is meant to be run in a separate thread.
+     *
+     * @param localFileName Name of the local file
+     *
+     * @returns A list with one entry per block. The entry is the offset where
+     * the block is found in the local file, or -1 if it is not found.
+     *
+     * @param canceled If not nullptr, the scan stops early once the value
+     * becomes non-zero. The result is then incomplete.
+     */
+    QVector<qint64> findBlocks(const QString& localFileName, const QAtomicInt *canceled = nullptr) const;
+
+    /*! \brief Assembles the file described by the manifest
+     *
+     * This method writes the output file block by block. Blocks that have
+     * been found in the local file are copied from there, all other blocks are
+     * read in order from the file missingBlocksFileName. Finally, the SHA-256
+     * checksum of the output is compared to the manifest. This method is meant
+     * to be run in a separate thread.
+     *
+     * @param localFileName Name of the local file
+     *
+     * @param localOffsets Offsets of the blocks in the local file, as returned
+     * by findBlocks()
+     *
+     * @param missingBlocksFileName Name of a file that contains all blocks
+     * that have not been found locally, concatenated in the order of the
+     * blocks
+     *
+     * @param outputFileName Name of the output file. If the file exists, it
+     * is overwritten.
+     *
+     * @param canceled If not nullptr, the method stops early and fails once
+     * the value becomes non-zero
+     *
+     * @returns True if the output file has been written and its checksum
+     * agrees with the manifest
+     */
+    bool assemble(const QString& localFileName, const QVector<qint64>& localOffsets, const QString& missingBlocksFileName, const QString& outputFileName, const QAtomicInt *canceled = nullptr) const;
+
+    /*! \brief Default block size used by create() */
+    static const int defaultBlockSize = 4096;
+
+private:
+    // Weak checksum, as used by rsync. The checksum can be updated in constant
+    // time when the window moves by one byte.
+    static quint32 weakChecksum(const char* data, qint64 length);
+
+    // Magic number and format version of the binary format
+    static const quint32 magic = 0x454e4253;
+    static const quint16 formatVersion = 1;
+
+    int _blockSize{0};
+    qint64 _fileSize{-1};
+    QByteArray _sha256;
+    QVector<quint32> _weakChecksums;
+    QVector<QByteArray> _strongChecksums;
+};
+
+#endif
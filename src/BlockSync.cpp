@@ -0,0 +1,257 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <QRegularExpression>
+#include <QtConcurrent/QtConcurrentRun>
+#include <utility>
+
+#include "BlockSync.h"
+
+
+BlockSync::BlockSync(QUrl url, QUrl manifestURL, QString localFileName, QString outputFileName,
+                     QNetworkAccessManager *networkAccessManager, QObject *parent)
+    : QObject(parent), _networkAccessManager(networkAccessManager), _url(std::move(url)),
+      _manifestURL(std::move(manifestURL)), _localFileName(std::move(localFileName)),
+      _outputFileName(std::move(outputFileName)), _missingBlocksFile(_outputFileName+".blocks") {
+    // Paranoid safety checks
+    Q_ASSERT(networkAccessManager != nullptr);
+
+    connect(&_findBlocksWatcher, &QFutureWatcher<QVector<qint64>>::finished, this, &BlockSync::blocksFound);
+    connect(&_assembleWatcher, &QFutureWatcher<bool>::finished, this, &BlockSync::assembled);
+}
+
+
+BlockSync::~BlockSync() {
+    // Stop the threads started by this class and wait for them, so that the
+    // files they read and write can safely be removed
+    _canceled.store(1);
+    _findBlocksWatcher.waitForFinished();
+    _assembleWatcher.waitForFinished();
+
+    if (!_networkReply.isNull()) {
+        _networkReply->disconnect(this);
+        _networkReply->abort();
+        delete _networkReply;
+    }
+    _missingBlocksFile.close();
+    _missingBlocksFile.remove();
+}
+
+
+void BlockSync::start() {
+    // Paranoid safety checks
+    if (_networkAccessManager.isNull() || !_manifestURL.isValid()) {
+        fail();
+        return;
+    }
+
+    _networkReply = _networkAccessManager->get(QNetworkRequest(_manifestURL));
+    connect(_networkReply, &QNetworkReply::finished, this, &BlockSync::manifestFinished);
+}
+
+
+void BlockSync::manifestFinished() {
+    // Paranoid safety checks
+    if (_networkReply.isNull())
+        return;
+    auto reply = _networkReply;
+    _networkReply = nullptr;
+    reply->deleteLater();
+    if (reply->error() != QNetworkReply::NoError) {
+        fail();
+        return;
+    }
+    if (!_manifest.read(reply->readAll())) {
+        fail();
+        return;
+    }
+
+    // Scan the local file in a separate thread. The lambda works on copies.
+    // The destructor cancels the scan and waits for it.
+    auto manifest = _manifest;
+    auto localFileName = _localFileName;
+    auto canceled = &_canceled;
+    _findBlocksWatcher.setFuture(QtConcurrent::run([manifest, localFileName, canceled]() { return manifest.findBlocks(localFileName, canceled); }));
+}
+
+
+void BlockSync::blocksFound() {
+    _localOffsets = _findBlocksWatcher.result();
+
+    // Blocks in small gaps between missing blocks are downloaded as well
+    int lastMissing = -1;
+    for(int i=0; i<_localOffsets.size(); i++) {
+        if (_localOffsets[i] >= 0)
+            continue;
+        if ((lastMissing >= 0) && (i-lastMissing-1 <= maxGapInBlocks))
+            for(int j=lastMissing+1; j<i; j++)
+                _localOffsets[j] = -1;
+        lastMissing = i;
+    }
+
+    // Compute the byte ranges that need to be downloaded
+    _ranges.clear();
+    _bytesToFetch = 0;
+    for(int i=0; i<_localOffsets.size(); i++) {
+        if (_localOffsets[i] >= 0)
+            continue;
+        auto first = _manifest.blockOffset(i);
+        auto last = first+_manifest.blockLength(i)-1;
+        if (!_ranges.isEmpty() && (_ranges.last().second+1 == first))
+            _ranges.last().second = last;
+        else
+            _ranges.append(qMakePair(first, last));
+        _bytesToFetch += last-first+1;
+    }
+
+    // If most of the file has changed, a block-level update does not pay off
+    if (_bytesToFetch > maxFractionToFetch*_manifest.fileSize()) {
+        fail();
+        return;
+    }
+
+    if (!_missingBlocksFile.open(QIODevice::WriteOnly|QIODevice::Truncate)) {
+        fail();
+        return;
+    }
+    startRangeRequest();
+}
+
+
+void BlockSync::startRangeRequest() {
+    // Paranoid safety checks
+    if (_networkAccessManager.isNull()) {
+        fail();
+        return;
+    }
+
+    // If all ranges have been downloaded, assemble the file in a separate
+    // thread. The lambda works on copies. The destructor cancels the assembly
+    // and waits for it.
+    if (_ranges.isEmpty()) {
+        _missingBlocksFile.close();
+        setProgress(100);
+        auto manifest = _manifest;
+        auto localFileName = _localFileName;
+        auto localOffsets = _localOffsets;
+        auto missingBlocksFileName = _missingBlocksFile.fileName();
+        auto outputFileName = _outputFileName;
+        auto canceled = &_canceled;
+        _assembleWatcher.setFuture(QtConcurrent::run([=]() { return manifest.assemble(localFileName, localOffsets, missingBlocksFileName, outputFileName, canceled); }));
+        return;
+    }
+
+    auto range = _ranges.first();
+    QNetworkRequest request(_url);
+    request.setRawHeader("Range", "bytes="+QByteArray::number(range.first)+"-"+QByteArray::number(range.second));
+    _rangeResponseChecked = false;
+    _networkReply = _networkAccessManager->get(request);
+    connect(_networkReply, &QNetworkReply::readyRead, this, &BlockSync::rangeDataReceived);
+    connect(_networkReply, &QNetworkReply::finished, this, &BlockSync::rangeFinished);
+}
+
+
+void BlockSync::rangeDataReceived() {
+    // Paranoid safety checks
+    if (_networkReply.isNull() || _ranges.isEmpty())
+        return;
+    if (_networkReply->error() != QNetworkReply::NoError)
+        return;
+
+    // Before writing the first data, check that the server sends exactly the
+    // range that we asked for. Servers that do not support range requests
+    // send the complete file instead.
+    if (!_rangeResponseChecked) {
+        _rangeResponseChecked = true;
+        auto status = _networkReply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        QRegularExpression contentRangeRegExp("^bytes (\\d+)-(\\d+)/(\\d+|\\*)$");
+        auto match = contentRangeRegExp.match(QString::fromLatin1(_networkReply->rawHeader("Content-Range")));
+        if ((status != 206) || !match.hasMatch()
+                || (match.captured(1).toLongLong() != _ranges.first().first)
+                || (match.captured(2).toLongLong() != _ranges.first().second)) {
+            fail();
+            return;
+        }
+    }
+
+    auto data = _networkReply->readAll();
+    if (_missingBlocksFile.write(data) != data.size()) {
+        fail();
+        return;
+    }
+    _bytesFetched += data.size();
+    setProgress((_bytesToFetch <= 0) ? 100 : static_cast<int>((100.0*_bytesFetched)/_bytesToFetch));
+}
+
+
+void BlockSync::rangeFinished() {
+    // Paranoid safety checks
+    if (_networkReply.isNull() || _ranges.isEmpty())
+        return;
+    if (_networkReply->error() != QNetworkReply::NoError) {
+        fail();
+        return;
+    }
+
+    // Read the last remaining bits of data
+    rangeDataReceived();
+    if (_networkReply.isNull())
+        return;
+    _networkReply->deleteLater();
+    _networkReply = nullptr;
+
+    // Check that the range is complete
+    _ranges.removeFirst();
+    qint64 remainingBytes = 0;
+    foreach(auto range, _ranges)
+        remainingBytes += range.second-range.first+1;
+    if (_bytesFetched != _bytesToFetch-remainingBytes) {
+        fail();
+        return;
+    }
+
+    startRangeRequest();
+}
+
+
+void BlockSync::assembled() {
+    emit finished(_assembleWatcher.result());
+}
+
+
+void BlockSync::fail() {
+    if (!_networkReply.isNull()) {
+        _networkReply->disconnect(this);
+        _networkReply->abort();
+        _networkReply->deleteLater();
+        _networkReply = nullptr;
+    }
+    _missingBlocksFile.close();
+    _missingBlocksFile.remove();
+    emit finished(false);
+}
+
+
+void BlockSync::setProgress(int progress) {
+    if (progress == _progress)
+        return;
+    _progress = progress;
+    emit progressChanged(_progress);
+}
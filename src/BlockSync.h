@@ -0,0 +1,203 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef BLOCKSYNC_H
+#define BLOCKSYNC_H
+
+#include <QFile>
+#include <QFutureWatcher>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QPointer>
+
+#include "BlockManifest.h"
+
+
+/*! \brief Block-level delta update of a file
+ *
+ * This class updates a local file to the version on the server, downloading
+ * only those parts of the file that have changed, in the way zsync does it.
+ * The server publishes a BlockManifest next to the file. The update works as
+ * follows.
+ *
+ * - The manifest is downloaded.
+ *
+ * - The local file is scanned for blocks of the manifest, in a separate
+ *   thread.
+ *
+ * - All blocks that are not found locally are downloaded, using HTTP range
+ *   requests. Neighbouring ranges are merged, to keep the number of requests
+ *   small.
+ *
+ * - The new file is assembled in a separate thread, from local and downloaded
+ *   blocks, and its SHA-256 checksum is compared to the manifest.
+ *
+ * Once done, the signal finished() is emitted. The local file is never
+ * modified; the new version is written to a separate output file.
+ *
+ * Objects of this class are used once. If the update cannot be done (e.g.
+ * because the server does not support range requests, or because most of the
+ * file has changed anyway), finished() is emitted with the parameter 'false'
+ * and the caller is expected to download the complete file instead.
+ */
+
+class BlockSync : public QObject {
+    Q_OBJECT
+
+public:
+    /*! \brief Standard constructor
+     *
+     * @param url URL of the file on the server
+     *
+     * @param manifestURL URL of the BlockManifest for the file on the server
+     *
+     * @param localFileName Name of the local file that holds an older version
+     *
+     * @param outputFileName Name of the file where the new version is written
+     *
+     * @param networkAccessManager Pointer to a QNetworkAccessManager that will
+     * be used for network access. The QNetworkAccessManager needs to survive
+     * the lifetime of this object.
+     *
+     * @param parent The standard QObject parent pointer.
+     */
+    explicit BlockSync(QUrl url, QUrl manifestURL, QString localFileName, QString outputFileName,
+                       QNetworkAccessManager *networkAccessManager, QObject *parent = nullptr);
+
+    // No copy constructor
+    BlockSync(BlockSync const &) = delete;
+
+    // No assign operator
+    BlockSync &operator=(BlockSync const &) = delete;
+
+    // No move constructor
+    BlockSync(BlockSync &&) = delete;
+
+    // No move assignment operator
+    BlockSync &operator=(BlockSync &&) = delete;
+
+    /*! \brief Standard destructor
+     *
+     * The destructor aborts all network requests and removes the temporary
+     * file that holds the downloaded blocks. The output file is not removed.
+     */
+    ~BlockSync() override;
+
+    /*! \brief Download progress
+     *
+     * @returns Percentage of the missing blocks that have been downloaded
+     */
+    int progress() const { return _progress; }
+
+    /*! \brief SHA-256 checksum of the new version
+     *
+     * @returns Checksum of the new version, as stated in the manifest, or an
+     * empty array if the manifest has not been read yet
+     */
+    QByteArray sha256() const { return _manifest.sha256(); }
+
+    /*! \brief Start the update */
+    void start();
+
+    /*! \brief Maximal size of the ranges to download
+     *
+     * If more than this fraction of the file needs to be downloaded, the
+     * update is not done and the caller should download the complete file.
+     */
+    static constexpr double maxFractionToFetch = 0.5;
+
+signals:
+    /*! \brief Download progress
+     *
+     * @param percentage Percentage of the missing blocks that have been
+     * downloaded
+     */
+    void progressChanged(int percentage);
+
+    /*! \brief Update finished
+     *
+     * @param success True if the output file has been written and its checksum
+     * agrees with the manifest
+     */
+    void finished(bool success);
+
+private slots:
+    // Reads the manifest and starts the scan of the local file
+    void manifestFinished();
+
+    // Computes the ranges that need to be downloaded, once the scan of the
+    // local file is finished
+    void blocksFound();
+
+    // Requests the next range, or starts the assembly if there are no more
+    // ranges to download
+    void startRangeRequest();
+
+    // Checks that the server sends the right range, and appends the data to
+    // the missing blocks file
+    void rangeDataReceived();
+
+    // Checks that the range is complete, and requests the next one
+    void rangeFinished();
+
+    // Emits finished() once the output file has been assembled
+    void assembled();
+
+private:
+    // Stops the update and emits finished(false)
+    void fail();
+
+    // Sets _progress and emits progressChanged() if appropriate
+    void setProgress(int progress);
+
+    // Blocks that are not found locally are downloaded. Gaps of at most that
+    // many blocks between two ranges are downloaded as well, in order to save
+    // requests.
+    static const int maxGapInBlocks = 4;
+
+    QPointer<QNetworkAccessManager> _networkAccessManager;
+    QUrl _url;
+    QUrl _manifestURL;
+    QString _localFileName;
+    QString _outputFileName;
+
+    BlockManifest _manifest;
+    QVector<qint64> _localOffsets;
+
+    // Byte ranges that remain to be downloaded. Each entry contains the first
+    // and the last byte of the range.
+    QList<QPair<qint64, qint64>> _ranges;
+    qint64 _bytesToFetch{0};
+    qint64 _bytesFetched{0};
+    bool _rangeResponseChecked{false};
+    int _progress{0};
+
+    // All blocks that are downloaded, concatenated in the order of the blocks
+    QFile _missingBlocksFile;
+
+    QPointer<QNetworkReply> _networkReply;
+    QFutureWatcher<QVector<qint64>> _findBlocksWatcher;
+    QFutureWatcher<bool> _assembleWatcher;
+
+    // Set by the destructor, to stop the threads started by this class
+    QAtomicInt _canceled;
+};
+
+#endif
@@ -18,12 +18,25 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#include <QCryptographicHash>
+#include <QDebug>
 #include <QDir>
 #include <QFileInfo>
-#include <QLockFile>
+#include <QLoggingCategory>
+#include <QRegularExpression>
+#include <QSettings>
+#include <QtConcurrent/QtConcurrentRun>
 #include <utility>
 
 #include "Downloadable.h"
+#include "FileView.h"
+#include "MBTiles.h"
+
+
+// Diagnostic messages about downloads. They are off by default and can be
+// enabled with QT_LOGGING_RULES="enroute.downloadable.debug=true".
+Q_LOGGING_CATEGORY(downloadableLog, "enroute.downloadable", QtWarningMsg)
+
 
 Downloadable::Downloadable(QUrl url, const QString &fileName,
                            QNetworkAccessManager *networkAccessManager, QObject *parent)
@@ -41,20 +54,32 @@ Downloadable::Downloadable(QUrl url, const QString &fileName,
     connect(this, &Downloadable::fileContentChanged, this, &Downloadable::infoTextChanged);
     connect(this, &Downloadable::downloadingChanged, this, &Downloadable::infoTextChanged);
     connect(this, &Downloadable::downloadProgressChanged, this, &Downloadable::infoTextChanged);
+    connect(this, &Downloadable::queuedChanged, this, &Downloadable::infoTextChanged);
+
+    _retryTimer.setSingleShot(true);
+    connect(&_retryTimer, &QTimer::timeout, this, [this]() {
+        if (!startNetworkRequest())
+            emit downloadingChanged();
+    });
+    connect(&_optimizationWatcher, &QFutureWatcher<bool>::finished, this, &Downloadable::optimizationFinished);
 }
 
 
 Downloadable::~Downloadable() {
-    // Free all ressources
+    // Free all ressources. The partially downloaded file is kept, so that the
+    // download can be resumed later.
     delete _networkReplyDownloadFile;
     delete _networkReplyDownloadHeader;
-    delete _saveFile;
+    delete _partFile;
+    delete _blockSync;
 }
 
 
 QString Downloadable::infoText() const {
     if (downloading())
         return tr("downloading … %1% complete").arg(_downloadProgress);
+    if (_queued)
+        return tr("waiting for download");
 
     QString displayText;
     if (hasFile()) {
@@ -83,12 +108,10 @@ QByteArray Downloadable::fileContent() const {
     // Paranoid safety checks
     Q_ASSERT(!_fileName.isEmpty());
 
-    QFile file(_fileName);
-    if (!file.exists())
+    FileView view(_fileName);
+    if (!view.isValid())
         return QByteArray();
-
-    file.open(QIODevice::ReadOnly);
-    return file.readAll();
+    return QByteArray(view.data(), static_cast<int>(view.size()));
 }
 
 
@@ -131,6 +154,32 @@ void Downloadable::setRemoteFileSize(qint64 size) {
 }
 
 
+void Downloadable::setPriority(int priority)
+{
+    if (priority == _priority)
+        return;
+    _priority = priority;
+    emit priorityChanged();
+}
+
+
+void Downloadable::setQueued(bool queued)
+{
+    if (queued == _queued)
+        return;
+
+    // Save old value to see if anything changed
+    bool oldUpdatable = updatable();
+
+    _queued = queued;
+
+    // Emit signals as appropriate
+    if (oldUpdatable != updatable())
+        emit updatableChanged();
+    emit queuedChanged();
+}
+
+
 void Downloadable::setSection(QString sectionName)
 {
     if (sectionName == _section)
@@ -141,7 +190,7 @@ void Downloadable::setSection(QString sectionName)
 
 
 bool Downloadable::updatable() const {
-    if (downloading())
+    if (downloading() || _queued)
         return false;
     if (!QFile::exists(_fileName))
         return false;
@@ -155,6 +204,10 @@ bool Downloadable::updatable() const {
 
 
 void Downloadable::deleteFile() {
+    // Partially downloaded data is no longer wanted
+    if (!downloading())
+        discardPartialFile();
+
     // If the local file does not exist, there is nothing to do
     if (!QFile::exists(_fileName))
         return;
@@ -163,10 +216,11 @@ void Downloadable::deleteFile() {
     bool oldUpdatable = updatable();
 
     emit aboutToChangeFile(_fileName);
-    QLockFile lockFile(_fileName + ".lock");
+    FileLock lockFile(_fileName);
     lockFile.lock();
     QFile::remove(_fileName);
     lockFile.unlock();
+    QSettings().remove(settingsKey(_fileName));
     emit hasFileChanged();
     emit fileContentChanged();
 
@@ -186,8 +240,12 @@ void Downloadable::startInfoDownload() {
     if (!_networkReplyDownloadHeader.isNull())
         return;
 
-    // Start the download process for the remote file info
-    _networkReplyDownloadHeader = _networkAccessManager->head(QNetworkRequest(_url));
+    // Start the download process for the remote file info. If the local file
+    // exists, the server only needs to confirm that it is current.
+    QNetworkRequest request(_url);
+    if (hasFile())
+        setConditionalHeaders(request);
+    _networkReplyDownloadHeader = _networkAccessManager->head(request);
     connect(_networkReplyDownloadHeader, &QNetworkReply::finished, this,
             &Downloadable::downloadHeaderFinished);
 }
@@ -208,30 +266,44 @@ void Downloadable::startFileDownload() {
     auto oldDownloadProgress =_downloadProgress;
     auto oldIsDownloading = downloading();
 
-    // Clear temporary file
-    delete _saveFile;
-
     // Create directory that will hold the local file, if it does not yet exist
     QDir dir(QFileInfo(_fileName).dir());
     if (!dir.exists())
         dir.mkpath(".");
 
-    // Copy the temporary file to the local file
-    _saveFile = new QSaveFile(_fileName, this);
-    _saveFile->open(QIODevice::WriteOnly);
+    // If the local file exists and there is a delta for the installed version,
+    // download the delta instead of the complete file. The installed version
+    // is the newest version that was available when the local file was
+    // written.
+    _downloadingDelta = false;
+    auto localFileDate = QFileInfo(_fileName).lastModified();
+    if (hasFile() && _fileName.endsWith(".mbtiles", Qt::CaseInsensitive) && _remoteFileDate.isValid() && (localFileDate < _remoteFileDate)) {
+        auto it = _deltaURLs.upperBound(localFileDate);
+        if (it != _deltaURLs.constBegin()) {
+            --it;
+            _deltaURL = it.value();
+            _downloadingDelta = true;
+        }
+    }
 
-    // Start download
-    QNetworkRequest request(_url);
-    _networkReplyDownloadFile = _networkAccessManager->get(request);
-    connect(_networkReplyDownloadFile, &QNetworkReply::finished, this,
-            &Downloadable::downloadFileFinished);
-    connect(_networkReplyDownloadFile, &QNetworkReply::readyRead, this,
-            &Downloadable::downloadFilePartialDataReceiver);
-    connect(_networkReplyDownloadFile, &QNetworkReply::downloadProgress, this,
-            &Downloadable::downloadFileProgressReceiver);
-    connect(_networkReplyDownloadFile,
-            static_cast<void (QNetworkReply::*)(QNetworkReply::NetworkError)>(&QNetworkReply::error),
-            this, &Downloadable::downloadFileErrorReceiver);
+    // Complete downloads use a peer on the local network if there is one whose
+    // copy has the right checksum, and otherwise the compressed copy of the
+    // file, if there is one
+    _downloadingFromPeer = !_downloadingDelta && _peerURL.isValid() && !_expectedSHA256.isEmpty();
+    _downloadingCompressed = !_downloadingDelta && !_downloadingFromPeer && _compressedURL.isValid();
+
+    // Start download. If there is no delta and no peer, but a block manifest,
+    // try to download only those parts of the file that have changed.
+    setQueued(false);
+    _retryCount = 0;
+    if (hasFile() && !_downloadingDelta && !_downloadingFromPeer && _blockManifestURL.isValid() && _remoteFileDate.isValid() && (localFileDate < _remoteFileDate)) {
+        _blockSync = new BlockSync(_url, _blockManifestURL, _fileName, _fileName+".sync.part", _networkAccessManager, this);
+        connect(_blockSync, &BlockSync::progressChanged, this, [this](int percentage) { _downloadProgress = percentage; });
+        connect(_blockSync, &BlockSync::progressChanged, this, &Downloadable::downloadProgressChanged);
+        connect(_blockSync, &BlockSync::finished, this, &Downloadable::blockSyncFinished);
+        _blockSync->start();
+    } else
+        startNetworkRequest();
     _downloadProgress = 0;
 
     // Emit signals as appropriate
@@ -250,6 +322,9 @@ void Downloadable::stopFileDownload() {
     if (_networkAccessManager.isNull())
         return;
 
+    // Remove the Downloadable from any download queue
+    setQueued(false);
+
     // Do stop a new download if none is already running
     if (!downloading())
         return;
@@ -257,23 +332,296 @@ void Downloadable::stopFileDownload() {
     // Save old value to see if anything changed
     bool oldUpdatable = updatable();
 
-    // Stop the download
+    // Stop the download. The partial file is kept, so that the download can be
+    // resumed later.
+    _retryTimer.stop();
+    releaseNetworkReply();
+    delete _partFile;
+    if (!_blockSync.isNull()) {
+        // The destructor of the BlockSync waits for its threads, which might
+        // still write to the output file
+        _blockSync->disconnect(this);
+        delete _blockSync;
+        QFile::remove(_fileName+".sync.part");
+    }
+
+    // Emit signals as appropriate
+    if (oldUpdatable != updatable())
+        emit updatableChanged();
+    emit downloadingChanged();
+}
+
+
+bool Downloadable::startNetworkRequest() {
+    // Paranoid safety checks
+    if (_networkAccessManager.isNull())
+        return false;
+    releaseNetworkReply();
+
+    // Open the partial file, which might contain data from an earlier attempt
+    if (_partFile.isNull()) {
+        _partFile = new AsyncFileWriter(partialFileName(), this);
+        connect(_partFile, &AsyncFileWriter::bytesWritten, this, [this]() {
+            if (!_networkReplyDownloadFile.isNull())
+                downloadFilePartialDataReceiver();
+        });
+        if (!_partFile->open()) {
+            delete _partFile;
+            emit error(objectName(), tr("the partially downloaded file cannot be written"));
+            return false;
+        }
+    }
+    _partialResponseChecked = false;
+    _expectedFileSize = -1;
+    _resumeOffset = 0;
+    _decompressor.reset();
+    _sha256.reset();
+
+    // If there is partial data, ask the server for the remaining part. The
+    // If-Range header guarantees that the server sends the complete file if
+    // the file on the server has changed in the meantime. Downloads of
+    // compressed data always start from the beginning.
+    QUrl url = _url;
+    if (_downloadingDelta)
+        url = _deltaURL;
+    else if (_downloadingFromPeer)
+        url = _peerURL;
+    else if (_downloadingCompressed)
+        url = _compressedURL;
+    QNetworkRequest request(url);
+    auto validator = partialFileValidator();
+    if ((_partFile->size() > 0) && !validator.isEmpty() && !_downloadingCompressed) {
+        request.setRawHeader("Range", "bytes="+QByteArray::number(_partFile->size())+"-");
+        request.setRawHeader("If-Range", validator);
+        _resumeOffset = _partFile->size();
+    } else {
+        _partFile->resize(0);
+
+        // If the local file exists, ask the server to send the file only if it
+        // differs from the local file. The validator belongs to the remote
+        // server and means nothing to a peer.
+        if (hasFile() && !_downloadingDelta && !_downloadingFromPeer)
+            setConditionalHeaders(request);
+    }
+    _responseValidator.clear();
+
+    _networkReplyDownloadFile = _networkAccessManager->get(request);
+    _networkReplyDownloadFile->setReadBufferSize(readBufferSize);
+    connect(_networkReplyDownloadFile, &QNetworkReply::finished, this,
+            &Downloadable::downloadFileFinished);
+    connect(_networkReplyDownloadFile, &QNetworkReply::readyRead, this,
+            &Downloadable::downloadFilePartialDataReceiver);
+    connect(_networkReplyDownloadFile, &QNetworkReply::downloadProgress, this,
+            &Downloadable::downloadFileProgressReceiver);
+    connect(_networkReplyDownloadFile,
+            static_cast<void (QNetworkReply::*)(QNetworkReply::NetworkError)>(&QNetworkReply::error),
+            this, &Downloadable::downloadFileErrorReceiver);
+    return true;
+}
+
+
+void Downloadable::releaseNetworkReply() {
+    if (_networkReplyDownloadFile.isNull())
+        return;
+
+    // Disconnect first, so that the reply does not call any of our slots while
+    // it is being deleted
+    _networkReplyDownloadFile->disconnect(this);
     _networkReplyDownloadFile->deleteLater();
     _networkReplyDownloadFile = nullptr;
-    delete _saveFile;
+}
+
+
+bool Downloadable::retryDownload(bool discardPartialData) {
+    if (_retryCount >= maxRetries)
+        return false;
+
+    if (discardPartialData && !_partFile.isNull())
+        _partFile->resize(0);
+
+    // Try again after a delay that doubles with every attempt
+    releaseNetworkReply();
+    _retryTimer.start(firstRetryDelayInMS << _retryCount);
+    _retryCount++;
+    return true;
+}
+
+
+QString Downloadable::partialFileName() const {
+    if (_downloadingDelta)
+        return _fileName+".delta.part";
+    return _fileName+".part";
+}
+
+
+void Downloadable::setConditionalHeaders(QNetworkRequest& request) const {
+    auto validator = QSettings().value(settingsKey(_fileName)).toByteArray();
+    if (validator.isEmpty())
+        return;
+    if (validator.startsWith('"'))
+        request.setRawHeader("If-None-Match", validator);
+    else
+        request.setRawHeader("If-Modified-Since", validator);
+}
+
+
+void Downloadable::localFileConfirmed() {
+    // Save old value to see if anything changed
+    bool oldIsUpdatable = updatable();
+
+    // Delete the data structures for the download
+    releaseNetworkReply();
+    discardPartialFile();
+
+    // The local file is as new as the remote file. Update its modification
+    // time, which is taken to be the download time.
+    QFile file(_fileName);
+    if (file.open(QIODevice::Append))
+        file.setFileTime(QDateTime::currentDateTimeUtc(), QFileDevice::FileModificationTime);
+    file.close();
 
     // Emit signals as appropriate
-    if (oldUpdatable != updatable())
+    if (_downloadProgress != 100) {
+        _downloadProgress = 100;
+        emit downloadProgressChanged(_downloadProgress);
+    }
+    emit localFileConfirmedCurrent();
+    if (oldIsUpdatable != updatable())
         emit updatableChanged();
     emit downloadingChanged();
 }
 
 
+void Downloadable::setDeltaURLs(const QMap<QDateTime, QUrl>& deltaURLs) {
+    _deltaURLs = deltaURLs;
+}
+
+
+QString Downloadable::settingsKey(const QString& partialFileName) {
+    return "Downloadable/"+QCryptographicHash::hash(partialFileName.toUtf8(), QCryptographicHash::Md5).toHex()+"/validator";
+}
+
+
+QByteArray Downloadable::partialFileValidator() const {
+    return QSettings().value(settingsKey(partialFileName())).toByteArray();
+}
+
+
+void Downloadable::discardPartialFile() {
+    delete _partFile;
+
+    QSettings settings;
+    foreach(auto name, QStringList({_fileName+".part", _fileName+".delta.part", _fileName+".sync.part"})) {
+        QFile::remove(name);
+        settings.remove(settingsKey(name));
+    }
+}
+
+
+bool Downloadable::checkPartialResponse() {
+    auto status = _networkReplyDownloadFile->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+
+    if (status == 206) {
+        // The server sends the remaining part of the file. Check that it
+        // begins exactly where our partial data ends.
+        QRegularExpression contentRangeRegExp("^bytes (\\d+)-(\\d+)/(\\d+|\\*)$");
+        auto match = contentRangeRegExp.match(QString::fromLatin1(_networkReplyDownloadFile->rawHeader("Content-Range")));
+        if (!match.hasMatch())
+            return false;
+        if (match.captured(1).toLongLong() != _partFile->size())
+            return false;
+        if (match.captured(3) != "*")
+            _expectedFileSize = match.captured(3).toLongLong();
+    } else {
+        // The server sends the complete file, so our partial data is useless
+        _partFile->resize(0);
+        auto contentLength = _networkReplyDownloadFile->header(QNetworkRequest::ContentLengthHeader);
+        if (contentLength.isValid())
+            _expectedFileSize = contentLength.toLongLong();
+    }
+    _resumeOffset = _partFile->size();
+    _partFileSize = _resumeOffset;
+
+    // If the download is resumed, the hash must include the data that we
+    // already have. This is read once, when the download resumes.
+    if (!_expectedSHA256.isEmpty() && (_resumeOffset > 0)) {
+        _partFile->flush();
+        QFile partialData(partialFileName());
+        if (!partialData.open(QIODevice::ReadOnly))
+            return false;
+        while(partialData.pos() < _resumeOffset) {
+            auto chunk = partialData.read(qMin(_resumeOffset-partialData.pos(), static_cast<qint64>(1024*1024)));
+            if (chunk.isEmpty())
+                return false;
+            _sha256.addData(chunk);
+        }
+    }
+
+    // Remember the validator of the file we are downloading. Prefer the ETag,
+    // which is more precise than the modification date.
+    QByteArray validator = _networkReplyDownloadFile->rawHeader("ETag");
+    if (validator.isEmpty() || validator.startsWith("W/"))
+        validator = _networkReplyDownloadFile->rawHeader("Last-Modified");
+    _responseValidator = validator;
+
+    // For compressed data, the size announced by the server is the compressed
+    // size. Integrity is checked by the decompressor instead, and there is no
+    // point in storing a validator because the download cannot be resumed.
+    if (_downloadingCompressed) {
+        _expectedFileSize = -1;
+        QSettings().remove(settingsKey(partialFileName()));
+        return true;
+    }
+
+    // Store the validator with the partial data, so that the download can be
+    // resumed later
+    QSettings settings;
+    if (validator.isEmpty())
+        settings.remove(settingsKey(partialFileName()));
+    else
+        settings.setValue(settingsKey(partialFileName()), validator);
+
+    return true;
+}
+
+
 void Downloadable::downloadFileErrorReceiver(QNetworkReply::NetworkError code) {
     // Do nothing if there is no error
     if (code == QNetworkReply::NoError)
         return;
 
+    // Peers are not retried
+    if (_downloadingFromPeer) {
+        fallBackFromPeer();
+        return;
+    }
+
+    // If the server cannot satisfy our range request, the partial data does not
+    // match the file on the server. Start again from the beginning.
+    if (!_networkReplyDownloadFile.isNull()) {
+        auto status = _networkReplyDownloadFile->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        if ((status == 416) && retryDownload(true))
+            return;
+    }
+
+    // If the error is likely temporary, try again later. The data received so
+    // far is kept.
+    switch (code) {
+    case QNetworkReply::RemoteHostClosedError:
+    case QNetworkReply::TimeoutError:
+    case QNetworkReply::TemporaryNetworkFailureError:
+    case QNetworkReply::NetworkSessionFailedError:
+    case QNetworkReply::ProxyConnectionClosedError:
+    case QNetworkReply::ProxyTimeoutError:
+    case QNetworkReply::ServiceUnavailableError:
+    case QNetworkReply::UnknownNetworkError:
+        if (retryDownload(false))
+            return;
+        break;
+    default:
+        break;
+    }
+
     // Stop the download
     stopFileDownload();
 
@@ -442,7 +790,7 @@ void Downloadable::downloadFileErrorReceiver(QNetworkReply::NetworkError code) {
 void Downloadable::downloadFileFinished() {
     // Paranoid safety checks
     //  Q_ASSERT(!_networkReplyDownloadFile.isNull() && !_tmpFile.isNull());
-    if (_networkReplyDownloadFile.isNull() || _saveFile.isNull()) {
+    if (_networkReplyDownloadFile.isNull() || _partFile.isNull()) {
         stopFileDownload();
         return;
     }
@@ -451,8 +799,52 @@ void Downloadable::downloadFileFinished() {
         return;
     }
 
-    // Read the last remaining bits of data, then close the temporary file
+    // The server confirms that the local file is current
+    if (_networkReplyDownloadFile->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() == 304) {
+        localFileConfirmed();
+        return;
+    }
+
+    // Wait until all queued data is written, then read the last remaining
+    // bits of data
+    _partFile->flush();
     downloadFilePartialDataReceiver();
+    if (_networkReplyDownloadFile.isNull() || _partFile.isNull())
+        return;
+
+    // Check that all data could be written
+    _partFile->flush();
+    if (_partFile->hasError()) {
+        stopFileDownload();
+        emit error(objectName(), tr("the partially downloaded file cannot be written"));
+        return;
+    }
+    qCDebug(downloadableLog) << objectName() << "peak write buffer" << _partFile->peakPendingBytes() << "bytes";
+
+    // Integrity check: if the server told us the size of the file, then the
+    // data we have must have exactly that size. Compressed data must end with
+    // the end of the compressed stream. If the checksum of the file is known,
+    // the hash of the data must agree. Otherwise, start again and leave the
+    // local file untouched.
+    if (((_expectedFileSize >= 0) && (_partFile->size() != _expectedFileSize))
+            || (_downloadingCompressed && !_decompressor.isFinished())
+            || (!_downloadingDelta && !_expectedSHA256.isEmpty() && (_sha256.result() != _expectedSHA256))) {
+        if (_downloadingFromPeer) {
+            fallBackFromPeer();
+            return;
+        }
+        if (retryDownload(true))
+            return;
+        stopFileDownload();
+        discardPartialFile();
+        emit error(objectName(), tr("the downloaded file is incomplete or corrupted"));
+        return;
+    }
+
+    if (_downloadingCompressed)
+        qCDebug(downloadableLog) << objectName() << "decompressed" << _decompressor.bytesIn() << "to"
+                 << _decompressor.bytesOut() << "bytes, compression ratio" << _decompressor.compressionRatio()
+                 << ", throughput" << _decompressor.throughputInBytesPerSecond()/(1024.0*1024.0) << "MiB/s";
 
     // Download is now finished to 100%
     if (_downloadProgress != 100) {
@@ -464,18 +856,63 @@ void Downloadable::downloadFileFinished() {
     bool oldIsUpdatable = updatable();
     bool oldHasLocalFile = hasFile();
 
-    // Copy the temporary file to the local file
-    emit aboutToChangeFile(_fileName);
-    QLockFile lockFile(_fileName + ".lock");
-    lockFile.lock();
-    _saveFile->commit();
-    lockFile.unlock();
-    emit fileContentChanged();
+    // Move the partial file to the local file. A delta is applied to a copy
+    // of the local file, so that the local file is only replaced if the delta
+    // could be applied.
+    _partFile->close();
+    auto newFileName = partialFileName();
+    bool success = true;
+    if (_downloadingDelta) {
+        newFileName = _fileName+".patched.part";
+        QFile::remove(newFileName);
+        success = QFile::copy(_fileName, newFileName) && MBTiles::applyDelta(newFileName, partialFileName());
+
+        // The delta checks only the tiles that it changes. If the checksum of
+        // the new version is known, make sure that the patched file is exactly
+        // that version.
+        if (success && !_expectedSHA256.isEmpty()) {
+            QFile patchedFile(newFileName);
+            QCryptographicHash sha256(QCryptographicHash::Sha256);
+            success = patchedFile.open(QIODevice::ReadOnly) && sha256.addData(&patchedFile) && (sha256.result() == _expectedSHA256);
+        }
+        if (!success)
+            QFile::remove(newFileName);
+    }
+    if (success) {
+        emit aboutToChangeFile(_fileName);
+        FileLock lockFile(_fileName);
+        lockFile.lock();
+        QFile::remove(_fileName);
+        QFile::rename(newFileName, _fileName);
+        lockFile.unlock();
+        emit fileContentChanged();
+    }
+
+    // Remember the validator of the local file, for later revalidation. After
+    // a delta has been applied, the local file does not correspond to any
+    // validator sent by the server. Validators sent by peers mean nothing to
+    // the server.
+    if (success) {
+        if (!_downloadingDelta && !_downloadingFromPeer && !_responseValidator.isEmpty())
+            QSettings().setValue(settingsKey(_fileName), _responseValidator);
+        else
+            QSettings().remove(settingsKey(_fileName));
+    }
 
     // Delete the data structures for the download
-    delete _saveFile;
-    _networkReplyDownloadFile->deleteLater();
-    _networkReplyDownloadFile = nullptr;
+    discardPartialFile();
+    releaseNetworkReply();
+
+    // If the delta could not be applied, the local file is unchanged.
+    // Download the complete file instead.
+    if (!success) {
+        _downloadingDelta = false;
+        _downloadingCompressed = _compressedURL.isValid();
+        _deltaURLs.clear();
+        _retryCount = 0;
+        startNetworkRequest();
+        return;
+    }
 
     // Emit signals as appropriate
     if (oldIsUpdatable != updatable())
@@ -483,13 +920,207 @@ void Downloadable::downloadFileFinished() {
     if (oldHasLocalFile != hasFile())
         emit hasFileChanged();
     emit downloadingChanged();
+
+    startOptimization();
+}
+
+
+void Downloadable::blockSyncFinished(bool success) {
+    // Paranoid safety checks
+    if (_blockSync.isNull())
+        return;
+    auto manifestSHA256 = _blockSync->sha256();
+    _blockSync->disconnect(this);
+    _blockSync->deleteLater();
+    _blockSync = nullptr;
+
+    // The BlockSync checks its output against the manifest. If the checksum
+    // of the new version is also known from the list of maps, the manifest
+    // must describe that version.
+    if (success && !_expectedSHA256.isEmpty() && !manifestSHA256.isEmpty() && (manifestSHA256 != _expectedSHA256)) {
+        qWarning() << "Downloadable: block manifest of" << _fileName << "does not match the expected checksum";
+        success = false;
+    }
+
+    // If the BlockSync failed, the local file is unchanged. Download the
+    // complete file instead.
+    if (!success) {
+        QFile::remove(_fileName+".sync.part");
+        _blockManifestURL = QUrl();
+        _downloadProgress = 0;
+        emit downloadProgressChanged(_downloadProgress);
+        startNetworkRequest();
+        return;
+    }
+
+    // Save old value to see if anything changed
+    bool oldIsUpdatable = updatable();
+
+    // Move the output of the BlockSync to the local file
+    emit aboutToChangeFile(_fileName);
+    FileLock lockFile(_fileName);
+    lockFile.lock();
+    QFile::remove(_fileName);
+    QFile::rename(_fileName+".sync.part", _fileName);
+    lockFile.unlock();
+    QSettings().remove(settingsKey(_fileName));
+    emit fileContentChanged();
+
+    // Emit signals as appropriate
+    if (_downloadProgress != 100) {
+        _downloadProgress = 100;
+        emit downloadProgressChanged(_downloadProgress);
+    }
+    if (oldIsUpdatable != updatable())
+        emit updatableChanged();
+    emit downloadingChanged();
+
+    startOptimization();
+}
+
+
+void Downloadable::fallBackFromPeer()
+{
+    qCDebug(downloadableLog) << objectName() << "cannot download from peer" << _peerURL << ", using the server instead";
+
+    // The partial data from the peer cannot be resumed from the server,
+    // because the server does not know the validator of the peer
+    _peerURL = QUrl();
+    _downloadingFromPeer = false;
+    _downloadingCompressed = _compressedURL.isValid();
+    _retryCount = 0;
+    if (!_partFile.isNull())
+        _partFile->resize(0);
+    QSettings().remove(settingsKey(partialFileName()));
+    startNetworkRequest();
+}
+
+
+void Downloadable::setOptimizeMBTiles(bool optimize)
+{
+    if (optimize == _optimizeMBTiles)
+        return;
+    _optimizeMBTiles = optimize;
+    if (!downloading())
+        startOptimization();
+}
+
+
+void Downloadable::setMBTilesRegion(const QVector<QRectF>& boxes, int minZoom, int maxZoom)
+{
+    if ((boxes == _regionBoxes) && (minZoom == _regionMinZoom) && (maxZoom == _regionMaxZoom))
+        return;
+    _regionBoxes = boxes;
+    _regionMinZoom = minZoom;
+    _regionMaxZoom = maxZoom;
+    if (!downloading())
+        startOptimization();
+}
+
+
+void Downloadable::startOptimization()
+{
+    if ((!_optimizeMBTiles && _regionBoxes.isEmpty()) || !_fileName.endsWith(".mbtiles", Qt::CaseInsensitive))
+        return;
+    if (_optimizationWatcher.isRunning() || !hasFile())
+        return;
+
+    _optimizationBase = QFileInfo(_fileName).lastModified();
+    auto fileName = _fileName;
+    auto optimizedFileName = _fileName+".optimized.part";
+    auto boxes = _regionBoxes;
+    auto minZoom = _regionMinZoom;
+    auto maxZoom = _regionMaxZoom;
+    _optimizationWatcher.setFuture(QtConcurrent::run([fileName, optimizedFileName, boxes, minZoom, maxZoom]() {
+        QFile::remove(optimizedFileName);
+        QString errorMessage;
+        if (!boxes.isEmpty()) {
+            if (MBTiles::metadataValue(fileName, MBTiles::regionMetadataName) == MBTiles::regionDescription(boxes, minZoom, maxZoom))
+                return false;
+            if (!MBTiles::extract(fileName, optimizedFileName, boxes, minZoom, maxZoom, &errorMessage)) {
+                qWarning() << "Downloadable: cannot extract region from" << fileName << ":" << errorMessage;
+                return false;
+            }
+            return true;
+        }
+        if (MBTiles::isOptimized(fileName))
+            return false;
+        if (!MBTiles::optimize(fileName, optimizedFileName, &errorMessage)) {
+            qWarning() << "Downloadable: cannot optimize" << fileName << ":" << errorMessage;
+            return false;
+        }
+        return true;
+    }));
+}
+
+
+void Downloadable::optimizationFinished()
+{
+    auto optimizedFileName = _fileName+".optimized.part";
+
+    // If the local file has been changed or deleted while the optimization
+    // ran, or if a download is running that will change it, the optimized copy
+    // is outdated
+    if (!_optimizationWatcher.result() || downloading() || !hasFile()
+            || (QFileInfo(_fileName).lastModified() != _optimizationBase)) {
+        QFile::remove(optimizedFileName);
+        return;
+    }
+
+    // The optimized copy holds the same version of the data as the local
+    // file. It takes over the modification time of the local file, which
+    // updatable() and the choice of deltas rely on.
+    QFile optimizedFile(optimizedFileName);
+    if (!optimizedFile.open(QIODevice::Append) || !optimizedFile.setFileTime(_optimizationBase, QFileDevice::FileModificationTime)) {
+        qWarning() << "Downloadable: cannot set modification time of" << optimizedFileName;
+        optimizedFile.close();
+        QFile::remove(optimizedFileName);
+        return;
+    }
+    optimizedFile.close();
+
+    // Replace the local file by the optimized copy. If any step fails, the
+    // optimized copy is deleted.
+    FileLock lockFile(_fileName);
+    if (!lockFile.lock()) {
+        qWarning() << "Downloadable: cannot lock" << _fileName;
+        QFile::remove(optimizedFileName);
+        return;
+    }
+    bool oldIsUpdatable = updatable();
+    emit aboutToChangeFile(_fileName);
+    if (!QFile::remove(_fileName)) {
+        qWarning() << "Downloadable: cannot replace" << _fileName << "by optimized copy";
+        lockFile.unlock();
+        QFile::remove(optimizedFileName);
+        return;
+    }
+    if (!QFile::rename(optimizedFileName, _fileName)) {
+        // The local file is gone
+        lockFile.unlock();
+        QFile::remove(optimizedFileName);
+        QSettings().remove(settingsKey(_fileName));
+        emit hasFileChanged();
+        if (oldIsUpdatable != updatable())
+            emit updatableChanged();
+        emit error(objectName(), tr("the optimized file cannot be written"));
+        return;
+    }
+    lockFile.unlock();
+    emit fileContentChanged();
+    if (oldIsUpdatable != updatable())
+        emit updatableChanged();
 }
 
 
 void Downloadable::downloadFileProgressReceiver(qint64 bytesReceived, qint64 bytesTotal) {
+    // If a download is resumed, the numbers refer to the remaining part only
+    bytesReceived += _resumeOffset;
+    bytesTotal += _resumeOffset;
+
     auto oldDownloadProgress = _downloadProgress ;
     _downloadProgress =
-            (bytesTotal == 0) ? 0 : static_cast<int>((100.0 * bytesReceived) / bytesTotal);
+            (bytesTotal <= 0) ? 0 : static_cast<int>((100.0 * bytesReceived) / bytesTotal);
     if (_downloadProgress != oldDownloadProgress)
         emit downloadProgressChanged(_downloadProgress);
 }
@@ -497,16 +1128,59 @@ void Downloadable::downloadFileProgressReceiver(qint64 bytesReceived, qint64 byt
 
 void Downloadable::downloadFilePartialDataReceiver() {
     // Paranoid safety checks
-    Q_ASSERT(!_networkReplyDownloadFile.isNull() && !_saveFile.isNull());
-    if (_networkReplyDownloadFile.isNull() || _saveFile.isNull()) {
+    Q_ASSERT(!_networkReplyDownloadFile.isNull() && !_partFile.isNull());
+    if (_networkReplyDownloadFile.isNull() || _partFile.isNull()) {
         stopFileDownload();
         return;
     }
     if (_networkReplyDownloadFile->error() != QNetworkReply::NoError)
         return;
 
-    // Write all available data to the temporary file
-    _saveFile->write(_networkReplyDownloadFile->readAll());
+    // Before writing the first data, check that the reply fits the partial
+    // data that we already have
+    if (!_partialResponseChecked) {
+        _partialResponseChecked = true;
+        if (!checkPartialResponse()) {
+            if (!retryDownload(true)) {
+                stopFileDownload();
+                discardPartialFile();
+                emit error(objectName(), tr("the server response does not fit the partially downloaded file"));
+            }
+            return;
+        }
+    }
+
+    // If too much data is waiting to be written, leave the data in the read
+    // buffer of the reply. This method is called again once data has been
+    // written.
+    if (_partFile->pendingBytes() > maxPendingWriteBytes)
+        return;
+
+    // Queue all available data for writing to the partial file, decompressing
+    // it if necessary. Since we have received data, the connection works and
+    // we reset the retry counter.
+    auto data = _networkReplyDownloadFile->readAll();
+    if (data.isEmpty())
+        return;
+    if (_downloadingCompressed) {
+        QByteArray decompressedData;
+        if (!_decompressor.decompress(data, decompressedData)) {
+            if (!retryDownload(true)) {
+                stopFileDownload();
+                discardPartialFile();
+                emit error(objectName(), tr("the downloaded file is incomplete or corrupted"));
+            }
+            return;
+        }
+        data = decompressedData;
+    }
+    if (!_expectedSHA256.isEmpty())
+        _sha256.addData(data);
+    _partFile->write(data);
+    if (!_downloadingDelta)
+        emit downloadDataReceived(_fileName, _partFileSize, data);
+    _partFileSize += data.size();
+    _retryCount = 0;
 }
 
 
@@ -515,9 +1189,20 @@ void Downloadable::downloadHeaderFinished() {
     Q_ASSERT(!_networkReplyDownloadHeader.isNull());
     if (_networkReplyDownloadHeader.isNull())
         return;
+    _networkReplyDownloadHeader->deleteLater();
     if (_networkReplyDownloadHeader->error() != QNetworkReply::NoError)
         return;
 
+    // If the server confirms that the local file is current, the remote file
+    // has the date and size of the local file
+    if (_networkReplyDownloadHeader->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() == 304) {
+        QFileInfo info(_fileName);
+        setRemoteFileDate(info.lastModified());
+        setRemoteFileSize(info.size());
+        emit localFileConfirmedCurrent();
+        return;
+    }
+
     // Save old value to see if anything changed
     bool oldUpdatable = updatable();
 
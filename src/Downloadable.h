@@ -21,11 +21,18 @@
 #ifndef DOWNLOADABLE_H
 #define DOWNLOADABLE_H
 
+#include <QCryptographicHash>
 #include <QFile>
 #include <QFileInfo>
+#include <QFutureWatcher>
 #include <QNetworkReply>
 #include <QPointer>
-#include <QSaveFile>
+#include <QRectF>
+#include <QTimer>
+
+#include "AsyncFileWriter.h"
+#include "BlockSync.h"
+#include "GzipDecompressor.h"
 
 /*! \brief Base class for all downloadable objects
 
@@ -37,6 +44,14 @@
   - Check if a newer version of the file is available at the URL and update the
     file if desired.
 
+  - Resume interrupted downloads, using HTTP range requests.
+
+  - Update the file by downloading only the parts that have changed, if the
+    server offers deltas or block manifests.
+
+  - Download a compressed variant of the file, if the server offers one, and
+    decompress it on the fly.
+
   The URL and the name of the local file are given in the constructor and cannot
   be changed. See the description of the method startFileDownload() to see how
   downloads work.
@@ -90,14 +105,17 @@ public:
 
     /*! \brief Standard destructor
      *
-     * This destructor will stop all running downloads and delete all temporary
-     * files.  It will not delete the local file.
+     * This destructor will stop all running downloads. It will not delete the
+     * local file, and it will not delete partially downloaded data, so that the
+     * download can be resumed later.
      */
     ~Downloadable() override;
 
     /*! \brief Indicates whether a download process is currently running
      *
-     * This property indicates whether a download process is currently running
+     * This property indicates whether a download process is currently running.
+     * This includes the time where the download waits before it is retried
+     * after a network error.
      *
      * @see startFileDownload(), stopFileDownload()
      */
@@ -107,7 +125,7 @@ public:
      *
      * @returns Property downloading
      */
-    bool downloading() const { return !_networkReplyDownloadFile.isNull(); }
+    bool downloading() const { return !_networkReplyDownloadFile.isNull() || _retryTimer.isActive() || !_blockSync.isNull(); }
 
     /*! \brief Download progress
      *
@@ -122,6 +140,48 @@ public:
      */
     int downloadProgress() const { return _downloadProgress; }
 
+    /*! \brief Download priority
+     *
+     * This property is used by DownloadableGroup to decide which of the queued
+     * downloads is started first. Downloadables with higher priority are
+     * downloaded first. The default value is 0.
+     */
+    Q_PROPERTY(int priority READ priority WRITE setPriority NOTIFY priorityChanged)
+
+    /*! \brief Getter function for the property with the same name
+     *
+     * @returns Property priority
+     */
+    int priority() const { return _priority; }
+
+    /*! \brief Setter function for the property with the same name
+     *
+     * @param priority Property priority
+     */
+    void setPriority(int priority);
+
+    /*! \brief Indicates whether the Downloadable waits in a download queue
+     *
+     * This property is set by DownloadableGroup when the Downloadable is added
+     * to the group's download queue, and cleared when the download starts, or
+     * when stopFileDownload() is called.
+     *
+     * @see DownloadableGroup::queueDownload()
+     */
+    Q_PROPERTY(bool queued READ queued NOTIFY queuedChanged)
+
+    /*! \brief Getter function for the property with the same name
+     *
+     * @returns Property queued
+     */
+    bool queued() const { return _queued; }
+
+    /*! \brief Setter function for the property with the same name
+     *
+     * @param queued Property queued
+     */
+    void setQueued(bool queued);
+
     /*! \brief File name, as set in the constructor */
     Q_PROPERTY(QString fileName READ fileName CONSTANT)
 
@@ -166,7 +226,9 @@ public:
     /*! \brief Content of the downloaded file
      *
      * This convenience property holds the content of the downloaded file, or a null
-     * QByteArray, if nothing has been downloaded
+     * QByteArray, if nothing has been downloaded. Reading the property copies
+     * the whole file into memory. C++ code that only needs to parse the file
+     * should use a FileView of fileName() instead.
      */
     Q_PROPERTY(QByteArray fileContent READ fileContent NOTIFY fileContentChanged)
 
@@ -241,7 +303,8 @@ public:
      *
      * This property is true if all of the following conditions are met.
      *
-     * - No download is in progress
+     * - No download is in progress, and the Downloadable is not queued for
+     *   download
      *
      * - The file has been downloaded
      *
@@ -268,12 +331,144 @@ public:
      */
     QUrl url() const { return _url; }
 
+    /*! \brief Name of the file that holds partially downloaded data
+     *
+     * @returns fileName()+".part", or fileName()+".delta.part" while a delta
+     * is downloaded
+     */
+    QString partialFileName() const;
+
+    /*! \brief Sets the URLs of tile-level delta updates
+     *
+     * For MBTiles files, the server can offer deltas that update an installed
+     * version of the file to the current version, in the format described in
+     * the class MBTiles. If the local file exists when startFileDownload() is
+     * called, the delta for the installed version is downloaded and applied,
+     * instead of the complete file. The installed version is taken to be the
+     * newest version that is older than the modification date of the local
+     * file. If the delta does not fit the local file, the complete file is
+     * downloaded.
+     *
+     * @param deltaURLs Map whose keys are the dates of the versions, as found
+     * in the file "maps.json", and whose values are the URLs of the deltas
+     * that update these versions to the current one
+     */
+    void setDeltaURLs(const QMap<QDateTime, QUrl>& deltaURLs);
+
+    /*! \brief Sets the URL of the block manifest for the remote file
+     *
+     * The server can offer a BlockManifest for the remote file, which works
+     * for files of any type. If the local file exists when startFileDownload()
+     * is called and no tile-level delta is available, the file is updated
+     * with a BlockSync, which downloads only those blocks that are not found
+     * in the local file. If that fails, the complete file is downloaded.
+     *
+     * @param manifestURL URL of the block manifest, or an invalid URL if the
+     * server does not offer a manifest
+     */
+    void setBlockManifestURL(const QUrl& manifestURL) { _blockManifestURL = manifestURL; }
+
+    /*! \brief Sets the URL of a compressed variant of the remote file
+     *
+     * The server can offer a gzip-compressed copy of the remote file. If so,
+     * complete downloads fetch the compressed copy and decompress the data as
+     * it arrives, so that the partial file always holds decompressed data.
+     * Since the state of the decompressor cannot be stored, interrupted
+     * downloads of compressed data are not resumed but restarted. Compression
+     * ratio and decompression throughput are written to the debug log.
+     *
+     * @param compressedURL URL of the compressed file, or an invalid URL if
+     * the server does not offer a compressed copy
+     */
+    void setCompressedURL(const QUrl& compressedURL) { _compressedURL = compressedURL; }
+
+    /*! \brief Sets the SHA-256 checksum of the remote file
+     *
+     * If the checksum is known, a SHA-256 hash is computed incrementally while
+     * the data of a complete download arrives. Before the local file is
+     * replaced, the hash is compared to the checksum. If they differ, the
+     * download is retried and eventually fails, and the local file is left
+     * untouched. Deltas and block syncs are not affected; they have their own
+     * integrity checks.
+     *
+     * @param sha256 Checksum, as a hex-encoded string, or an empty array if
+     * the checksum is not known
+     */
+    void setExpectedSHA256(const QByteArray& sha256) { _expectedSHA256 = QByteArray::fromHex(sha256); }
+
+    /*! \brief SHA-256 checksum of the remote file
+     *
+     * @returns Checksum set with setExpectedSHA256(), hex-encoded, or an empty
+     * array if the checksum is not known
+     */
+    QByteArray expectedSHA256() const { return _expectedSHA256.toHex(); }
+
+    /*! \brief Sets a peer that offers a copy of the remote file
+     *
+     * A peer is another device on the local network that offers a copy of the
+     * remote file, see MapShare. If a peer is set and the checksum of the
+     * remote file is known, then complete downloads fetch the file from the
+     * peer instead of the remote server. Deltas and block syncs always use
+     * the remote server. If the download from the peer fails, or if the data
+     * does not match the checksum, the peer is forgotten and the file is
+     * downloaded from the remote server.
+     *
+     * @param peerURL URL of the file on the peer, or an invalid URL if no peer
+     * offers the file
+     */
+    void setPeerURL(const QUrl& peerURL) { _peerURL = peerURL; }
+
+    /*! \brief Getter function for the property set with setOptimizeMBTiles()
+     *
+     * @returns True if MBTiles files are optimized after download
+     */
+    bool optimizeMBTiles() const { return _optimizeMBTiles; }
+
+    /*! \brief Optimizes MBTiles files after download
+     *
+     * If set, and if the local file is an MBTiles file, then every newly
+     * installed local file is rewritten by MBTiles::optimize() in a separate
+     * thread. The local file can be used while the optimization runs. Once
+     * the optimization is done, the local file is replaced by the optimized
+     * copy, unless it has been changed in the meantime, and the signal
+     * fileContentChanged() is emitted. Files that are already optimized are
+     * left alone.
+     *
+     * @param optimize If true, and if the local file exists, the optimization
+     * starts immediately
+     */
+    void setOptimizeMBTiles(bool optimize);
+
+    /*! \brief Cuts MBTiles files to a region after download
+     *
+     * If a region is set, and if the local file is an MBTiles file, then
+     * every newly installed local file is cut down to the region by
+     * MBTiles::extract() in a separate thread, in place of the optimization
+     * described in setOptimizeMBTiles(). The extracted file is optimized as
+     * well. As with the optimization, the local file can be used while the
+     * extraction runs. Files that have already been cut to the same region
+     * are left alone.
+     *
+     * Tiles that have been cut away cannot be restored locally. If the region
+     * is enlarged or removed, the file needs to be deleted and downloaded
+     * again.
+     *
+     * @param boxes Boxes, as in MBTiles::extract(), or an empty vector for no
+     * region
+     *
+     * @param minZoom Smallest zoom level, as in MBTiles::extract()
+     *
+     * @param maxZoom Largest zoom level, as in MBTiles::extract()
+     */
+    void setMBTilesRegion(const QVector<QRectF>& boxes, int minZoom=0, int maxZoom=-1);
+
 public slots:
     /*! \brief The convenience method deletes the local file.
      *
      * This convenience method deletes the local file. The singals
      * aboutToChangeLocalFile() and localFileChanged() are emitted
-     * appropriately, and a QLockFile is used at fileName()+".lock".
+     * appropriately, and a QLockFile is used at fileName()+".lock". If no
+     * download is in progress, partially downloaded data is deleted as well.
      */
     void deleteFile();
 
@@ -283,15 +478,34 @@ public slots:
      * already in progress, nothing will happen.  Otherwise, the following will
      * take place.
      *
-     * -# Data is retrieved from the remote server and stored in temporary
-     *    file. The signal downloadProgress() will be emitted regularly.
+     * -# Data is retrieved from the remote server and stored in the file
+     *    partialFileName(). The signal downloadProgress() will be emitted
+     *    regularly. If the partial file contains data from an earlier attempt,
+     *    only the missing part is requested from the server, provided that the
+     *    file on the server has not changed in the meantime. To check this,
+     *    the ETag or Last-Modified header sent by the server is stored with
+     *    the partial data.
+     *
+     * -# In case of a temporary network error, the download is retried a few
+     *    times, with increasing delays, continuing from where it stopped.
      *
-     * -# In case of an error, the signal error() is emitted and the download
-     *    stops.
+     * -# In case of any other error, the signal error() is emitted and the
+     *    download stops.
      *
      * -# Optionally, the download can be stopped using the method
      *    stopFileDownload().
      *
+     * If the local file exists and the validator of the local file is known,
+     * the request is conditional. If the server answers "304 Not Modified",
+     * the download ends right away, the local file is left untouched and the
+     * signal localFileConfirmedCurrent() is emitted.
+     *
+     * If the local file exists, no tile-level delta is available and the
+     * server offers a block manifest (see setBlockManifestURL()), a BlockSync
+     * is used instead, which writes the new version of the file to
+     * fileName()+".sync.part". If the BlockSync fails, the complete file is
+     * downloaded as described above.
+     *
      * Once all data has been downloaded successfully to the temporary file, the
      * process continues as follows.
      *
@@ -301,7 +515,13 @@ public slots:
      *
      * -# A QLockFile is created at fileName()+".lock"
      *
-     * -# The local file is overwritten by the newly downloaded data.
+     * -# If the server has announced the size of the file, the size of the
+     *    downloaded data is checked. If the sizes differ, the data is discarded
+     *    and the download starts again.
+     *
+     * -# The local file is overwritten by the newly downloaded data. If a delta
+     *    has been downloaded (see setDeltaURLs()), the delta is applied to the
+     *    local file instead.
      *
      * -# The QLockFile is removed
      *
@@ -326,9 +546,11 @@ public slots:
 
     /*! \brief Stops download process
      *
-     * This method stops the currenly running download process gracefully and
-     * deletes any partially downloaded data. No signal will be emitted.  If no
-     * download is in progress, nothing will happen.
+     * This method stops the currenly running download process gracefully, or
+     * removes the Downloadable from the download queue. The
+     * partially downloaded data is kept, so that a later call to
+     * startFileDownload() resumes the download. No signal will be emitted.  If
+     * no download is in progress, nothing will happen.
      */
     void stopFileDownload();
 
@@ -337,13 +559,14 @@ signals:
      *
      * This signal is emitted once the download finished, just before the local
      * file is overwritten with new data. It indicates that all users should
-     * stop using the file immediately. This signal is always followed by the
-     * signal localFileChanged(), which indicates that the local file can be
-     * used again.
+     * stop using the file immediately. Once the file has been replaced, this
+     * signal is followed by the signal fileContentChanged(), which indicates
+     * that the local file can be used again. If replacing the file fails, the
+     * local file is left untouched and fileContentChanged() is not emitted.
      *
      * @param localFileName Name of the local file that has will change
      *
-     * @see localFileChanged()
+     * @see fileContentChanged()
      */
     void aboutToChangeFile(QString localFileName);
 
@@ -406,6 +629,38 @@ signals:
      */
     void remoteFileSizeChanged();
 
+    /*! \brief Local file is current
+     *
+     * This signal is emitted when the server answers a download or an info
+     * request with "304 Not Modified", confirming that the local file agrees
+     * with the remote file. The local file is not touched in this case, and
+     * fileContentChanged() is not emitted.
+     */
+    void localFileConfirmedCurrent();
+
+    /*! \brief Data of a complete download has arrived
+     *
+     * This signal is emitted whenever data of a download of the complete
+     * remote file is queued for writing to the partial file, after
+     * decompression. It allows to process the file while it is downloaded.
+     * Data of deltas and block syncs is not reported.
+     *
+     * @param localFileName Name of the local file, as in fileName()
+     *
+     * @param offset Position of the data in the file. If the download starts
+     * from the beginning, the offset is 0. If a download is resumed, the
+     * offset is larger than 0, and earlier data is not reported again.
+     *
+     * @param data The data
+     */
+    void downloadDataReceived(QString localFileName, qint64 offset, QByteArray data);
+
+    /*! \brief Notifier signal for the property priority */
+    void priorityChanged();
+
+    /*! \brief Notifier signal for the property queued */
+    void queuedChanged();
+
     /*! \brief Notifier signal for the property section */
     void sectionChanged();
 
@@ -419,9 +674,9 @@ private slots:
     // &QNetworkReply::error of _networkReplyDownload.
     void downloadFileErrorReceiver(QNetworkReply::NetworkError code);
 
-    // Called once download of the remote file is finished, this method
-    // overwrites the local file. It deletes the QTemporaryFile _tmpFile, and
-    // deletes _networkReplyDownload by calling deleteLater. Connected to
+    // Called once download of the remote file is finished, this method checks
+    // the size of the partial file and moves it to the local file. It deletes
+    // _networkReplyDownload by calling deleteLater. Connected to
     // &QNetworkReply::finished of _networkReplyDownload.
     void downloadFileFinished();
 
@@ -431,9 +686,13 @@ private slots:
     void downloadFileProgressReceiver(qint64 bytesReceived, qint64 bytesTotal);
 
     // Called during the download of the remote file, this method reads all the
-    // data that has been downloaded so far and stores it in the QTemporaryFile
-    // _tmpFile.  Connected to &QNetworkReply::readyRead of
-    // _networkReplyDownload.
+    // data that has been downloaded so far and queues it for writing to the
+    // partial file _partFile. If too much data is waiting to be written, the
+    // method does nothing; the data stays in the read buffer of the reply,
+    // whose size is limited, and the server is slowed down by TCP flow
+    // control. Connected to &QNetworkReply::readyRead of
+    // _networkReplyDownload, and to &AsyncFileWriter::bytesWritten of
+    // _partFile.
     void downloadFilePartialDataReceiver();
 
     // Called once download of the remote file header data is finished, this
@@ -442,7 +701,82 @@ private slots:
     // &QNetworkReply::finished of _networkReplyDownloadHeader.
     void downloadHeaderFinished();
 
+    // Opens the partial file and sends a GET request to the server. If the
+    // partial file contains data, only the missing part is requested. This
+    // method is called by startFileDownload(), and by _retryTimer. Returns
+    // false if no request could be sent. The method does not emit
+    // downloadingChanged(); that is left to the caller.
+    bool startNetworkRequest();
+
+    // Called once the BlockSync started by startFileDownload() is done. On
+    // success, the output of the BlockSync is moved to the local file.
+    // Otherwise, the complete file is downloaded.
+    void blockSyncFinished(bool success);
+
+    // Called once the optimization started by startOptimization() is done. If
+    // the local file has not changed in the meantime, it is replaced by the
+    // optimized copy.
+    void optimizationFinished();
+
 private:
+    // Called if the download from a peer fails. Forgets the peer and downloads
+    // the file from the remote server instead.
+    void fallBackFromPeer();
+
+    // Starts the optimization or extraction of the local file in a separate
+    // thread, if _optimizeMBTiles or a region is set and the local file is an
+    // MBTiles file
+    void startOptimization();
+
+    // Checks the headers of the reply to the GET request, before any data is
+    // written. If the server sends the complete file, the partial file is
+    // truncated. If the server sends a part that does not fit the data we
+    // have, the method returns false. The validator of the remote file is
+    // stored with the partial data.
+    bool checkPartialResponse();
+
+    // Deletes the partial files for complete file, delta and block sync, and
+    // the validators stored with them
+    void discardPartialFile();
+
+    // Returns the ETag or Last-Modified header that was sent by the server
+    // when the data in the partial file was downloaded, or an empty array if
+    // nothing is known
+    QByteArray partialFileValidator() const;
+
+    // Disconnects _networkReplyDownloadFile, deletes it by calling deleteLater
+    // and sets the pointer to nullptr
+    void releaseNetworkReply();
+
+    // If the maximal number of retries has not been reached, this method
+    // releases the network reply, starts _retryTimer and returns true. If
+    // discardPartialData is true, the partial file is truncated first.
+    bool retryDownload(bool discardPartialData);
+
+    // Key under which the validator for the given partial file is stored in
+    // QSettings. The validator of the local file is stored under the key
+    // settingsKey(fileName()).
+    static QString settingsKey(const QString& partialFileName);
+
+    // If a validator for the local file is known, adds the header
+    // "If-None-Match" or "If-Modified-Since" to the request, so that the
+    // server answers with "304 Not Modified" if the local file is current
+    void setConditionalHeaders(QNetworkRequest& request) const;
+
+    // Called when the server answers the download request with "304 Not
+    // Modified". Ends the download, leaves the local file untouched and
+    // updates its modification time.
+    void localFileConfirmed();
+
+    // Validator (ETag or Last-Modified header) sent with the reply that is
+    // currently downloaded
+    QByteArray _responseValidator;
+
+    // Maximal number of retries, and delay before the first retry. The delay
+    // doubles with every retry.
+    static const int maxRetries = 5;
+    static const int firstRetryDelayInMS = 2000;
+
     // Pointer the QNetworkAccessManager that will be used for all the
     // downloading
     QPointer<QNetworkAccessManager> _networkAccessManager;
@@ -458,9 +792,75 @@ private:
     // no download is in progress.
     QPointer<QNetworkReply> _networkReplyDownloadHeader;
 
-    // Temporary file for storing partiall data when downloading the remote
-    // file. Set to nullptr when no download is in progress.
-    QPointer<QSaveFile> _saveFile{};
+    // File for storing partial data when downloading the remote file, opened
+    // in append mode. Data is written in a separate thread. Set to nullptr
+    // when no download is in progress.
+    QPointer<AsyncFileWriter> _partFile{};
+
+    // Size of the read buffer of _networkReplyDownloadFile, and maximal
+    // number of bytes waiting to be written to _partFile before we stop
+    // reading from the network
+    static const qint64 readBufferSize = 1024*1024;
+    static const qint64 maxPendingWriteBytes = 4*1024*1024;
+
+    // True once checkPartialResponse() has been called for the current reply
+    bool _partialResponseChecked{false};
+
+    // Size of the complete file, as announced by the server, or -1 if unknown
+    qint64 _expectedFileSize{-1};
+
+    // Size of the partial file when the current request was sent. Used to
+    // compute the download progress.
+    qint64 _resumeOffset{0};
+
+    // Size of the partial file, including data queued for writing
+    qint64 _partFileSize{0};
+
+    // Number of retries since data was last received, and timer used to start
+    // the next retry
+    int _retryCount{0};
+    QTimer _retryTimer;
+
+    // Deltas offered by the server, see setDeltaURLs(). While a delta is
+    // downloaded, _downloadingDelta is true and _deltaURL holds its URL.
+    QMap<QDateTime, QUrl> _deltaURLs;
+    QUrl _deltaURL;
+    bool _downloadingDelta{false};
+
+    // Block manifest offered by the server, see setBlockManifestURL(), and
+    // the BlockSync that is running. Set to nullptr when no BlockSync is
+    // running.
+    QUrl _blockManifestURL;
+    QPointer<BlockSync> _blockSync;
+
+    // Compressed copy of the remote file, see setCompressedURL(). While the
+    // compressed copy is downloaded, _downloadingCompressed is true and the
+    // data is decompressed by _decompressor.
+    QUrl _compressedURL;
+    bool _downloadingCompressed{false};
+    GzipDecompressor _decompressor;
+
+    // Peer that offers a copy of the remote file, see setPeerURL(). While the
+    // file is downloaded from the peer, _downloadingFromPeer is true.
+    QUrl _peerURL;
+    bool _downloadingFromPeer{false};
+
+    // Optimization of MBTiles files, see setOptimizeMBTiles(). While an
+    // optimization runs, _optimizationBase holds the modification time of the
+    // local file when the optimization started.
+    bool _optimizeMBTiles{false};
+    QFutureWatcher<bool> _optimizationWatcher;
+    QDateTime _optimizationBase;
+
+    // Region set with setMBTilesRegion()
+    QVector<QRectF> _regionBoxes;
+    int _regionMinZoom{0};
+    int _regionMaxZoom{-1};
+
+    // Checksum of the remote file, see setExpectedSHA256(), and the hash of
+    // the data in the partial file, computed while the data arrives
+    QByteArray _expectedSHA256;
+    QCryptographicHash _sha256{QCryptographicHash::Sha256};
 
     // URL of the remote file, as set in the constructor
     QUrl _url;
@@ -478,6 +878,10 @@ private:
 
     // Section name
     QString _section {};
+
+    // Download priority and queue state
+    int _priority {0};
+    bool _queued {false};
 };
 
 #endif // DOWNLOADABLE_H
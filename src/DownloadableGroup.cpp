@@ -24,24 +24,36 @@
 DownloadableGroup::DownloadableGroup(QObject *parent)
     : QObject(parent), _cachedDownloading(false), _cachedUpdatable(false)
 {
+    _notificationTimer.setSingleShot(true);
+    _notificationTimer.setInterval(notificationInterval);
+    connect(&_notificationTimer, &QTimer::timeout, this, &DownloadableGroup::emitNotifications);
 }
 
 
 void DownloadableGroup::addToGroup(Downloadable *downloadable)
 {
     // Avoid double entries
-    if (_downloadables.contains(downloadable))
+    if (_memberStates.contains(downloadable))
         return;
 
     // Add element to group
     _downloadables.append(downloadable);
+    _memberStates.insert(downloadable, MemberState());
 
+    // The state of a member is also recomputed whenever its local file
+    // changes, so that the counters stay right even if a member fails to
+    // emit updatableChanged().
     connect(downloadable, &Downloadable::downloadingChanged, this, &DownloadableGroup::elementChanged);
     connect(downloadable, &Downloadable::updatableChanged, this, &DownloadableGroup::elementChanged);
+    connect(downloadable, &Downloadable::hasFileChanged, this, &DownloadableGroup::elementChanged);
+    connect(downloadable, &Downloadable::fileContentChanged, this, &DownloadableGroup::elementChanged);
     connect(downloadable, &Downloadable::hasFileChanged, this, &DownloadableGroup::filesChanged);
     connect(downloadable, &Downloadable::fileContentChanged, this, &DownloadableGroup::localFileContentChanged);
+    connect(downloadable, &Downloadable::downloadDataReceived, this, &DownloadableGroup::downloadDataReceived);
     connect(downloadable, &QObject::destroyed, this, &DownloadableGroup::cleanUp);
-    elementChanged();
+    connect(downloadable, &QObject::destroyed, this, &DownloadableGroup::forgetMemberState);
+    updateMemberState(downloadable);
+    startQueuedDownloads();
 
     emit downloadablesChanged();
 }
@@ -57,21 +69,26 @@ void DownloadableGroup::removeFromGroup(Downloadable *downloadable)
 
     _downloadables.takeAt(index);
     disconnect(downloadable, nullptr, this, nullptr);
-    elementChanged();
+    forgetMemberState(downloadable);
+    startQueuedDownloads();
     emit downloadablesChanged();
 }
 
 
-bool DownloadableGroup::downloading() const
+int DownloadableGroup::numberOfRunningDownloads() const
 {
-    foreach(auto _downloadable, _downloadables) {
+    // Members are already counted. Add the Downloadables that were started
+    // from the queue, but are not members.
+    auto result = _numberOfDownloadingMembers;
+    foreach(auto _downloadable, _startedFromQueue) {
         if (_downloadable.isNull())
             continue;
+        if (_memberStates.contains(_downloadable))
+            continue;
         if (_downloadable->downloading())
-            return true;
+            result++;
     }
-
-    return false;
+    return result;
 }
 
 
@@ -91,16 +108,92 @@ QStringList DownloadableGroup::files() const
 }
 
 
-bool DownloadableGroup::updatable() const
+QList<Downloadable *> DownloadableGroup::queue() const
 {
-    foreach(auto _downloadable, _downloadables) {
+    QList<Downloadable *> result;
+    foreach(auto _downloadable, _queue) {
+        if (_downloadable.isNull())
+            continue;
+        if (!_downloadable->queued())
+            continue;
+        result += _downloadable;
+    }
+
+    // Sort by priority. The sort is stable, so that downloadables of equal
+    // priority are started in the order in which they were queued.
+    std::stable_sort(result.begin(), result.end(), [](Downloadable* a, Downloadable* b)
+    {
+        return (a->priority() > b->priority());
+    }
+    );
+
+    return result;
+}
+
+
+void DownloadableGroup::queueDownload(Downloadable *downloadable)
+{
+    // Paranoid safety checks
+    if (downloadable == nullptr)
+        return;
+    if (downloadable->downloading() || downloadable->queued())
+        return;
+
+    _queue.append(downloadable);
+    downloadable->setQueued(true);
+    connect(downloadable, &Downloadable::queuedChanged, this, &DownloadableGroup::startQueuedDownloads, Qt::UniqueConnection);
+    connect(downloadable, &Downloadable::downloadingChanged, this, &DownloadableGroup::startQueuedDownloads, Qt::UniqueConnection);
+    connect(downloadable, &QObject::destroyed, this, &DownloadableGroup::startQueuedDownloads, Qt::UniqueConnection);
+
+    startQueuedDownloads();
+    emit queueChanged();
+}
+
+
+void DownloadableGroup::setMaxConcurrentDownloads(int maxConcurrentDownloads)
+{
+    maxConcurrentDownloads = qMax(1, maxConcurrentDownloads);
+    if (maxConcurrentDownloads == _maxConcurrentDownloads)
+        return;
+
+    _maxConcurrentDownloads = maxConcurrentDownloads;
+    emit maxConcurrentDownloadsChanged();
+    startQueuedDownloads();
+}
+
+
+void DownloadableGroup::startQueuedDownloads()
+{
+    if (_startingQueuedDownloads)
+        return;
+    _startingQueuedDownloads = true;
+
+    auto oldQueue = _queue;
+
+    // Remove everything that is no longer queued, or no longer downloading
+    _queue = QList<QPointer<Downloadable>>();
+    foreach(auto _downloadable, queue())
+        _queue += _downloadable;
+    QList<QPointer<Downloadable>> stillRunning;
+    foreach(auto _downloadable, _startedFromQueue) {
         if (_downloadable.isNull())
             continue;
-        if (_downloadable->updatable())
-            return true;
+        if (_downloadable->downloading())
+            stillRunning += _downloadable;
+    }
+    _startedFromQueue = stillRunning;
+
+    // Start downloads, in the order of priority
+    while(!_queue.isEmpty() && (numberOfRunningDownloads() < _maxConcurrentDownloads)) {
+        auto next = _queue.takeFirst();
+        _startedFromQueue += next;
+        next->startFileDownload();
     }
 
-    return false;
+    _startingQueuedDownloads = false;
+
+    if (oldQueue != _queue)
+        emit queueChanged();
 }
 
 
@@ -115,16 +208,68 @@ void DownloadableGroup::cleanUp()
 
 void DownloadableGroup::elementChanged()
 {
-    bool newDownloading = downloading();
-    bool newUpdatable   = updatable();
+    auto downloadable = qobject_cast<Downloadable *>(sender());
+    if (downloadable == nullptr)
+        return;
 
-    if (newDownloading != _cachedDownloading) {
-        _cachedDownloading = newDownloading;
+    // Rebuilding the queue is expensive. It is only necessary if a download
+    // slot might have become free while downloads are waiting.
+    if (updateMemberState(downloadable) && !_queue.isEmpty())
+        startQueuedDownloads();
+}
+
+
+bool DownloadableGroup::updateMemberState(Downloadable *downloadable)
+{
+    // Paranoid safety checks
+    auto iterator = _memberStates.find(downloadable);
+    if (iterator == _memberStates.end())
+        return false;
+
+    bool newDownloading = downloadable->downloading();
+    bool newUpdatable   = downloadable->updatable();
+    if (newDownloading != iterator->downloading)
+        _numberOfDownloadingMembers += newDownloading ? 1 : -1;
+    if (newUpdatable != iterator->updatable)
+        _numberOfUpdatableMembers += newUpdatable ? 1 : -1;
+    bool startedOrStopped = (newDownloading != iterator->downloading);
+    iterator->downloading = newDownloading;
+    iterator->updatable   = newUpdatable;
+
+    if ((downloading() != _cachedDownloading) || (updatable() != _cachedUpdatable))
+        if (!_notificationTimer.isActive())
+            _notificationTimer.start();
+    return startedOrStopped;
+}
+
+
+void DownloadableGroup::forgetMemberState(QObject *downloadable)
+{
+    auto iterator = _memberStates.find(downloadable);
+    if (iterator == _memberStates.end())
+        return;
+
+    if (iterator->downloading)
+        _numberOfDownloadingMembers--;
+    if (iterator->updatable)
+        _numberOfUpdatableMembers--;
+    _memberStates.erase(iterator);
+
+    if ((downloading() != _cachedDownloading) || (updatable() != _cachedUpdatable))
+        if (!_notificationTimer.isActive())
+            _notificationTimer.start();
+}
+
+
+void DownloadableGroup::emitNotifications()
+{
+    if (downloading() != _cachedDownloading) {
+        _cachedDownloading = downloading();
         emit downloadingChanged();
     }
 
-    if (newUpdatable != _cachedUpdatable) {
-        _cachedUpdatable = newUpdatable;
+    if (updatable() != _cachedUpdatable) {
+        _cachedUpdatable = updatable();
         emit updatableChanged();
     }
 }
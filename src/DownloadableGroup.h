@@ -22,6 +22,8 @@
 #define DOWNLOADABLEGROUP_H
 
 
+#include <QHash>
+
 #include "Downloadable.h"
 
 
@@ -29,6 +31,19 @@
  *
  * This convenience class collects signals and properties from a set of
  * Downloadable objects, and forwards summarized information.
+ *
+ * In addition, the class maintains a download queue. Downloads that are added
+ * to the queue with queueDownload() are started in the order of
+ * Downloadable::priority, and never more than maxConcurrentDownloads at the same
+ * time. This way, the available bandwidth is shared among few downloads, and
+ * the most important files become usable early.
+ *
+ * The group keeps track of the number of members that are downloading or
+ * updatable, so that the properties downloading and updatable can be read
+ * without going through the list of members. The notifier signals of these
+ * properties are emitted at most once per frame (that is, every
+ * notificationInterval milliseconds), even if many members change state at the
+ * same time.
  */
 
 class DownloadableGroup : public QObject
@@ -36,6 +51,13 @@ class DownloadableGroup : public QObject
     Q_OBJECT
 
 public:
+    /*! \brief Minimal interval between two notifier signals, in milliseconds
+     *
+     * The notifier signals downloadingChanged() and updatableChanged() are
+     * emitted at most once during this interval.
+     */
+    static const int notificationInterval = 16;
+
     /*! \brief Constructs an empty group
      *
      * @param parent The standard QObject parent pointer.
@@ -92,6 +114,43 @@ public:
      */
     QList<Downloadable *> downloadables() const;
 
+    /*! \brief Maximal number of downloads that run at the same time
+     *
+     * Queued downloads are only started if fewer than this number of
+     * Downloadables in the group are downloading. Downloads that are started
+     * directly with Downloadable::startFileDownload() are counted, but never
+     * held back. The default value is 2.
+     */
+    Q_PROPERTY(int maxConcurrentDownloads READ maxConcurrentDownloads WRITE setMaxConcurrentDownloads NOTIFY maxConcurrentDownloadsChanged)
+
+    /*! \brief Getter function for the property with the same name
+     *
+     * @returns Property maxConcurrentDownloads
+     */
+    int maxConcurrentDownloads() const { return _maxConcurrentDownloads; }
+
+    /*! \brief Setter function for the property with the same name
+     *
+     * @param maxConcurrentDownloads Property maxConcurrentDownloads. Values
+     * smaller than 1 are treated as 1.
+     */
+    void setMaxConcurrentDownloads(int maxConcurrentDownloads);
+
+    /*! \brief Downloadables that wait in the download queue
+     *
+     * This property holds the list of Downloadables that have been queued
+     * with queueDownload() and whose download has not yet started, in the
+     * order in which they will be started. The nullptr is never contained in
+     * the list.
+     */
+    Q_PROPERTY(QList<Downloadable *> queue READ queue NOTIFY queueChanged)
+
+    /*! \brief Getter function for the property with the same name
+     *
+     * @returns Property queue
+     */
+    QList<Downloadable *> queue() const;
+
     /*! \brief Indicates whether a download process is currently running
      *
      * By definition, an empty group is not downloading
@@ -102,7 +161,7 @@ public:
      *
      * @returns Property downloading
      */
-    bool downloading() const;
+    bool downloading() const { return _numberOfDownloadingMembers > 0; }
 
     /*! \brief Names of all files that have been downloaded by any of the
      *  Downloadbles in this group
@@ -125,9 +184,29 @@ public:
      *
      * @returns Property updatable
      */
-    bool updatable() const;
+    bool updatable() const { return _numberOfUpdatableMembers > 0; }
+
+public slots:
+    /*! \brief Adds a Downloadable to the download queue
+     *
+     * The Downloadable is marked as queued, and the download is started as
+     * soon as fewer than maxConcurrentDownloads downloads are running and all
+     * queued Downloadables of higher priority have been started. If the
+     * Downloadable is already downloading or queued, nothing happens. The
+     * Downloadable need not be a member of the group. Use
+     * Downloadable::stopFileDownload() to remove a Downloadable from the queue.
+     *
+     * @param downloadable Pointer to the Downloadable to be queued
+     */
+    void queueDownload(Downloadable *downloadable);
 
 signals:
+    /*! \brief Notifier signal for the property maxConcurrentDownloads */
+    void maxConcurrentDownloadsChanged();
+
+    /*! \brief Notifier signal for the property queue */
+    void queueChanged();
+
     /*! \brief Notifier signal for property downloading */
     void downloadingChanged();
 
@@ -144,18 +223,79 @@ signals:
      */
     void localFileContentChanged();
 
+    /*! \brief Emitted if data of a download arrives
+     *
+     * This signal is emitted if one of the downloadables in this group emits
+     * the signal downloadDataReceived().
+     *
+     * @see Downloadable::downloadDataReceived()
+     */
+    void downloadDataReceived(QString localFileName, qint64 offset, QByteArray data);
+
     /*! \brief Notifier signal for the property downloadables */
     void downloadablesChanged();
 
 private slots:
+    // Updates the counters _numberOfDownloadingMembers and
+    // _numberOfUpdatableMembers when the member that sent the signal changes
+    // state or its local file, and starts _notificationTimer if required
     void elementChanged();
 
+    // Emits downloadingChanged() and updatableChanged() if the properties
+    // differ from the values that were last announced
+    void emitNotifications();
+
     // Remove all instances of nullptr from _downloadables
     void cleanUp();
 
+    // Starts queued downloads, in the order of priority, until
+    // _maxConcurrentDownloads downloads are running. Downloadables that are no
+    // longer marked as queued are removed from the queue.
+    void startQueuedDownloads();
+
 private:
-    bool _cachedDownloading; // Cached value for the 'downloading' property
-    bool _cachedUpdatable;   // Cached value for the 'updatable' property
+    // Number of Downloadables that are currently downloading, counting both
+    // the group members and the Downloadables started from the queue
+    int numberOfRunningDownloads() const;
+
+    int _maxConcurrentDownloads {2};
+
+    // Downloadables in the download queue, in the order in which they were
+    // queued
+    QList<QPointer<Downloadable>> _queue;
+
+    // Downloadables that have been started from the queue and that might
+    // still be downloading
+    QList<QPointer<Downloadable>> _startedFromQueue;
+
+    // Guard against recursive calls of startQueuedDownloads(), which happen
+    // because starting a download emits downloadingChanged()
+    bool _startingQueuedDownloads {false};
+
+    // Updates the counters with the current state of the member downloadable,
+    // and records that state in _memberStates. Returns true if the member
+    // started or stopped downloading.
+    bool updateMemberState(Downloadable *downloadable);
+
+    // Removes a member from _memberStates and from the counters. The pointer
+    // is only used as a key and need not point to a valid object.
+    void forgetMemberState(QObject *downloadable);
+
+    // State of a member, as last seen by the group
+    struct MemberState {
+        bool downloading {false};
+        bool updatable {false};
+    };
+    QHash<QObject*, MemberState> _memberStates;
+
+    int _numberOfDownloadingMembers {0}; // Number of members that are downloading
+    int _numberOfUpdatableMembers {0};   // Number of members that are updatable
+
+    bool _cachedDownloading; // Value of the 'downloading' property, as last announced
+    bool _cachedUpdatable;   // Value of the 'updatable' property, as last announced
+
+    // Timer used to batch notifier signals, see emitNotifications()
+    QTimer _notificationTimer;
 
     // List of QPointers to the Downloadable objects in this group
     QList<QPointer<Downloadable>> _downloadables;
@@ -0,0 +1,46 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "FileView.h"
+
+
+FileView::FileView(const QString &fileName)
+    : _lockFile(fileName), _file(fileName) {
+    _lockFile.lock();
+    if (!_file.open(QIODevice::ReadOnly))
+        return;
+    _size = _file.size();
+    if (_size == 0)
+        return;
+
+    _data = reinterpret_cast<const char*>(_file.map(0, _size));
+    if (_data == nullptr) {
+        _buffer = _file.readAll();
+        _data = _buffer.constData();
+        _size = _buffer.size();
+    }
+}
+
+
+FileView::~FileView() {
+    // Unmap and close the file before the lock is released
+    _file.close();
+    _lockFile.unlock();
+}
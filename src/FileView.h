@@ -0,0 +1,119 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef FILEVIEW_H
+#define FILEVIEW_H
+
+#include <QFile>
+#include <QLockFile>
+
+
+/*! \brief Lock that protects a local file
+ *
+ * Files managed by Downloadable are protected by a QLockFile at
+ * fileName+".lock". Readers may hold the lock for a long time, for instance
+ * during a scan of a large file, so the lock is never considered stale. All
+ * code that reads, replaces or deletes such a file must use this class, so
+ * that everybody follows the same policy.
+ */
+
+class FileLock : public QLockFile {
+public:
+    /*! \brief Constructs a lock for a file, without locking it
+     *
+     * @param fileName Name of the file that is protected, not of the lock file
+     */
+    explicit FileLock(const QString &fileName) : QLockFile(fileName+".lock") { setStaleLockTime(0); }
+};
+
+
+/*! \brief Read-only, memory-mapped view of a local file
+ *
+ * This class gives read access to the content of a file without copying it
+ * into memory. The file is mapped into the address space of the process, so
+ * that parsers can work directly on the page cache. If the file cannot be
+ * mapped, it is read into memory instead.
+ *
+ * Files managed by Downloadable are protected by a FileLock. The view holds
+ * that lock for its whole lifetime, so that
+ * the file cannot be replaced or deleted while it is being read. Views should
+ * therefore be short-lived, and a thread must not create two views of the same
+ * file at the same time.
+ */
+
+class FileView {
+public:
+    /*! \brief Locks and maps a file
+     *
+     * @param fileName Name of the file
+     */
+    explicit FileView(const QString &fileName);
+
+    // No copy constructor
+    FileView(FileView const &) = delete;
+
+    // No assign operator
+    FileView &operator=(FileView const &) = delete;
+
+    // No move constructor
+    FileView(FileView &&) = delete;
+
+    // No move assignment operator
+    FileView &operator=(FileView &&) = delete;
+
+    /*! \brief Unmaps the file and releases the lock */
+    ~FileView();
+
+    /*! \brief Validity
+     *
+     * @returns True if the file exists and could be opened
+     */
+    bool isValid() const { return _file.isOpen(); }
+
+    /*! \brief Content of the file
+     *
+     * @returns Pointer to the first byte of the file. The data remains valid
+     * as long as the view exists.
+     */
+    const char *data() const { return _data; }
+
+    /*! \brief Size of the file
+     *
+     * @returns Size of the file in bytes
+     */
+    qint64 size() const { return _size; }
+
+    /*! \brief Content of the file, as a QByteArray
+     *
+     * @returns A QByteArray that refers to the mapped data, without copying
+     * it. The QByteArray, and all copies of it, must not be used once the view
+     * has been destroyed.
+     */
+    QByteArray bytes() const { return QByteArray::fromRawData(_data, static_cast<int>(_size)); }
+
+private:
+    FileLock _lockFile;
+    QFile _file;
+    QByteArray _buffer;
+    const char *_data{nullptr};
+    qint64 _size{0};
+};
+
+#endif
@@ -18,25 +18,51 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#include <QtConcurrent/QtConcurrent>
 #include <QDataStream>
 #include <QFile>
+#include <QGeoRectangle>
+#include <QSaveFile>
 #include <QStandardPaths>
+#include <QtMath>
 
 #include "AviationUnits.h"
 #include "FlightRoute.h"
 #include "Waypoint.h"
 
 
-FlightRoute::FlightRoute(Aircraft *aircraft, Wind *wind, QObject *parent)
-    : QObject(parent), _aircraft(aircraft), _wind(wind)
+FlightRoute::FlightRoute(Aircraft *aircraft, Wind *wind, GeoMapProvider *geoMapProvider, QObject *parent)
+    : QObject(parent), _aircraft(aircraft), _wind(wind), _geoMapProvider(geoMapProvider)
 {
     load();
-    connect(this, &FlightRoute::waypointsChanged, this, &FlightRoute::save);
-    connect(this, &FlightRoute::waypointsChanged, this, &FlightRoute::summaryChanged);
+
+    _saveTimer.setSingleShot(true);
+    _saveTimer.setInterval(saveDelayInMS);
+    connect(&_saveTimer, &QTimer::timeout, this, &FlightRoute::save);
+    connect(this, &FlightRoute::waypointsChanged, &_saveTimer, static_cast<void (QTimer::*)()>(&QTimer::start));
+    connect(this, &FlightRoute::waypointsChanged, this, &FlightRoute::updateSummary);
+    connect(this, &FlightRoute::waypointsChanged, this, &FlightRoute::airspaceBriefingChanged);
+    connect(this, &FlightRoute::waypointsChanged, this, &FlightRoute::pruneAirspaceCrossingCache);
+    if (!_geoMapProvider.isNull())
+        connect(_geoMapProvider, &GeoMapProvider::geoJSONChanged, this, &FlightRoute::clearAirspaceCrossingCache);
     if (!_aircraft.isNull())
-        connect(_aircraft, &Aircraft::valChanged, this, &FlightRoute::summaryChanged);
+        connect(_aircraft, &Aircraft::valChanged, this, &FlightRoute::updateWindTriangles);
     if (!_wind.isNull())
-        connect(_wind, &Wind::valChanged, this, &FlightRoute::summaryChanged);
+        connect(_wind, &Wind::valChanged, this, &FlightRoute::updateWindTriangles);
+    updateSummary();
+}
+
+
+FlightRoute::~FlightRoute()
+{
+    // If a save is pending, write the file now, in the main thread. Wait for
+    // any write that is currently running, so that the files do not get
+    // written concurrently.
+    _saveFuture.waitForFinished();
+    if (_saveTimer.isActive()) {
+        _saveTimer.stop();
+        writeFile(fileName(), serialize());
+    }
 }
 
 
@@ -50,11 +76,126 @@ void FlightRoute::append(QObject *waypoint)
     auto* wp = dynamic_cast<Waypoint*>(waypoint);
     _waypoints.append(new Waypoint(*wp, this));
 
-    updateLegs();
+    // Add a leg that ends in the new waypoint
+    if (_waypoints.size() > 1)
+        _legs.append(new Leg(_waypoints[_waypoints.size()-2], _waypoints.last(), _aircraft, _wind, this));
+
     emit waypointsChanged();
 }
 
 
+QVariantList FlightRoute::airspaceBriefing() const
+{
+    QVariantList result;
+
+    for(int i=0; i<_legs.size(); i++) {
+        foreach(auto crossing, _legs[i]->airspaces()) {
+            auto map = crossing.toMap();
+            map.insert("leg", i);
+            result.append(map);
+        }
+    }
+
+    return result;
+}
+
+
+QVariantList FlightRoute::airspaceCrossings(const QGeoCoordinate& start, const QGeoCoordinate& end) const
+{
+    // Paranoid safety checks
+    if (_geoMapProvider.isNull())
+        return {};
+    if (!start.isValid() || !end.isValid())
+        return {};
+
+    // Check cache
+    auto key = airspaceCrossingCacheKey(start, end);
+    if (_airspaceCrossingCache.contains(key))
+        return _airspaceCrossingCache.value(key);
+
+    // Cut the great circle into pieces that are short enough to be treated as
+    // rhumb lines
+    auto lengthInM = start.distanceTo(end);
+    auto azimuth = start.azimuthTo(end);
+    auto numPieces = qMax(1, qCeil(lengthInM/maxAirspaceCrossingPieceLengthInM));
+    QList<QGeoCoordinate> points;
+    for(int i=0; i<numPieces; i++)
+        points.append(start.atDistanceAndAzimuth(i*lengthInM/numPieces, azimuth));
+    points.append(end);
+    QGeoRectangle boundingRectangle(points);
+
+    QVariantList result;
+    foreach(auto airspace, _geoMapProvider->allAirspaces()) {
+        if (airspace.isNull())
+            continue;
+        if (!airspace->boundingRectangle().intersects(boundingRectangle))
+            continue;
+
+        // Find the points where the leg crosses the airspace boundary, as
+        // distances from the start. Intersections at the end of a piece are
+        // ignored, because they are found again at the start of the next piece.
+        QList<double> crossingsInM;
+        for(int i=0; i<numPieces; i++) {
+            foreach(auto t, airspace->intersections(points[i], points[i+1])) {
+                if ((t >= 1.0) && (i < numPieces-1))
+                    continue;
+                crossingsInM.append((i+t)*lengthInM/numPieces);
+            }
+        }
+
+        // Walk along the leg and pair entries with exits
+        bool inside = airspace->contains(start);
+        if (!inside && crossingsInM.isEmpty())
+            continue;
+        double entryInM = 0.0;
+        QList<QPair<double, double>> passages;
+        foreach(auto crossingInM, crossingsInM) {
+            if (inside)
+                passages.append(qMakePair(entryInM, crossingInM));
+            else
+                entryInM = crossingInM;
+            inside = !inside;
+        }
+        if (inside)
+            passages.append(qMakePair(entryInM, lengthInM));
+
+        foreach(auto passage, passages) {
+            QVariantMap entry;
+            entry.insert("airspace", QVariant::fromValue(static_cast<QObject*>(airspace.data())));
+            entry.insert("name", airspace->name());
+            entry.insert("CAT", airspace->CAT());
+            entry.insert("lowerBound", airspace->lowerBound());
+            entry.insert("upperBound", airspace->upperBound());
+            entry.insert("entryInNM", AviationUnits::Distance::fromM(passage.first).toNM());
+            entry.insert("exitInNM", AviationUnits::Distance::fromM(passage.second).toNM());
+            result.append(entry);
+        }
+    }
+
+    // Sort airspaces according to point of entry
+    std::sort(result.begin(), result.end(), [](const QVariant &a, const QVariant &b) {return a.toMap()["entryInNM"].toDouble() < b.toMap()["entryInNM"].toDouble(); });
+
+    _airspaceCrossingCache.insert(key, result);
+    return result;
+}
+
+
+QString FlightRoute::airspaceCrossingCacheKey(const QGeoCoordinate& start, const QGeoCoordinate& end)
+{
+    return QString("%1 %2 %3 %4").arg(start.latitude(), 0, 'g', 17).arg(start.longitude(), 0, 'g', 17)
+            .arg(end.latitude(), 0, 'g', 17).arg(end.longitude(), 0, 'g', 17);
+}
+
+
+void FlightRoute::clearAirspaceCrossingCache()
+{
+    _airspaceCrossingCache.clear();
+    foreach(auto _leg, _legs)
+        emit _leg->airspacesChanged();
+    emit airspaceBriefingChanged();
+}
+
+
 QObject* FlightRoute::firstWaypointObject() const
 {
     if (_waypoints.isEmpty())
@@ -111,9 +252,15 @@ void FlightRoute::moveDown(QObject *waypoint)
     auto swp = dynamic_cast<Waypoint*>(waypoint);
 
     auto idx = _waypoints.indexOf(swp);
+    if ((idx < 0) || (idx >= _waypoints.size()-1))
+        return;
     _waypoints.move(idx, idx+1);
 
-    updateLegs();
+    // Only the legs that touch the two swapped waypoints change
+    updateLeg(idx-1);
+    updateLeg(idx);
+    updateLeg(idx+1);
+
     emit waypointsChanged();
 }
 
@@ -131,10 +278,15 @@ void FlightRoute::moveUp(QObject *waypoint)
     auto swp = dynamic_cast<Waypoint*>(waypoint);
 
     auto idx = _waypoints.indexOf(swp);
-    if (idx > 0)
-        _waypoints.move(idx, idx-1);
+    if (idx <= 0)
+        return;
+    _waypoints.move(idx, idx-1);
+
+    // Only the legs that touch the two swapped waypoints change
+    updateLeg(idx-2);
+    updateLeg(idx-1);
+    updateLeg(idx);
 
-    updateLegs();
     emit waypointsChanged();
 }
 
@@ -149,10 +301,19 @@ void FlightRoute::removeWaypoint(QObject *waypoint)
 
     auto swp = dynamic_cast<Waypoint*>(waypoint);
 
-    _waypoints.removeOne(swp);
+    auto idx = _waypoints.indexOf(swp);
+    if (idx < 0)
+        return;
+    _waypoints.removeAt(idx);
     delete swp;
 
-    updateLegs();
+    // Remove one leg. If the waypoint was in the middle of the route, the
+    // preceding leg now ends at the following waypoint.
+    if (!_legs.isEmpty()) {
+        _legs.takeAt(qMin(idx, _legs.size()-1))->deleteLater();
+        updateLeg(idx-1);
+    }
+
     emit waypointsChanged();
 }
 
@@ -160,26 +321,65 @@ void FlightRoute::removeWaypoint(QObject *waypoint)
 void FlightRoute::reverse()
 {
     std::reverse(_waypoints.begin(), _waypoints.end());
-    updateLegs();
+
+    // Re-use the existing legs, in reverse order
+    std::reverse(_legs.begin(), _legs.end());
+    for(int i=0; i<_legs.size(); i++)
+        updateLeg(i);
+
     emit waypointsChanged();
 }
 
 
-void FlightRoute::save()
+QString FlightRoute::fileName()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation)+"/flightPlan.dat";
+}
+
+
+QByteArray FlightRoute::serialize() const
 {
-    QFile file(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation)+"/flightPlan.dat");
-    file.open(QIODevice::WriteOnly);
-    QDataStream out(&file);
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
 
     out << streamVersion; // Stream version
     for(auto & _waypoint : _waypoints)
         out << *_waypoint;
+
+    return data;
+}
+
+
+void FlightRoute::save()
+{
+    // If the previous write is still running, try again later
+    if (_saveFuture.isRunning()) {
+        _saveTimer.start();
+        return;
+    }
+
+    // Serialize the route here, in the main thread, and write the data to disk
+    // in a separate thread
+    _saveFuture = QtConcurrent::run(&FlightRoute::writeFile, fileName(), serialize());
+}
+
+
+void FlightRoute::writeFile(const QString& fileName, const QByteArray& data)
+{
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly))
+        return;
+    if (file.write(data) != data.size()) {
+        file.cancelWriting();
+        return;
+    }
+    file.commit();
 }
 
 
 void FlightRoute::load()
 {
-    QFile file(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation)+"/flightPlan.dat");
+    QFile file(fileName());
     if (!file.exists())
         return;
 
@@ -207,6 +407,14 @@ void FlightRoute::load()
 }
 
 
+void FlightRoute::updateLeg(int index)
+{
+    if ((index < 0) || (index >= _legs.size()))
+        return;
+    _legs[index]->setWaypoints(_waypoints[index], _waypoints[index+1]);
+}
+
+
 void FlightRoute::updateLegs()
 {
     foreach(auto _leg, _legs)
@@ -218,6 +426,22 @@ void FlightRoute::updateLegs()
 }
 
 
+void FlightRoute::pruneAirspaceCrossingCache()
+{
+    // Remove cached airspace crossings for legs that no longer exist
+    QSet<QString> keys;
+    for(int i=0; i<_waypoints.size()-1; i++)
+        keys += airspaceCrossingCacheKey(_waypoints[i]->coordinate(), _waypoints[i+1]->coordinate());
+    auto it = _airspaceCrossingCache.begin();
+    while(it != _airspaceCrossingCache.end()) {
+        if (keys.contains(it.key()))
+            it++;
+        else
+            it = _airspaceCrossingCache.erase(it);
+    }
+}
+
+
 QList<QObject*> FlightRoute::routeObjects() const
 {
     QList<QObject*> result;
@@ -235,7 +459,25 @@ QList<QObject*> FlightRoute::routeObjects() const
 }
 
 
-QString FlightRoute::summary() const
+void FlightRoute::updateSummary()
+{
+    auto newSummary = computeSummary();
+    if (newSummary == _summary)
+        return;
+    _summary = newSummary;
+    emit summaryChanged();
+}
+
+
+void FlightRoute::updateWindTriangles()
+{
+    foreach(auto _leg, _legs)
+        _leg->updateWindTriangle();
+    updateSummary();
+}
+
+
+QString FlightRoute::computeSummary() const
 {
     if (_legs.empty())
         return {};
@@ -21,10 +21,13 @@
 #ifndef FLIGHTROUTE_H
 #define FLIGHTROUTE_H
 
+#include <QFuture>
 #include <QLocale>
 #include <QPointer>
+#include <QTimer>
 
 #include "Aircraft.h"
+#include "GeoMapProvider.h"
 #include "Waypoint.h"
 #include "Wind.h"
 
@@ -40,6 +43,9 @@
  *
  * - Compute length and true course for the legs in the flight path, as well as
  *   a total length and expose this data to QML.
+ *
+ * - Compute the airspaces crossed by the legs of the route. The results are
+ *   cached, so that they are computed only once for every leg.
  */
 
 class FlightRoute : public QObject
@@ -60,9 +66,13 @@ public:
      * @param wind Pointer to wind info that is used in route computations. The
      * wind object to supposed to exist throughout the liftime of this object.
      *
+     * @param geoMapProvider Pointer to the GeoMapProvider whose airspaces are
+     * used to compute the airspace briefing. The GeoMapProvider is supposed to
+     * exist throughout the lifetime of this object.
+     *
      * @param parent The standard QObject parent pointer.
      */
-    explicit FlightRoute(Aircraft *aircraft, Wind *wind, QObject *parent = nullptr);
+    explicit FlightRoute(Aircraft *aircraft, Wind *wind, GeoMapProvider *geoMapProvider, QObject *parent = nullptr);
 
     // No copy constructor
     FlightRoute(FlightRoute const&) = delete;
@@ -77,7 +87,7 @@ public:
     FlightRoute& operator=(FlightRoute&&) = delete;
 
     // Standard destructor
-    ~FlightRoute() override = default;
+    ~FlightRoute() override;
 
     /*! \brief Adds a waypoint to the end of the route
      *
@@ -100,6 +110,27 @@ public:
      */
     Q_INVOKABLE void append(const QGeoCoordinate& position) { append(new Waypoint(position, this)); }
 
+    /*! \brief Airspaces crossed by the route
+     *
+     * This property holds a list of all airspaces crossed by any of the legs
+     * of the route. There is one entry for every passage through an airspace,
+     * in the order in which they appear along the route. For better
+     * cooperation with QML, each entry is a QVariantMap, with the members
+     * described in FlightRoute::Leg::airspaces, and an additional member "leg"
+     * that holds the index of the leg.
+     *
+     * The data is computed once per leg and cached. It is recomputed only for
+     * legs whose start or end point change, or when the airspace data
+     * changes.
+     */
+    Q_PROPERTY(QVariantList airspaceBriefing READ airspaceBriefing NOTIFY airspaceBriefingChanged)
+
+    /*! \brief Getter function for the property with the same name
+     *
+     * @returns Property airspaceBriefing
+     */
+    QVariantList airspaceBriefing() const;
+
     /*! \brief First waypoint in the route
      *
      * This property holds a pointer to the first waypoint in the route, or a
@@ -180,7 +211,7 @@ public:
      *
      * @returns Property summary
      */
-    QString summary() const;
+    QString summary() const { return _summary; }
 
 public slots:
     /*! \brief Deletes all waypoints in the current route */
@@ -214,6 +245,9 @@ public slots:
     void reverse();
 
 signals:
+    /*! \brief Notification signal for the property with the same name */
+    void airspaceBriefingChanged();
+
     /*! \brief Notification signal for the property with the same name */
     void waypointsChanged();
 
@@ -223,8 +257,9 @@ signals:
 private slots:
     // Saves the route in "flightRoute.dat" contained in
     // QStandardPaths::writableLocation(QStandardPaths::AppDataLocation). This
-    // slot is called whenever the route changes, so that the file will always
-    // contain the current route.
+    // slot is called by _saveTimer, a short while after the route last
+    // changed, so that a quick succession of edits leads to only one write.
+    // The file is written in a separate thread.
     void save();
 
     // Loads the route from "flightRoute.dat" contained in
@@ -233,18 +268,86 @@ private slots:
     // restored automatically
     void load();
 
+    // Deletes all legs and constructs new ones. This is used when the route is
+    // loaded or cleared. All other edits of the route modify only those legs
+    // that are affected, using the method updateLeg().
     void updateLegs();
 
+    // Recomputes the summary and emits summaryChanged() if the summary has
+    // changed. This slot is called whenever the route changes.
+    void updateSummary();
+
+    // Recomputes the wind-dependent values of all legs in one pass, and then
+    // updates the summary. This slot is called whenever aircraft or wind
+    // change.
+    void updateWindTriangles();
+
+    // Clears the airspace crossing cache and emits the appropriate signals.
+    // This slot is called whenever the airspace data changes.
+    void clearAirspaceCrossingCache();
+
+    // Removes the entries of the airspace crossing cache that do not belong to
+    // a leg of the route, so that the cache does not grow while the route is
+    // edited. This slot is called whenever the waypoints change.
+    void pruneAirspaceCrossingCache();
+
 private:
+    // Sets start and end point of the leg with the given index to the
+    // waypoints with index and index+1. Does nothing if no leg with this index
+    // exists.
+    void updateLeg(int index);
+
+    // Computes the summary from the cached values of the legs
+    QString computeSummary() const;
+
+    // Computes the airspaces crossed by the great circle from start to end,
+    // as described in FlightRoute::Leg::airspaces. Results are cached in
+    // _airspaceCrossingCache.
+    QVariantList airspaceCrossings(const QGeoCoordinate& start, const QGeoCoordinate& end) const;
+
+    // Key for _airspaceCrossingCache
+    static QString airspaceCrossingCacheKey(const QGeoCoordinate& start, const QGeoCoordinate& end);
+
+    // Maximal length of the pieces into which legs are cut when computing
+    // airspace crossings. Each piece is treated as a rhumb line.
+    static constexpr double maxAirspaceCrossingPieceLengthInM = 10.0*1852.0;
+
     // Used to check compatibility when loading/saving
     static const quint16 streamVersion = 1;
 
+    // Name of the file where the route is stored
+    static QString fileName();
+
+    // Serializes the route into a QByteArray, in the format used by save() and
+    // load()
+    QByteArray serialize() const;
+
+    // Writes data to the file atomically, using QSaveFile, so that a crash
+    // never leaves a half-written file behind. This method is meant to be run
+    // in a separate thread.
+    static void writeFile(const QString& fileName, const QByteArray& data);
+
+    // Delay between the last change of the route and the save operation
+    static const int saveDelayInMS = 500;
+
+    // Timer used to coalesce save operations, and future that indicates if
+    // writeFile() is currently running
+    QTimer _saveTimer;
+    QFuture<void> _saveFuture;
+
     QList<Waypoint*> _waypoints;
 
     QList<Leg*> _legs;
 
     QPointer<Aircraft> _aircraft {nullptr};
     QPointer<Wind> _wind {nullptr};
+    QPointer<GeoMapProvider> _geoMapProvider {nullptr};
+
+    // Cache for airspaceCrossings(), indexed by airspaceCrossingCacheKey()
+    mutable QHash<QString, QVariantList> _airspaceCrossingCache;
+
+    // Cached summary, computed by updateSummary()
+    QString _summary;
 
     QLocale myLocale;
 };
@@ -23,77 +23,79 @@
 #include "FlightRoute_Leg.h"
 
 
-FlightRoute::Leg::Leg(const Waypoint* start, const Waypoint *end, Aircraft *aircraft, Wind *wind, QObject* parent)
-    : QObject(parent), _aircraft(aircraft), _wind(wind)
+FlightRoute::Leg::Leg(Waypoint* start, Waypoint *end, Aircraft *aircraft, Wind *wind, QObject* parent)
+    : QObject(parent), _start(start), _end(end), _aircraft(aircraft), _wind(wind)
 {
-    _start = new Waypoint(*start, this);
-    _end   = new Waypoint(*end, this);
-
-    if (!_aircraft.isNull())
-        connect(_aircraft, &Aircraft::valChanged, this, &FlightRoute::Leg::valChanged);
-    if (!_wind.isNull())
-        connect(_wind, &Wind::valChanged, this, &FlightRoute::Leg::valChanged);
+    updateGeometry();
+    computeWindTriangle();
 }
 
 
-AviationUnits::Distance FlightRoute::Leg::distance() const
+QVariantList FlightRoute::Leg::airspaces() const
 {
     // Paranoid safety checks
     if (!isValid())
         return {};
 
-    return AviationUnits::Distance::fromM( _start->coordinate().distanceTo( _end->coordinate() ));
+    auto route = qobject_cast<FlightRoute*>(parent());
+    if (route == nullptr)
+        return {};
+
+    return route->airspaceCrossings(_start->coordinate(), _end->coordinate());
 }
 
 
-double FlightRoute::Leg::Fuel() const
+void FlightRoute::Leg::updateGeometry()
 {
-    if (!hasDataForWindTriangle())
-        return qQNaN();
+    _distance = {};
+    _TC = {};
 
-    return _aircraft->fuelConsumptionInLPH()*Time().toH();
+    // Paranoid safety checks
+    if (!isValid())
+        return;
+
+    auto distanceInM = _start->coordinate().distanceTo( _end->coordinate() );
+    _distance = AviationUnits::Distance::fromM(distanceInM);
+    if (distanceInM >= minLegLength)
+        _TC = AviationUnits::Angle::fromDEG( _start->coordinate().azimuthTo(_end->coordinate()) );
 }
 
 
-AviationUnits::Speed FlightRoute::Leg::GS() const
+void FlightRoute::Leg::computeWindTriangle()
 {
+    _WCA = {};
+    _TH = {};
+    _GS = {};
+    _time = {};
+    _fuel = qQNaN();
+
     if (!hasDataForWindTriangle())
-        return {};
+        return;
 
     auto TASInKT = _aircraft->cruiseSpeedInKT();
     auto WSInKT  = _wind->windSpeedInKT();
     auto WD      = AviationUnits::Angle::fromDEG( _wind->windDirectionInDEG() );
 
-    // Law of cosine for wind triangle
-    auto GSInKT = qSqrt( TASInKT*TASInKT + WSInKT*WSInKT - 2.0*TASInKT*WSInKT*AviationUnits::Angle::cos(WD-TH()));
-
-    return AviationUnits::Speed::fromKT(GSInKT);
-}
-
+    // Law of sine for wind triangle
+    auto TAS = AviationUnits::Speed::fromKT(TASInKT);
+    auto WS  = AviationUnits::Speed::fromKT(WSInKT);
+    auto TC  = _TC;
+    _WCA = AviationUnits::Angle::asin(-AviationUnits::Angle::sin(TC-WD)*(WS/TAS));
+    _TH  = TC+_WCA;
 
-AviationUnits::Angle FlightRoute::Leg::TC() const
-{
-    // Paranoid safety checks
-    if (!isValid())
-        return {};
-    if( _start->coordinate().distanceTo( _end->coordinate() ) < minLegLength )
-        return {};
+    // Law of cosine for wind triangle
+    auto GSInKT = qSqrt( TASInKT*TASInKT + WSInKT*WSInKT - 2.0*TASInKT*WSInKT*AviationUnits::Angle::cos(WD-_TH));
+    _GS = AviationUnits::Speed::fromKT(GSInKT);
 
-    return AviationUnits::Angle::fromDEG( _start->coordinate().azimuthTo(_end->coordinate()) );
+    _time = _distance/_GS;
+    _fuel = _aircraft->fuelConsumptionInLPH()*_time.toH();
 }
 
 
-AviationUnits::Angle FlightRoute::Leg::WCA() const
+void FlightRoute::Leg::updateWindTriangle()
 {
-    if (!hasDataForWindTriangle())
-        return {};
-
-    AviationUnits::Speed TAS = AviationUnits::Speed::fromKT( _aircraft->cruiseSpeedInKT() );
-    AviationUnits::Speed WS  = AviationUnits::Speed::fromKT( _wind->windSpeedInKT() );
-    AviationUnits::Angle WD  = AviationUnits::Angle::fromDEG( _wind->windDirectionInDEG() );
-
-    // Law of sine for wind triangle
-    return AviationUnits::Angle::asin(-AviationUnits::Angle::sin(TC()-WD)*(WS/TAS));
+    computeWindTriangle();
+    emit valChanged();
 }
 
 
@@ -117,14 +119,13 @@ QString FlightRoute::Leg::description() const
         return QString();
 
     QString result;
-    result += QString("%1 NM").arg(distance().toNM(), 0, 'f', 1);
-    auto _time = Time();
+    result += QString("%1 NM").arg(_distance.toNM(), 0, 'f', 1);
     if (_time.isFinite())
         result += QString(" • %1 h").arg(_time.toHoursAndMinutes());
-    auto TCInDEG = TC().toNormalizedDEG();
+    auto TCInDEG = _TC.toNormalizedDEG();
     if (qIsFinite(TCInDEG))
         result += QString(" • TC %1°").arg(qRound(TCInDEG));
-    double THInDEG = TH().toNormalizedDEG();
+    double THInDEG = _TH.toNormalizedDEG();
     if (qIsFinite(THInDEG))
         result += QString(" • TH %1°").arg(qRound(THInDEG));
 
@@ -150,3 +151,17 @@ bool FlightRoute::Leg::hasDataForWindTriangle() const
 
     return true;
 }
+
+
+void FlightRoute::Leg::setWaypoints(Waypoint* start, Waypoint* end)
+{
+    if ((start == _start) && (end == _end))
+        return;
+
+    _start = start;
+    _end   = end;
+    updateGeometry();
+    computeWindTriangle();
+    emit valChanged();
+    emit airspacesChanged();
+}
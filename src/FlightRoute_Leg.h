@@ -34,10 +34,11 @@ class FlightRoute::Leg : public QObject
     Q_OBJECT
 
 public:
-  /*! \brief Constructs a flight route with given start and end point
+  /*! \brief Constructs a leg with given start and end point
    *
-   * The Waypoint start and end are copied, so that this class does not make any
-   * assumption about the lifetome of *start and *end
+   * The leg refers to the waypoints start and end, which are typically owned
+   * by the FlightRoute. The waypoints are not copied. If one of them is
+   * deleted, the leg becomes invalid.
    *
    * @param start Pointer to the starting point
    *
@@ -52,7 +53,7 @@ public:
    *
    * @param parent The standard QObject parent pointer.
    */
-  explicit Leg(const Waypoint* start, const Waypoint *end, Aircraft *aircraft, Wind *wind, QObject *parent = nullptr);
+  explicit Leg(Waypoint* start, Waypoint *end, Aircraft *aircraft, Wind *wind, QObject *parent = nullptr);
   
   // No copy constructor
   Leg(Leg const&) = delete;
@@ -69,14 +70,41 @@ public:
   // Standard destructor
   ~Leg() override = default;
   
+  /*! \brief Airspaces crossed by this leg
+   *
+   * This property holds a list of the airspaces that the leg crosses, in the
+   * order of entry. For better cooperation with QML, each entry is a
+   * QVariantMap with the following members.
+   *
+   * - "airspace": Pointer to the Airspace, as a QObject*
+   *
+   * - "name", "CAT", "lowerBound", "upperBound": Name, category and vertical
+   *   bounds of the airspace, as described in the class Airspace
+   *
+   * - "entryInNM", "exitInNM": Distance from the start of the leg to the points
+   *   where the leg enters and leaves the airspace, in nautical miles. If the
+   *   leg starts inside the airspace, the entry distance is 0. If the leg ends
+   *   inside the airspace, the exit distance is the length of the leg.
+   *
+   * The data is computed only once and cached by the FlightRoute that owns
+   * this leg.
+   */
+  Q_PROPERTY(QVariantList airspaces READ airspaces NOTIFY airspacesChanged)
+
+  /*! \brief Getter function for property of the same name
+   *
+   * @returns Property airspaces
+   */
+  QVariantList airspaces() const;
+
   /*! \brief Length of the leg */
-  Q_PROPERTY(AviationUnits::Distance distance READ distance CONSTANT)
+  Q_PROPERTY(AviationUnits::Distance distance READ distance NOTIFY valChanged)
   
   /*! \brief Getter function for property of the same name
    *
    * @returns Property distance
    */
-  AviationUnits::Distance distance() const;
+  AviationUnits::Distance distance() const { return _distance; }
   
   /*! \brief Fuel
    *
@@ -89,7 +117,7 @@ public:
    *
    * @returns Property Fuel
    */
-  double Fuel() const;
+  double Fuel() const { return _fuel; }
   
   /*! \brief Ground speed
    *
@@ -102,7 +130,7 @@ public:
    *
    * @returns Property GS
    */
-  AviationUnits::Speed GS() const;
+  AviationUnits::Speed GS() const { return _GS; }
   
   /*! \brief True course
    *
@@ -115,7 +143,7 @@ public:
    *
    * @returns Property TC
    */
-  AviationUnits::Angle TC() const;
+  AviationUnits::Angle TC() const { return _TC; }
   
   /*! \brief Time required for this leg. 
    *
@@ -127,19 +155,19 @@ public:
    *
    * @returns Property Time
    */
-  AviationUnits::Time Time() const{ return distance()/GS(); }
+  AviationUnits::Time Time() const { return _time; }
   
   /*! \brief True heading.
    *
    * Set to NaN if a TH cannot be computed.
    */
-  Q_PROPERTY(AviationUnits::Angle TH READ TH CONSTANT)
+  Q_PROPERTY(AviationUnits::Angle TH READ TH NOTIFY valChanged)
   
   /*! \brief Getter function for property of the same name
    *
    * @returns Property TH
    */
-  AviationUnits::Angle TH() const { return TC()+WCA(); }
+  AviationUnits::Angle TH() const { return _TH; }
   
   /*! \brief Human-readable description of the leg */
   Q_PROPERTY(QString description READ description NOTIFY valChanged)
@@ -162,9 +190,34 @@ public:
    *
    * @returns Wind correction angle, or NaN if a WCA cannot be computed
    */
-  AviationUnits::Angle WCA() const;
+  AviationUnits::Angle WCA() const { return _WCA; }
+
+  /*! \brief Sets start and end point of the leg
+   *
+   * This method is used by FlightRoute to modify legs in place when the route
+   * is edited, instead of constructing new legs. If start or end point
+   * change, the signals valChanged() and airspacesChanged() are emitted.
+   *
+   * @param start Pointer to the starting point
+   *
+   * @param end Pointer to the end point
+   */
+  void setWaypoints(Waypoint* start, Waypoint* end);
+
+  /*! \brief Recomputes the wind-dependent values of the leg
+   *
+   * The leg caches all values that it exposes. Distance and true course are
+   * computed whenever start or end point are set. Wind correction angle, true
+   * heading, ground speed, time and fuel depend on aircraft and wind. The
+   * FlightRoute calls this method for all of its legs whenever aircraft or
+   * wind change. The signal valChanged() is emitted.
+   */
+  void updateWindTriangle();
   
 signals:
+  /*! \brief Notification signal for the property with the same name */
+  void airspacesChanged();
+
   /*! \brief Notification signal */
   void valChanged();
   
@@ -172,8 +225,24 @@ private:
   // Necessary data for computation of wind triangle?
   bool hasDataForWindTriangle() const;
   
+  // Computes _distance and _TC from start and end point
+  void updateGeometry();
+
+  // Computes the cached values that depend on aircraft and wind, without
+  // emitting any signals
+  void computeWindTriangle();
+
   // Minimum length of the leg in meters. If shorter, no courses are computed.
   static constexpr double minLegLength  =  100.0;
+
+  // Cached values, computed by updateGeometry() and computeWindTriangle()
+  AviationUnits::Distance _distance {};
+  AviationUnits::Angle _TC {};
+  AviationUnits::Angle _WCA {};
+  AviationUnits::Angle _TH {};
+  AviationUnits::Speed _GS {};
+  AviationUnits::Time _time {};
+  double _fuel {qQNaN()};
   
   QPointer<Waypoint> _start {nullptr};
   QPointer<Waypoint> _end {nullptr};
@@ -0,0 +1,122 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <QJsonDocument>
+
+#include "GeoJSONStreamParser.h"
+
+
+void GeoJSONStreamParser::addData(const QByteArray &data)
+{
+    if (_error || data.isEmpty())
+        return;
+    _bytesReceived += data.size();
+
+    auto begin = _buffer.size();
+    _buffer += data;
+    for(int i=begin; i<_buffer.size(); i++) {
+        auto c = _buffer.at(i);
+
+        // Inside strings, only the end of the string matters. Strings at the
+        // top level of the document are remembered, because one of them is
+        // the key "features".
+        if (_inString) {
+            if (_escape)
+                _escape = false;
+            else if (c == '\\')
+                _escape = true;
+            else if (c == '"') {
+                _inString = false;
+                if (_keyStart >= 0) {
+                    _lastKey = _buffer.mid(_keyStart+1, i-_keyStart-1);
+                    _keyStart = -1;
+                }
+            }
+            continue;
+        }
+
+        switch(c) {
+        case '"':
+            _inString = true;
+            if (_nesting.size() == 1)
+                _keyStart = i;
+            break;
+
+        case '{':
+            if (_started && _nesting.isEmpty()) {
+                _error = true;
+                return;
+            }
+            _started = true;
+            _nesting += c;
+            if (_inFeatures && (_nesting.size() == 3))
+                _featureStart = i;
+            break;
+
+        case '[':
+            if (_nesting.isEmpty()) {
+                _error = true;
+                return;
+            }
+            _nesting += c;
+            if ((_nesting.size() == 2) && (_lastKey == "features"))
+                _inFeatures = true;
+            break;
+
+        case '}':
+        case ']':
+            if (_nesting.isEmpty() || (_nesting.back() != ((c == '}') ? '{' : '['))) {
+                _error = true;
+                return;
+            }
+            _nesting.chop(1);
+            if ((c == '}') && (_featureStart >= 0) && (_nesting.size() == 2)) {
+                QJsonParseError parseError{};
+                auto document = QJsonDocument::fromJson(_buffer.mid(_featureStart, i-_featureStart+1), &parseError);
+                if (parseError.error != QJsonParseError::NoError) {
+                    _error = true;
+                    return;
+                }
+                _features.append(document.object());
+                _featureStart = -1;
+            }
+            if ((c == ']') && (_nesting.size() == 1))
+                _inFeatures = false;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    // Discard all data that is no longer needed
+    auto keep = _featureStart;
+    if ((keep < 0) || ((_keyStart >= 0) && (_keyStart < keep)))
+        keep = _keyStart;
+    if (keep < 0) {
+        _buffer.clear();
+        return;
+    }
+    _buffer.remove(0, keep);
+    if (_featureStart >= 0)
+        _featureStart -= keep;
+    if (_keyStart >= 0)
+        _keyStart -= keep;
+}
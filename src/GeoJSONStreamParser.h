@@ -0,0 +1,106 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef GEOJSONSTREAMPARSER_H
+#define GEOJSONSTREAMPARSER_H
+
+#include <QJsonObject>
+#include <QVector>
+
+
+/*! \brief Incremental parser for GeoJSON feature collections
+ *
+ * This class reads a GeoJSON document of type "FeatureCollection" in chunks
+ * of arbitrary size, for instance while the document is being downloaded. The
+ * parser keeps track of the nesting of objects and arrays, and every feature
+ * in the array "features" is parsed as soon as its last byte has arrived.
+ * Only the bytes of the feature that is currently incomplete are kept in
+ * memory.
+ */
+
+class GeoJSONStreamParser {
+public:
+    /*! \brief Constructs a parser that expects the beginning of a document */
+    GeoJSONStreamParser() = default;
+
+    /*! \brief Reads the next chunk of the document
+     *
+     * @param data Next chunk of data
+     */
+    void addData(const QByteArray &data);
+
+    /*! \brief Number of bytes read so far
+     *
+     * @returns Number of bytes passed to addData()
+     */
+    qint64 bytesReceived() const { return _bytesReceived; }
+
+    /*! \brief Features found so far
+     *
+     * @returns All features that have been parsed, in the order in which they
+     * appear in the document
+     */
+    QVector<QJsonObject> features() const { return _features; }
+
+    /*! \brief Indicates if the data is not a valid document
+     *
+     * @returns True if the data read so far cannot be the beginning of a
+     * valid GeoJSON document
+     */
+    bool hasError() const { return _error; }
+
+    /*! \brief Indicates if the document is complete
+     *
+     * @returns True if the top-level object of the document has been closed
+     * and no error occurred
+     */
+    bool isComplete() const { return _started && _nesting.isEmpty() && !_error; }
+
+private:
+    // Data that has been read but not yet consumed. This contains the
+    // incomplete feature, or the key string at the top level of the document
+    // that is currently read.
+    QByteArray _buffer;
+
+    // Stack of the objects and arrays that are currently open, each
+    // represented by its opening character
+    QByteArray _nesting;
+
+    bool _started{false};
+    bool _error{false};
+    bool _inString{false};
+    bool _escape{false};
+
+    // True while the parser is inside the array "features"
+    bool _inFeatures{false};
+
+    // Positions in _buffer where the current feature and the current key
+    // string begin, or -1
+    int _featureStart{-1};
+    int _keyStart{-1};
+
+    // Last key read at the top level of the document
+    QByteArray _lastKey;
+
+    qint64 _bytesReceived{0};
+    QVector<QJsonObject> _features;
+};
+
+#endif
@@ -19,6 +19,7 @@
  ***************************************************************************/
 
 #include <QtConcurrent/QtConcurrent>
+#include <QFileInfo>
 #include <QGeoCoordinate>
 #include <QJsonArray>
 #include <QJsonDocument>
@@ -26,7 +27,9 @@
 #include <QQmlEngine>
 #include <QRandomGenerator>
 
+#include "FileView.h"
 #include "GeoMapProvider.h"
+#include "TileNetworkAccessManager.h"
 #include "Waypoint.h"
 
 
@@ -42,12 +45,19 @@ GeoMapProvider::GeoMapProvider(MapManager *manager, GlobalSettings* settings, QO
 
     connect(_manager, &MapManager::geoMapFileContentChanged, this, &GeoMapProvider::aviationMapsChanged);
     connect(_manager, &MapManager::geoMapFileContentChanged, this, &GeoMapProvider::baseMapsChanged);
+    connect(_manager, &MapManager::geoMapDownloadDataReceived, this, &GeoMapProvider::ingestDownloadData);
     connect(_settings, &GlobalSettings::hideUpperAirspacesChanged, this, &GeoMapProvider::aviationMapsChanged);
+    connect(&_tileServer, &TileServer::tileServed, _manager, &MapManager::recordMapAccess);
 
     _aviationDataCacheTimer.setSingleShot(true);
     _aviationDataCacheTimer.setInterval(3*1000);
     connect(&_aviationDataCacheTimer, &QTimer::timeout, this, &GeoMapProvider::aviationMapsChanged);
 
+    // The style file points to the tile server. For testing, the environment
+    // variable ENROUTE_IN_PROCESS_TILES makes it point to the in-process
+    // transport of TileNetworkAccessManager instead. This works only with map
+    // renderers that use the network access manager of the QML engine.
+    _inProcessTiles = qEnvironmentVariableIsSet("ENROUTE_IN_PROCESS_TILES");
     _tileServer.listen(QHostAddress("127.0.0.1"));
     aviationMapsChanged();
     baseMapsChanged();
@@ -85,7 +95,7 @@ QList<QObject*> GeoMapProvider::airspaces(const QGeoCoordinate& position)
 
     QList<Airspace*> result;
     foreach(auto airspace, _airspaces_) {
-        if (airspace->polygon().contains(position))
+        if (airspace->contains(position))
             result.append(airspace);
     }
 
@@ -201,31 +211,84 @@ void GeoMapProvider::aviationMapsChanged()
         JSONFileNames += geoMapPtr->fileName();
     }
 
-    _aviationDataCacheFuture = QtConcurrent::run(this, &GeoMapProvider::fillAviationDataCache, JSONFileNames, _settings->hideUpperAirspaces());
+    // Hand over the features of all files whose download is complete
+    QHash<QString, AviationFileData> ingestedFiles;
+    foreach(auto fileName, _ingestParsers.keys()) {
+        auto parser = _ingestParsers.value(fileName);
+        if (!parser->isComplete())
+            continue;
+        AviationFileData fileData;
+        fileData.size = parser->bytesReceived();
+        fileData.features = parser->features();
+        ingestedFiles.insert(fileName, fileData);
+        _ingestParsers.remove(fileName);
+    }
+
+    _aviationDataCacheFuture = QtConcurrent::run(this, &GeoMapProvider::fillAviationDataCache, JSONFileNames, _settings->hideUpperAirspaces(), ingestedFiles);
 }
 
 
-void GeoMapProvider::fillAviationDataCache(const QStringList& JSONFileNames, bool hideUpperAirspaces)
+void GeoMapProvider::ingestDownloadData(const QString& localFileName, qint64 offset, const QByteArray& data)
+{
+    // Ignore everything but geojson files
+    if (!localFileName.endsWith(".geojson", Qt::CaseInsensitive))
+        return;
+
+    // A download that starts from the beginning gets a new parser. If data is
+    // missing, e.g. because a download was resumed, the file will be read
+    // from disk instead.
+    if (offset == 0)
+        _ingestParsers.insert(localFileName, QSharedPointer<GeoJSONStreamParser>(new GeoJSONStreamParser()));
+    auto parser = _ingestParsers.value(localFileName);
+    if (parser.isNull())
+        return;
+    if (parser->bytesReceived() != offset) {
+        _ingestParsers.remove(localFileName);
+        return;
+    }
+
+    parser->addData(data);
+    if (parser->hasError())
+        _ingestParsers.remove(localFileName);
+}
+
+
+void GeoMapProvider::fillAviationDataCache(const QStringList& JSONFileNames, bool hideUpperAirspaces, const QHash<QString, AviationFileData>& ingestedFiles)
 {
     //
     // Generate new GeoJSON array and new list of waypoints
     //
 
-    // First, create a set of JSON objects, in order to avoid duplicated entries
-    QSet<QJsonObject> objectSet;
+    // First, update the cache of features for every file. Files are only read
+    // if they have changed since they were last read, and if they were not
+    // parsed during download.
+    QHash<QString, AviationFileData> newFileCache;
     foreach(auto JSONFileName, JSONFileNames) {
-        // Read the lock file
-        QLockFile lockFile(JSONFileName+".lock");
-        lockFile.lock();
-        QFile file(JSONFileName);
-        file.open(QIODevice::ReadOnly);
-        auto document = QJsonDocument::fromJson(file.readAll());
-        file.close();
-        lockFile.unlock();
-
-        foreach(auto value, document.object()["features"].toArray()) {
-            auto object = value.toObject();
+        // The view holds the lock file while the file is examined, and gives
+        // access to the file content without copying it
+        FileView view(JSONFileName);
+        QFileInfo info(JSONFileName);
+
+        auto fileData = _aviationFileCache_.value(JSONFileName);
+        if (ingestedFiles.contains(JSONFileName) && (ingestedFiles.value(JSONFileName).size == info.size())) {
+            fileData = ingestedFiles.value(JSONFileName);
+            fileData.lastModified = info.lastModified();
+        } else if ((fileData.lastModified != info.lastModified()) || (fileData.size != info.size())) {
+            auto document = QJsonDocument::fromJson(view.bytes());
+            fileData.lastModified = info.lastModified();
+            fileData.size = info.size();
+            fileData.features.clear();
+            foreach(auto value, document.object()["features"].toArray())
+                fileData.features.append(value.toObject());
+        }
+        newFileCache.insert(JSONFileName, fileData);
+    }
+    _aviationFileCache_ = newFileCache;
 
+    // Then, create a set of JSON objects, in order to avoid duplicated entries
+    QSet<QJsonObject> objectSet;
+    foreach(auto fileData, _aviationFileCache_) {
+        foreach(auto object, fileData.features) {
             // If 'hideUpperAirspaces' is set, ignore all objects that are airspaces
             // and that begin at FL100 or above.
             if (hideUpperAirspaces) {
@@ -301,8 +364,9 @@ void GeoMapProvider::baseMapsChanged()
     QFile file(":/flightMap/osm-liberty.json");
     file.open(QIODevice::ReadOnly);
     QByteArray data = file.readAll();
-    data.replace("%URL%", (_tileServer.serverUrl()+"/"+_currentPath).toLatin1());
-    data.replace("%URL2%", _tileServer.serverUrl().toLatin1());
+    auto serverUrl = _inProcessTiles ? TileNetworkAccessManager::baseURL : _tileServer.serverUrl();
+    data.replace("%URL%", (serverUrl+"/"+_currentPath).toLatin1());
+    data.replace("%URL2%", serverUrl.toLatin1());
     _styleFile->open();
     _styleFile->write(data);
     _styleFile->close();
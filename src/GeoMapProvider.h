@@ -28,9 +28,11 @@
 #include <QMutexLocker>
 #include <QPointer>
 #include <QRegularExpression>
+#include <QSharedPointer>
 #include <QTemporaryFile>
 
 #include "Airspace.h"
+#include "GeoJSONStreamParser.h"
 #include "GlobalSettings.h"
 #include "MapManager.h"
 #include "TileServer.h"
@@ -44,7 +46,10 @@
  * served via two channels.
  *
  * - All files in GeoJSON format are concatenated, and the resulting compound
- *   GeoJSON is served via the geoJSON property of this class.
+ *   GeoJSON is served via the geoJSON property of this class. The features of
+ *   every file are cached, so that only files that have changed are read
+ *   again. Files that are downloaded are parsed while the data arrives, so
+ *   that they need not be read from disk at all.
  *
  * - A list of waypoints is generated and available via the waypoints property
  *
@@ -97,6 +102,16 @@ public:
      */
     Q_INVOKABLE QList<QObject*> airspaces(const QGeoCoordinate& position);
 
+    /*! \brief All airspaces
+     *
+     * @returns a list of all airspaces known to this GeoMapProvider (that is,
+     * the union of all airspaces in any of the installed maps)
+     */
+    QList<QPointer<Airspace>> allAirspaces() {
+        QMutexLocker locker(&_aviationDataMutex);
+        return _airspaces_;
+    }
+
     /*! \brief Find closest waypoint to a given position
      *
      * @param position Position near which waypoints are searched for
@@ -164,6 +179,15 @@ public:
      */
     QString styleFileURL() const;
 
+    /*! \brief Tile server that serves the base map
+     *
+     * The tile server can be used with a TileNetworkAccessManager, to
+     * retrieve tiles without going through TCP.
+     *
+     * @returns Pointer to the tile server
+     */
+    TileServer *tileServer() { return &_tileServer; }
+
     /*! \brief Waypoints
      *
      * @returns a list of all waypoints known to this GeoMapProvider (that is,
@@ -195,10 +219,29 @@ private:
     // fills the aviation data cache.
     void aviationMapsChanged();
 
+    // Features of one GeoJSON file, together with modification time and size
+    // of the file from which they were read
+    struct AviationFileData {
+        QDateTime lastModified;
+        qint64 size{-1};
+        QVector<QJsonObject> features;
+    };
+
     // Interal function that does most of the work for aviationMapsChanged() emits
-    // geoJSONChanged() when done. This function is meant to be run in a separate
-    // thread.
-    void fillAviationDataCache(const QStringList& JSONFileNames, bool hideUpperAirspaces);
+    // geoJSONChanged() when done. Files are read only if they are not found
+    // in _aviationFileCache_ or in ingestedFiles, which holds the features of
+    // files that have been parsed during download. This function is meant to
+    // be run in a separate thread.
+    void fillAviationDataCache(const QStringList& JSONFileNames, bool hideUpperAirspaces, const QHash<QString, AviationFileData>& ingestedFiles);
+
+    // This slot is called whenever data of a GeoJSON file download arrives. It
+    // feeds the data to the parser in _ingestParsers that belongs to the file.
+    void ingestDownloadData(const QString& localFileName, qint64 offset, const QByteArray& data);
+
+    // Parsers for GeoJSON files that are currently downloaded, indexed by file
+    // name. Once the download is complete, the features are handed over to
+    // fillAviationDataCache().
+    QHash<QString, QSharedPointer<GeoJSONStreamParser>> _ingestParsers;
 
     // This slot is called every time the the set of MBTile files changes. It
     // sets up the tile server to and generates a new style file.
@@ -218,6 +261,10 @@ private:
     // Tile Server
     TileServer _tileServer;
 
+    // If true, the style file directs clients to TileNetworkAccessManager::baseURL
+    // instead of _tileServer.serverUrl()
+    bool _inProcessTiles {false};
+
     // Temporary file that holds the current style file
     QPointer<QTemporaryFile> _styleFile;
 
@@ -234,6 +281,11 @@ private:
     QList<QPointer<Waypoint>> _waypoints_;       // Cache: Waypoints
     QList<QPointer<Airspace>> _airspaces_;       // Cache: Airspaces
 
+    // Features of the GeoJSON files, indexed by file name. This is accessed
+    // only by fillAviationDataCache(), which never runs twice at the same
+    // time.
+    QHash<QString, AviationFileData> _aviationFileCache_;
+
 };
 
 #endif
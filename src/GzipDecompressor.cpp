@@ -0,0 +1,102 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <QElapsedTimer>
+#include <zlib.h>
+
+#include "GzipDecompressor.h"
+
+
+GzipDecompressor::GzipDecompressor()
+{
+    _stream = new z_stream;
+    _stream->zalloc = Z_NULL;
+    _stream->zfree = Z_NULL;
+    _stream->opaque = Z_NULL;
+    _stream->next_in = Z_NULL;
+    _stream->avail_in = 0;
+
+    // Window size 15, plus 32 to detect gzip and zlib headers automatically
+    inflateInit2(_stream, 15+32);
+}
+
+
+GzipDecompressor::~GzipDecompressor()
+{
+    inflateEnd(_stream);
+    delete _stream;
+}
+
+
+void GzipDecompressor::reset()
+{
+    inflateReset(_stream);
+    _finished = false;
+    _bytesIn = 0;
+    _bytesOut = 0;
+    _decodeTimeInNS = 0;
+}
+
+
+bool GzipDecompressor::decompress(const QByteArray &input, QByteArray &output)
+{
+    if (input.isEmpty())
+        return true;
+    if (_finished)
+        return false;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    _stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.constData()));
+    _stream->avail_in = static_cast<uInt>(input.size());
+    bool success = true;
+    forever {
+        auto oldSize = output.size();
+        output.resize(oldSize+chunkSize);
+        _stream->next_out = reinterpret_cast<Bytef*>(output.data()+oldSize);
+        _stream->avail_out = chunkSize;
+
+        auto result = inflate(_stream, Z_NO_FLUSH);
+        auto produced = chunkSize-static_cast<int>(_stream->avail_out);
+        output.resize(oldSize+produced);
+        _bytesOut += produced;
+
+        if (result == Z_STREAM_END) {
+            _finished = true;
+            // Data after the end of the stream is treated as corruption
+            success = (_stream->avail_in == 0);
+            break;
+        }
+        if ((result != Z_OK) && (result != Z_BUF_ERROR)) {
+            success = false;
+            break;
+        }
+        // Stop once all input is consumed and inflate() has room to spare
+        if ((_stream->avail_in == 0) && (_stream->avail_out != 0))
+            break;
+        if (result == Z_BUF_ERROR)
+            break;
+    }
+    _bytesIn += input.size()-static_cast<qint64>(_stream->avail_in);
+
+    _decodeTimeInNS += timer.nsecsElapsed();
+    return success;
+}
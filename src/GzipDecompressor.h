@@ -0,0 +1,110 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef GZIPDECOMPRESSOR_H
+#define GZIPDECOMPRESSOR_H
+
+#include <QByteArray>
+
+struct z_stream_s;
+
+
+/*! \brief Streaming decompressor for gzip and zlib data
+ *
+ * This class decompresses data as it arrives, in chunks of arbitrary size, so
+ * that compressed downloads can be decompressed on the fly, without storing a
+ * compressed copy. The format (gzip or zlib) is detected automatically. The
+ * class also records the number of bytes read and written, and the time spent
+ * decompressing, in order to compute compression ratio and throughput.
+ */
+
+class GzipDecompressor {
+public:
+    /*! \brief Constructs a decompressor that is ready to receive data */
+    GzipDecompressor();
+
+    // No copy constructor
+    GzipDecompressor(GzipDecompressor const &) = delete;
+
+    // No assign operator
+    GzipDecompressor &operator=(GzipDecompressor const &) = delete;
+
+    // No move constructor
+    GzipDecompressor(GzipDecompressor &&) = delete;
+
+    // No move assignment operator
+    GzipDecompressor &operator=(GzipDecompressor &&) = delete;
+
+    // Standard destructor
+    ~GzipDecompressor();
+
+    /*! \brief Decompresses a chunk of data
+     *
+     * @param input Next chunk of compressed data
+     *
+     * @param output Decompressed data is appended to this array
+     *
+     * @returns False if the data is corrupted, or if there is data after the
+     * end of the compressed stream
+     */
+    bool decompress(const QByteArray &input, QByteArray &output);
+
+    /*! \brief Indicates whether the end of the compressed stream has been
+     * reached
+     *
+     * @returns True if the compressed stream is complete
+     */
+    bool isFinished() const { return _finished; }
+
+    /*! \brief Resets the decompressor, so that a new stream can be
+     * decompressed */
+    void reset();
+
+    /*! \brief Number of compressed bytes read since the last reset */
+    qint64 bytesIn() const { return _bytesIn; }
+
+    /*! \brief Number of decompressed bytes written since the last reset */
+    qint64 bytesOut() const { return _bytesOut; }
+
+    /*! \brief Compression ratio
+     *
+     * @returns bytesOut()/bytesIn(), or 0.0 if no data has been read
+     */
+    double compressionRatio() const { return (_bytesIn > 0) ? static_cast<double>(_bytesOut)/_bytesIn : 0.0; }
+
+    /*! \brief Decompression throughput
+     *
+     * @returns Number of decompressed bytes written per second spent in
+     * decompress(), or 0.0 if nothing has been measured
+     */
+    double throughputInBytesPerSecond() const { return (_decodeTimeInNS > 0) ? 1.0e9*_bytesOut/_decodeTimeInNS : 0.0; }
+
+private:
+    // Size of the chunks in which output is produced
+    static const int chunkSize = 64*1024;
+
+    z_stream_s *_stream{nullptr};
+    bool _finished{false};
+    qint64 _bytesIn{0};
+    qint64 _bytesOut{0};
+    qint64 _decodeTimeInNS{0};
+};
+
+#endif
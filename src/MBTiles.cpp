@@ -0,0 +1,547 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <QAtomicInt>
+#include <QCryptographicHash>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QObject>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QVariant>
+#include <QtMath>
+
+#include "MBTiles.h"
+
+
+const QString MBTiles::tileExtentMetadataName = "enroute_tile_extent";
+const QString MBTiles::regionMetadataName = "enroute_region";
+
+
+// Opens an SQLite database connection with a unique name, and removes the
+// connection when the object goes out of scope. This allows to use the static
+// methods of MBTiles from several threads at the same time.
+class MBTilesConnection {
+public:
+    explicit MBTilesConnection(const QString& fileName) {
+        static QAtomicInt counter;
+        _name = QString("MBTiles-%1").arg(counter.fetchAndAddRelaxed(1));
+        auto db = QSqlDatabase::addDatabase("QSQLITE", _name);
+        db.setDatabaseName(fileName);
+        db.open();
+    }
+
+    ~MBTilesConnection() {
+        {
+            auto db = QSqlDatabase::database(_name, false);
+            db.close();
+        }
+        QSqlDatabase::removeDatabase(_name);
+    }
+
+    QSqlDatabase database() const { return QSqlDatabase::database(_name, false); }
+
+private:
+    QString _name;
+};
+
+
+// Stores message in *errorMessage, if errorMessage is not nullptr, and
+// returns false
+static bool fail(QString *errorMessage, const QString& message)
+{
+    if (errorMessage != nullptr)
+        *errorMessage = message;
+    return false;
+}
+
+
+// Attaches the database file fileName under the name schema
+static bool attach(QSqlDatabase db, const QString& fileName, const QString& schema, QString *errorMessage)
+{
+    QSqlQuery query(db);
+    query.prepare("ATTACH DATABASE ? AS "+schema+";");
+    query.addBindValue(fileName);
+    if (!query.exec())
+        return fail(errorMessage, query.lastError().text());
+    return true;
+}
+
+
+static bool createDelta(QSqlDatabase db, const QString& oldFileName, const QString& newFileName, QString *errorMessage)
+{
+    if (!db.isOpen())
+        return fail(errorMessage, db.lastError().text());
+    if (!attach(db, oldFileName, "base", errorMessage))
+        return false;
+    if (!attach(db, newFileName, "target", errorMessage))
+        return false;
+
+    QSqlQuery query(db);
+    QStringList statements = {
+        "CREATE TABLE main.metadata (name text, value text);",
+        "CREATE TABLE main.tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);",
+        "CREATE TABLE main.removed_tiles (zoom_level integer, tile_column integer, tile_row integer);",
+        "CREATE TABLE main.base_tiles (zoom_level integer, tile_column integer, tile_row integer, md5 blob);",
+        "BEGIN TRANSACTION;",
+        "INSERT INTO main.metadata SELECT name, value FROM target.metadata;",
+
+        // Tiles that are new or changed
+        "INSERT INTO main.tiles SELECT t.zoom_level, t.tile_column, t.tile_row, t.tile_data FROM target.tiles t "
+        "LEFT JOIN base.tiles b ON b.zoom_level=t.zoom_level AND b.tile_column=t.tile_column AND b.tile_row=t.tile_row "
+        "WHERE b.tile_data IS NULL OR b.tile_data != t.tile_data;",
+
+        // Tiles that no longer exist
+        "INSERT INTO main.removed_tiles SELECT b.zoom_level, b.tile_column, b.tile_row FROM base.tiles b "
+        "WHERE NOT EXISTS (SELECT 1 FROM target.tiles t WHERE t.zoom_level=b.zoom_level AND t.tile_column=b.tile_column AND t.tile_row=b.tile_row);",
+
+        "CREATE UNIQUE INDEX main.tile_index ON tiles (zoom_level, tile_column, tile_row);",
+        "CREATE UNIQUE INDEX main.removed_tile_index ON removed_tiles (zoom_level, tile_column, tile_row);"
+    };
+    foreach(auto statement, statements) {
+        if (!query.exec(statement))
+            return fail(errorMessage, query.lastError().text());
+    }
+
+    // Record checksums of all old tiles that are changed or removed
+    QSqlQuery insertQuery(db);
+    insertQuery.prepare("INSERT INTO main.base_tiles VALUES (?, ?, ?, ?);");
+    if (!query.exec("SELECT b.zoom_level, b.tile_column, b.tile_row, b.tile_data FROM base.tiles b "
+                    "WHERE EXISTS (SELECT 1 FROM main.tiles d WHERE d.zoom_level=b.zoom_level AND d.tile_column=b.tile_column AND d.tile_row=b.tile_row) "
+                    "OR EXISTS (SELECT 1 FROM main.removed_tiles r WHERE r.zoom_level=b.zoom_level AND r.tile_column=b.tile_column AND r.tile_row=b.tile_row);"))
+        return fail(errorMessage, query.lastError().text());
+    while(query.next()) {
+        insertQuery.addBindValue(query.value(0));
+        insertQuery.addBindValue(query.value(1));
+        insertQuery.addBindValue(query.value(2));
+        insertQuery.addBindValue(QCryptographicHash::hash(query.value(3).toByteArray(), QCryptographicHash::Md5));
+        if (!insertQuery.exec())
+            return fail(errorMessage, insertQuery.lastError().text());
+    }
+
+    statements = {
+        "CREATE UNIQUE INDEX main.base_tile_index ON base_tiles (zoom_level, tile_column, tile_row);",
+        "COMMIT;",
+        "DETACH DATABASE base;",
+        "DETACH DATABASE target;"
+    };
+    foreach(auto statement, statements) {
+        if (!query.exec(statement))
+            return fail(errorMessage, query.lastError().text());
+    }
+    return true;
+}
+
+
+static bool applyDelta(QSqlDatabase db, const QString& deltaFileName, QString *errorMessage)
+{
+    if (!db.isOpen())
+        return fail(errorMessage, db.lastError().text());
+
+    // Check that "tiles" is an ordinary table
+    QSqlQuery query(db);
+    if (!query.exec("SELECT type FROM main.sqlite_master WHERE name='tiles';") || !query.first())
+        return fail(errorMessage, QObject::tr("The file does not contain any tiles."));
+    if (query.value(0).toString() != "table")
+        return fail(errorMessage, QObject::tr("The table of tiles cannot be modified."));
+
+    if (!attach(db, deltaFileName, "delta", errorMessage))
+        return false;
+    if (!db.transaction()) {
+        query.exec("DETACH DATABASE delta;");
+        return fail(errorMessage, db.lastError().text());
+    }
+
+    auto rollback = [&](const QString& message) {
+        db.rollback();
+        query.exec("DETACH DATABASE delta;");
+        return fail(errorMessage, message);
+    };
+
+    // Check that the tiles that the delta changes or removes exist in the
+    // local file, with the expected content
+    if (!query.exec("SELECT b.md5, m.tile_data FROM delta.base_tiles b "
+                    "LEFT JOIN main.tiles m ON m.zoom_level=b.zoom_level AND m.tile_column=b.tile_column AND m.tile_row=b.tile_row;"))
+        return rollback(query.lastError().text());
+    while(query.next()) {
+        if (query.value(1).isNull())
+            return rollback(QObject::tr("The update does not fit the installed version."));
+        if (QCryptographicHash::hash(query.value(1).toByteArray(), QCryptographicHash::Md5) != query.value(0).toByteArray())
+            return rollback(QObject::tr("The update does not fit the installed version."));
+    }
+
+    // Check that the tiles that the delta adds do not exist in the local file
+    if (!query.exec("SELECT count(*) FROM delta.tiles d "
+                    "JOIN main.tiles m ON m.zoom_level=d.zoom_level AND m.tile_column=d.tile_column AND m.tile_row=d.tile_row "
+                    "WHERE NOT EXISTS (SELECT 1 FROM delta.base_tiles b WHERE b.zoom_level=d.zoom_level AND b.tile_column=d.tile_column AND b.tile_row=d.tile_row);") || !query.first())
+        return rollback(query.lastError().text());
+    if (query.value(0).toLongLong() != 0)
+        return rollback(QObject::tr("The update does not fit the installed version."));
+
+    // Apply changes
+    QStringList statements = {
+        "DELETE FROM main.tiles WHERE EXISTS (SELECT 1 FROM delta.removed_tiles r "
+        "WHERE r.zoom_level=main.tiles.zoom_level AND r.tile_column=main.tiles.tile_column AND r.tile_row=main.tiles.tile_row);",
+        "DELETE FROM main.tiles WHERE EXISTS (SELECT 1 FROM delta.tiles d "
+        "WHERE d.zoom_level=main.tiles.zoom_level AND d.tile_column=main.tiles.tile_column AND d.tile_row=main.tiles.tile_row);",
+        "INSERT INTO main.tiles (zoom_level, tile_column, tile_row, tile_data) "
+        "SELECT zoom_level, tile_column, tile_row, tile_data FROM delta.tiles;",
+        "DELETE FROM main.metadata;",
+        "INSERT INTO main.metadata (name, value) SELECT name, value FROM delta.metadata;"
+    };
+    foreach(auto statement, statements) {
+        if (!query.exec(statement))
+            return rollback(query.lastError().text());
+    }
+
+    if (!db.commit())
+        return rollback(db.lastError().text());
+    query.exec("DETACH DATABASE delta;");
+    return true;
+}
+
+
+// Sets the metadata entry name of the main database to value
+static bool setMetadata(QSqlDatabase db, const QString& name, const QString& value, QString *errorMessage)
+{
+    QSqlQuery query(db);
+    query.prepare("DELETE FROM main.metadata WHERE name=?;");
+    query.addBindValue(name);
+    if (!query.exec())
+        return fail(errorMessage, query.lastError().text());
+    query.prepare("INSERT INTO main.metadata VALUES (?, ?);");
+    query.addBindValue(name);
+    query.addBindValue(value);
+    if (!query.exec())
+        return fail(errorMessage, query.lastError().text());
+    return true;
+}
+
+
+// Records the tile extents of the main database in the metadata entry
+// MBTiles::tileExtentMetadataName. The query is answered from the index.
+static bool writeTileExtents(QSqlDatabase db, QString *errorMessage)
+{
+    QJsonObject extents;
+    QSqlQuery query(db);
+    if (!query.exec("SELECT zoom_level, min(tile_column), max(tile_column), min(tile_row), max(tile_row) "
+                    "FROM main.tiles GROUP BY zoom_level;"))
+        return fail(errorMessage, query.lastError().text());
+    while(query.next())
+        extents.insert(query.value(0).toString(), QJsonArray({query.value(1).toInt(), query.value(2).toInt(),
+                                                              query.value(3).toInt(), query.value(4).toInt()}));
+    return setMetadata(db, MBTiles::tileExtentMetadataName, QString::fromUtf8(QJsonDocument(extents).toJson(QJsonDocument::Compact)), errorMessage);
+}
+
+
+// Creates the tables of an empty MBTiles file in the main database, with page
+// size MBTiles::optimizedPageSize, attaches fileName as "source" and copies
+// the metadata. Checks that "tiles" is an ordinary table in the source.
+static bool createFrom(QSqlDatabase db, const QString& fileName, QString *errorMessage)
+{
+    if (!db.isOpen())
+        return fail(errorMessage, db.lastError().text());
+
+    // The page size must be set before the first table is created
+    QSqlQuery query(db);
+    if (!query.exec(QString("PRAGMA main.page_size=%1;").arg(MBTiles::optimizedPageSize)))
+        return fail(errorMessage, query.lastError().text());
+    if (!attach(db, fileName, "source", errorMessage))
+        return false;
+
+    // Check that "tiles" is an ordinary table
+    if (!query.exec("SELECT type FROM source.sqlite_master WHERE name='tiles';") || !query.first())
+        return fail(errorMessage, QObject::tr("The file does not contain any tiles."));
+    if (query.value(0).toString() != "table")
+        return fail(errorMessage, QObject::tr("The table of tiles cannot be modified."));
+
+    QStringList statements = {
+        "CREATE TABLE main.metadata (name text, value text);",
+        "CREATE TABLE main.tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);",
+        "CREATE UNIQUE INDEX main.tile_index ON tiles (zoom_level, tile_column, tile_row);",
+        "INSERT INTO main.metadata SELECT name, value FROM source.metadata WHERE name!='"+MBTiles::tileExtentMetadataName+"';"
+    };
+    foreach(auto statement, statements) {
+        if (!query.exec(statement))
+            return fail(errorMessage, query.lastError().text());
+    }
+    return true;
+}
+
+
+static bool optimize(QSqlDatabase db, const QString& fileName, QString *errorMessage)
+{
+    if (!createFrom(db, fileName, errorMessage))
+        return false;
+
+    QSqlQuery query(db);
+    QStringList statements = {
+        "BEGIN TRANSACTION;",
+
+        // Tiles in clustered order
+        "INSERT INTO main.tiles SELECT zoom_level, tile_column, tile_row, tile_data FROM source.tiles "
+        "ORDER BY zoom_level, tile_column, tile_row;"
+    };
+    foreach(auto statement, statements) {
+        if (!query.exec(statement))
+            return fail(errorMessage, query.lastError().text());
+    }
+
+    if (!writeTileExtents(db, errorMessage))
+        return false;
+
+    statements = {
+        "COMMIT;",
+        "DETACH DATABASE source;",
+        "ANALYZE main;"
+    };
+    foreach(auto statement, statements) {
+        if (!query.exec(statement))
+            return fail(errorMessage, query.lastError().text());
+    }
+    return true;
+}
+
+
+// Latitudes beyond this value are not covered by web mercator tiles
+static const double maxLatitude = 85.05112878;
+
+
+// Tile column that contains the longitude, at zoom level z
+static int tileColumn(double longitude, int z)
+{
+    auto n = 1 << z;
+    auto x = static_cast<int>(std::floor((longitude+180.0)/360.0*n));
+    return qBound(0, x, n-1);
+}
+
+
+// Tile row that contains the latitude, at zoom level z. Rows are counted from
+// the south, as in the MBTiles specification.
+static int tileRow(double latitude, int z)
+{
+    auto n = 1 << z;
+    auto latRad = qBound(-maxLatitude, latitude, maxLatitude)*M_PI/180.0;
+    auto y = static_cast<int>(std::floor((1.0-std::log(std::tan(latRad)+1.0/std::cos(latRad))/M_PI)/2.0*n));
+    return (n-1)-qBound(0, y, n-1);
+}
+
+
+static bool extract(QSqlDatabase db, const QString& fileName, const QVector<QRectF>& boxes, int minZoom, int maxZoom, const QString& region, QString *errorMessage)
+{
+    if (!createFrom(db, fileName, errorMessage))
+        return false;
+
+    QSqlQuery query(db);
+    if (!query.exec("BEGIN TRANSACTION;"))
+        return fail(errorMessage, query.lastError().text());
+
+    // Copy the tiles of every box, zoom level by zoom level. Boxes may
+    // overlap, so tiles that have already been copied are ignored.
+    QSqlQuery insertQuery(db);
+    insertQuery.prepare("INSERT OR IGNORE INTO main.tiles SELECT zoom_level, tile_column, tile_row, tile_data FROM source.tiles "
+                        "WHERE zoom_level=? AND tile_column BETWEEN ? AND ? AND tile_row BETWEEN ? AND ? "
+                        "ORDER BY tile_column, tile_row;");
+    for(int z=minZoom; z<=maxZoom; z++) {
+        foreach(auto box, boxes) {
+            insertQuery.addBindValue(z);
+            insertQuery.addBindValue(tileColumn(box.left(), z));
+            insertQuery.addBindValue(tileColumn(box.right(), z));
+            insertQuery.addBindValue(tileRow(box.top(), z));
+            insertQuery.addBindValue(tileRow(box.bottom(), z));
+            if (!insertQuery.exec())
+                return fail(errorMessage, insertQuery.lastError().text());
+        }
+    }
+
+    // Update metadata
+    QRectF bounds;
+    foreach(auto box, boxes)
+        bounds = bounds.united(box);
+    bounds = bounds.intersected(QRectF(QPointF(-180.0, -maxLatitude), QPointF(180.0, maxLatitude)));
+    if (!setMetadata(db, "bounds", QString("%1,%2,%3,%4").arg(bounds.left()).arg(bounds.top()).arg(bounds.right()).arg(bounds.bottom()), errorMessage))
+        return false;
+    if (!query.exec("SELECT min(zoom_level), max(zoom_level) FROM main.tiles;") || !query.first())
+        return fail(errorMessage, query.lastError().text());
+    if (query.value(0).isNull())
+        return fail(errorMessage, QObject::tr("The region does not contain any tiles."));
+    auto actualMinZoom = query.value(0).toString();
+    auto actualMaxZoom = query.value(1).toString();
+    if (!setMetadata(db, "minzoom", actualMinZoom, errorMessage) || !setMetadata(db, "maxzoom", actualMaxZoom, errorMessage))
+        return false;
+    if (!setMetadata(db, MBTiles::regionMetadataName, region, errorMessage))
+        return false;
+    if (!writeTileExtents(db, errorMessage))
+        return false;
+
+    QStringList statements = {
+        "COMMIT;",
+        "DETACH DATABASE source;",
+        "ANALYZE main;"
+    };
+    foreach(auto statement, statements) {
+        if (!query.exec(statement))
+            return fail(errorMessage, query.lastError().text());
+    }
+    return true;
+}
+
+
+bool MBTiles::createDelta(const QString& oldFileName, const QString& newFileName, const QString& deltaFileName, QString *errorMessage)
+{
+    // Paranoid safety checks
+    if (!QFile::exists(oldFileName))
+        return fail(errorMessage, QObject::tr("File %1 does not exist.").arg(oldFileName));
+    if (!QFile::exists(newFileName))
+        return fail(errorMessage, QObject::tr("File %1 does not exist.").arg(newFileName));
+
+    QFile::remove(deltaFileName);
+    bool success;
+    {
+        MBTilesConnection connection(deltaFileName);
+        success = ::createDelta(connection.database(), oldFileName, newFileName, errorMessage);
+    }
+    if (!success)
+        QFile::remove(deltaFileName);
+    return success;
+}
+
+
+bool MBTiles::applyDelta(const QString& fileName, const QString& deltaFileName, QString *errorMessage)
+{
+    // Paranoid safety checks
+    if (!QFile::exists(fileName))
+        return fail(errorMessage, QObject::tr("File %1 does not exist.").arg(fileName));
+    if (!QFile::exists(deltaFileName))
+        return fail(errorMessage, QObject::tr("File %1 does not exist.").arg(deltaFileName));
+
+    MBTilesConnection connection(fileName);
+    return ::applyDelta(connection.database(), deltaFileName, errorMessage);
+}
+
+
+bool MBTiles::optimize(const QString& fileName, const QString& optimizedFileName, QString *errorMessage)
+{
+    // Paranoid safety checks
+    if (!QFile::exists(fileName))
+        return fail(errorMessage, QObject::tr("File %1 does not exist.").arg(fileName));
+
+    QFile::remove(optimizedFileName);
+    bool success;
+    {
+        MBTilesConnection connection(optimizedFileName);
+        success = ::optimize(connection.database(), fileName, errorMessage);
+    }
+    if (!success)
+        QFile::remove(optimizedFileName);
+    return success;
+}
+
+
+bool MBTiles::isOptimized(const QString& fileName)
+{
+    return !metadataValue(fileName, tileExtentMetadataName).isEmpty();
+}
+
+
+QString MBTiles::metadataValue(const QString& fileName, const QString& name)
+{
+    // Paranoid safety checks
+    if (!QFile::exists(fileName))
+        return QString();
+
+    MBTilesConnection connection(fileName);
+    QSqlQuery query(connection.database());
+    query.prepare("SELECT value FROM metadata WHERE name=?;");
+    query.addBindValue(name);
+    if (!query.exec() || !query.first())
+        return QString();
+    return query.value(0).toString();
+}
+
+
+bool MBTiles::extract(const QString& fileName, const QString& extractFileName, const QVector<QRectF>& boxes, int minZoom, int maxZoom, QString *errorMessage)
+{
+    // Paranoid safety checks
+    if (!QFile::exists(fileName))
+        return fail(errorMessage, QObject::tr("File %1 does not exist.").arg(fileName));
+    if (boxes.isEmpty())
+        return fail(errorMessage, QObject::tr("The region is empty."));
+
+    // The region is recorded as given by the caller, so that it can be
+    // compared with the metadata entry later
+    auto region = regionDescription(boxes, minZoom, maxZoom);
+    minZoom = qBound(0, minZoom, maxZoomLevel);
+    maxZoom = (maxZoom < 0) ? maxZoomLevel : qBound(minZoom, maxZoom, maxZoomLevel);
+
+    QFile::remove(extractFileName);
+    bool success;
+    {
+        MBTilesConnection connection(extractFileName);
+        success = ::extract(connection.database(), fileName, boxes, minZoom, maxZoom, region, errorMessage);
+    }
+    if (!success)
+        QFile::remove(extractFileName);
+    return success;
+}
+
+
+QVector<QRectF> MBTiles::corridor(const QVector<QPointF>& route, double widthInKm)
+{
+    // Length of one degree of latitude, in km
+    const double kmPerDegree = 111.32;
+
+    QVector<QRectF> result;
+    auto halfWidth = qMax(widthInKm/2.0, 0.1);
+    auto box = [&](QPointF point) {
+        auto dLat = halfWidth/kmPerDegree;
+        auto dLon = halfWidth/(kmPerDegree*qMax(std::cos(qDegreesToRadians(point.y())), 0.01));
+        result += QRectF(QPointF(point.x()-dLon, point.y()-dLat), QPointF(point.x()+dLon, point.y()+dLat));
+    };
+
+    // Cover every leg with boxes whose centers are no more than half the
+    // corridor width apart
+    for(int i=0; i<route.size(); i++) {
+        if (i == 0) {
+            box(route[0]);
+            continue;
+        }
+        auto from = route[i-1];
+        auto to = route[i];
+        auto dx = (to.x()-from.x())*kmPerDegree*std::cos(qDegreesToRadians((from.y()+to.y())/2.0));
+        auto dy = (to.y()-from.y())*kmPerDegree;
+        auto steps = qMax(1, static_cast<int>(std::ceil(std::sqrt(dx*dx+dy*dy)/halfWidth)));
+        for(int step=1; step<=steps; step++)
+            box(from+(to-from)*step/steps);
+    }
+    return result;
+}
+
+
+QString MBTiles::regionDescription(const QVector<QRectF>& boxes, int minZoom, int maxZoom)
+{
+    QStringList result;
+    foreach(auto box, boxes)
+        result += QString("%1,%2,%3,%4").arg(box.left(), 0, 'f', 6).arg(box.top(), 0, 'f', 6).arg(box.right(), 0, 'f', 6).arg(box.bottom(), 0, 'f', 6);
+    return result.join(';')+QString("|%1-%2").arg(minZoom).arg(maxZoom);
+}
@@ -0,0 +1,223 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef MBTILES_H
+#define MBTILES_H
+
+#include <QRectF>
+#include <QString>
+#include <QVector>
+
+
+/*! \brief Operations on MBTiles files
+ *
+ * This class contains a few static methods that work on files in the MBTiles
+ * format, as specified in the MBTiles Specification 1.3
+ * (https://github.com/mapbox/mbtiles-spec/blob/master/1.3/spec.md).
+ *
+ * The class implements tile-level delta updates. A delta is itself an SQLite
+ * database, with the following tables.
+ *
+ * - "metadata" (name, value): the complete metadata table of the new version.
+ *
+ * - "tiles" (zoom_level, tile_column, tile_row, tile_data): all tiles that
+ *   have been added or changed in the new version.
+ *
+ * - "removed_tiles" (zoom_level, tile_column, tile_row): all tiles that exist
+ *   in the old version, but not in the new one.
+ *
+ * - "base_tiles" (zoom_level, tile_column, tile_row, md5): the MD5 checksum of
+ *   the old tile data, for every tile that has been changed or removed.
+ *
+ * When a delta is applied, the checksums in "base_tiles" are compared to the
+ * local file, and the tiles that the delta adds must not yet exist. A delta can
+ * therefore only be applied to exactly the version it was made from.
+ *
+ * The class also implements an optimization pass for MBTiles files, see
+ * optimize(), and the extraction of a region from an MBTiles file, see
+ * extract().
+ */
+
+class MBTiles {
+public:
+    /*! \brief Creates a delta between two versions of an MBTiles file
+     *
+     * @param oldFileName Name of the old version
+     *
+     * @param newFileName Name of the new version
+     *
+     * @param deltaFileName Name of the delta file that will be written. If the
+     * file exists, it is overwritten.
+     *
+     * @param errorMessage If not nullptr, an error message is stored here if
+     * the method fails
+     *
+     * @returns True on success
+     */
+    static bool createDelta(const QString& oldFileName, const QString& newFileName, const QString& deltaFileName, QString *errorMessage = nullptr);
+
+    /*! \brief Applies a delta to an MBTiles file
+     *
+     * The changes are applied in one SQLite transaction. If the delta does not
+     * fit the file, or if any error occurs, the file is left unchanged. The
+     * table "tiles" of the file must be an ordinary table; files where "tiles"
+     * is a view, as in the deduplicated layout used by some tile generators,
+     * are not supported.
+     *
+     * @param fileName Name of the MBTiles file that is updated
+     *
+     * @param deltaFileName Name of a delta file, as created by createDelta()
+     *
+     * @param errorMessage If not nullptr, an error message is stored here if
+     * the method fails
+     *
+     * @returns True on success
+     */
+    static bool applyDelta(const QString& fileName, const QString& deltaFileName, QString *errorMessage = nullptr);
+
+    /*! \brief Name of the metadata entry that holds the tile extents
+     *
+     * The value of this metadata entry is a JSON object that contains, for
+     * every zoom level, an array with the smallest and largest tile column and
+     * the smallest and largest tile row found in the file, such as {"0": [0,
+     * 0, 0, 0], "1": [0, 1, 0, 1]}. The entry is written by optimize(). It is
+     * dropped when a delta is applied, because the delta replaces the
+     * metadata.
+     */
+    static const QString tileExtentMetadataName;
+
+    /*! \brief Page size of optimized files, in bytes */
+    static const int optimizedPageSize = 16384;
+
+    /*! \brief Writes an optimized copy of an MBTiles file
+     *
+     * The optimized copy contains the same metadata and tiles as the
+     * original. The tiles are written in the order (zoom_level, tile_column,
+     * tile_row), so that tiles that are shown together are stored together,
+     * and the file is not fragmented. The page size is optimizedPageSize,
+     * which is large enough to hold most vector tiles without overflow pages.
+     * The copy has the unique index "tile_index" on (zoom_level, tile_column,
+     * tile_row), statistics for the query planner (ANALYZE), and the metadata
+     * entry tileExtentMetadataName. Files where "tiles" is a view, as in the
+     * deduplicated layout used by some tile generators, are not supported.
+     *
+     * The original file is not changed. Since the copy is not byte-identical
+     * to the original, block-level sync with BlockManifest will usually not
+     * work for an optimized file. Tile-level deltas will still work.
+     *
+     * @param fileName Name of the MBTiles file
+     *
+     * @param optimizedFileName Name of the optimized copy. If the file exists,
+     * it is overwritten.
+     *
+     * @param errorMessage If not nullptr, an error message is stored here if
+     * the method fails
+     *
+     * @returns True on success
+     */
+    static bool optimize(const QString& fileName, const QString& optimizedFileName, QString *errorMessage = nullptr);
+
+    /*! \brief Checks if an MBTiles file has been optimized
+     *
+     * @param fileName Name of the MBTiles file
+     *
+     * @returns True if the file contains the metadata entry
+     * tileExtentMetadataName
+     */
+    static bool isOptimized(const QString& fileName);
+
+    /*! \brief Reads a metadata entry of an MBTiles file
+     *
+     * @param fileName Name of the MBTiles file
+     *
+     * @param name Name of the metadata entry
+     *
+     * @returns Value of the entry, or an empty string if the file or the
+     * entry does not exist
+     */
+    static QString metadataValue(const QString& fileName, const QString& name);
+
+    /*! \brief Name of the metadata entry that describes an extracted region
+     *
+     * The value of this metadata entry is regionDescription() of the region
+     * that was used in extract().
+     */
+    static const QString regionMetadataName;
+
+    /*! \brief Largest zoom level supported by extract() */
+    static constexpr int maxZoomLevel = 22;
+
+    /*! \brief Writes the part of an MBTiles file that covers a region
+     *
+     * The region is a union of boxes in longitude and latitude, and a range
+     * of zoom levels. The extracted file contains all tiles of the original
+     * file within the zoom range that intersect one of the boxes. The tiles
+     * are copied box by box, directly from one SQLite database to the other,
+     * so that the tile data never needs to be held in memory. The extracted
+     * file is optimized as described in optimize(). The metadata entries
+     * "bounds", "minzoom" and "maxzoom" are adjusted, and the entry
+     * regionMetadataName is added.
+     *
+     * @param fileName Name of the MBTiles file
+     *
+     * @param extractFileName Name of the extracted file. If the file exists,
+     * it is overwritten.
+     *
+     * @param boxes Boxes, with longitude as x and latitude as y coordinate,
+     * in degrees. Use corridor() to construct boxes that cover a route.
+     *
+     * @param minZoom Smallest zoom level that is extracted
+     *
+     * @param maxZoom Largest zoom level that is extracted, or -1 for all
+     *
+     * @param errorMessage If not nullptr, an error message is stored here if
+     * the method fails
+     *
+     * @returns True on success. The method fails if the region contains no
+     * tiles.
+     */
+    static bool extract(const QString& fileName, const QString& extractFileName, const QVector<QRectF>& boxes, int minZoom, int maxZoom, QString *errorMessage = nullptr);
+
+    /*! \brief Boxes that cover a corridor around a route
+     *
+     * @param route Waypoints of the route, with longitude as x and latitude as
+     * y coordinate, in degrees
+     *
+     * @param widthInKm Width of the corridor, in kilometers
+     *
+     * @returns Boxes that cover every point whose distance from the route is
+     * less than half the width, suitable for extract()
+     */
+    static QVector<QRectF> corridor(const QVector<QPointF>& route, double widthInKm);
+
+    /*! \brief Describes a region as a string
+     *
+     * @param boxes Boxes, as in extract()
+     *
+     * @param minZoom Smallest zoom level, as in extract()
+     *
+     * @param maxZoom Largest zoom level, as in extract()
+     *
+     * @returns String that identifies the region
+     */
+    static QString regionDescription(const QVector<QRectF>& boxes, int minZoom, int maxZoom);
+};
+
+#endif
@@ -19,20 +19,57 @@
  ***************************************************************************/
 
 #include <QDirIterator>
+#include <QGeoRectangle>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QSettings>
+#include <QSqlDatabase>
+#include <QSqlQuery>
 #include <QStandardPaths>
+#include <QtConcurrent/QtConcurrent>
 #include <utility> 
+#include "FileView.h"
+#include "MBTiles.h"
 #include "MapManager.h"
 
 
-MapManager::MapManager(QNetworkAccessManager *networkAccessManager, QObject *parent) :
-    QObject(parent), _networkAccessManager(networkAccessManager)
+// Reads the "bounds" entry from the metadata table of an mbtiles file, as
+// described in the MBTiles Specification 1.3. Returns an invalid rectangle if
+// the file cannot be read or does not specify bounds.
+static QGeoRectangle mbtilesBounds(const QString& fileName)
+{
+    QGeoRectangle result;
+    {
+        auto db = QSqlDatabase::addDatabase("QSQLITE", "MapManager-"+fileName);
+        db.setDatabaseName(fileName);
+        db.setConnectOptions("QSQLITE_OPEN_READONLY");
+        if (db.open()) {
+            QSqlQuery query(db);
+            if (query.exec("select value from metadata where name='bounds';") && query.first()) {
+                auto bounds = query.value(0).toString().split(',');
+                if (bounds.size() == 4)
+                    result = QGeoRectangle(QGeoCoordinate(bounds[3].toDouble(), bounds[0].toDouble()),
+                                           QGeoCoordinate(bounds[1].toDouble(), bounds[2].toDouble()));
+            }
+            db.close();
+        }
+    }
+    QSqlDatabase::removeDatabase("MapManager-"+fileName);
+    return result;
+}
+
+
+MapManager::MapManager(QNetworkAccessManager *networkAccessManager, SatNav *satNav, QObject *parent) :
+    QObject(parent), _networkAccessManager(networkAccessManager), _satNav(satNav)
 {
     // Construct the Dowloadable object "_maps_json". Let it point to the remote file "maps.json" and wire it up.
-    _maps_json = new Downloadable(QUrl("https://cplx.vm.uni-freiburg.de/storage/enroute-GeoJSONv001/maps.json"),
+    // For testing, the environment variable ENROUTE_MAPS_JSON_URL can point to another server, such as the one
+    // started by "enroute-maptool serve".
+    QUrl mapsJSONURL("https://cplx.vm.uni-freiburg.de/storage/enroute-GeoJSONv001/maps.json");
+    if (qEnvironmentVariableIsSet("ENROUTE_MAPS_JSON_URL"))
+        mapsJSONURL = QUrl(qEnvironmentVariable("ENROUTE_MAPS_JSON_URL"));
+    _maps_json = new Downloadable(mapsJSONURL,
                                   QStandardPaths::writableLocation(QStandardPaths::AppDataLocation)+"/maps.json",
                                   networkAccessManager,
                                   this);
@@ -40,12 +77,45 @@ MapManager::MapManager(QNetworkAccessManager *networkAccessManager, QObject *par
     connect(_maps_json, &Downloadable::downloadingChanged, this, &MapManager::downloadingGeoMapListChanged);
     connect(_maps_json, &Downloadable::fileContentChanged, this, &MapManager::readGeoMapListFromJSONFile);
     connect(_maps_json, &Downloadable::fileContentChanged, this, &MapManager::setTimeOfLastUpdateToNow);
+    connect(_maps_json, &Downloadable::localFileConfirmedCurrent, this, &MapManager::setTimeOfLastUpdateToNow);
     connect(_maps_json, &Downloadable::error, this, &MapManager::errorReceiver);
 
     // Wire up the DownloadableGroup _geoMaps
     connect(&_geoMaps, &DownloadableGroup::downloadablesChanged, this, &MapManager::geoMapListChanged);
     connect(&_geoMaps, &DownloadableGroup::filesChanged, this, &MapManager::localFileOfGeoMapChanged);
     connect(&_geoMaps, &DownloadableGroup::localFileContentChanged, this, &MapManager::geoMapFileContentChanged);
+    connect(&_geoMaps, &DownloadableGroup::downloadDataReceived, this, &MapManager::geoMapDownloadDataReceived);
+    connect(&_geoMaps, &DownloadableGroup::queueChanged, this, &MapManager::downloadQueueChanged);
+
+    // Wire up map sharing
+    connect(&_geoMaps, &DownloadableGroup::filesChanged, this, &MapManager::updateSharedMaps);
+    connect(&_geoMaps, &DownloadableGroup::localFileContentChanged, this, &MapManager::updateSharedMaps);
+    connect(&_mapShare, &MapShare::peersChanged, this, &MapManager::updatePeerURLs);
+
+    // Wire up the reconciliation of the list of maps with "maps.json"
+    connect(&_geoMapListWatcher, &QFutureWatcher<GeoMapListDiff>::finished, this, &MapManager::applyGeoMapListDiff);
+    _readGeoMapListTimer.setSingleShot(true);
+    _readGeoMapListTimer.setInterval(1000);
+    connect(&_readGeoMapListTimer, &QTimer::timeout, this, &MapManager::readGeoMapListFromJSONFile);
+
+    // Restore storage budget and access statistics
+    QSettings settings;
+    _storageBudget = qMax(static_cast<qint64>(0), settings.value("MapManager/StorageBudget", 0).toLongLong());
+    _optimizeBaseMaps = settings.value("MapManager/OptimizeBaseMaps", false).toBool();
+    auto region = settings.value("MapManager/BaseMapRegion").toList();
+    if (region.size() == 4)
+        _baseMapRegion = QGeoRectangle(QGeoCoordinate(region[3].toDouble(), region[0].toDouble()), QGeoCoordinate(region[1].toDouble(), region[2].toDouble()));
+    _baseMapMaxZoom = settings.value("MapManager/BaseMapMaxZoom", -1).toInt();
+    _mapShare.setSharingEnabled(settings.value("MapManager/ShareMaps", false).toBool());
+    auto mapAccess = settings.value("MapManager/MapAccess").toMap();
+    for(auto iterator = mapAccess.constBegin(); iterator != mapAccess.constEnd(); ++iterator) {
+        auto access = iterator.value().toList();
+        if (access.size() != 2)
+            continue;
+        auto &storage = _mapStorage[downloadDirectory()+"/"+iterator.key()];
+        storage.lastAccess = access[0].toDateTime();
+        storage.accessCount = access[1].toLongLong();
+    }
 
     // Wire up the automatic update timer and check if automatic updates are
     // due. The method "autoUpdateGeoMapList" will also set a reasonable timeout
@@ -63,10 +133,22 @@ MapManager::MapManager(QNetworkAccessManager *networkAccessManager, QObject *par
 
 MapManager::~MapManager()
 {
+    // Save access statistics of the maps that still have a local file
+    QVariantMap mapAccess;
+    for(auto iterator = _mapStorage.constBegin(); iterator != _mapStorage.constEnd(); ++iterator) {
+        if ((iterator.value().size == 0) || !iterator.value().lastAccess.isValid())
+            continue;
+        auto relativeFileName = iterator.key().mid(downloadDirectory().size()+1);
+        mapAccess.insert(relativeFileName, QVariantList() << iterator.value().lastAccess << iterator.value().accessCount);
+    }
+    QSettings settings;
+    settings.setValue("MapManager/MapAccess", mapAccess);
+
     // It might be possible for whatever reason that our download directory
     // contains files that we do not know whom they belong to. We hunt down those
-    // files and silently delete them.
-    foreach(auto path, unattachedFiles())
+    // files and silently delete them, together with temporary files that were
+    // left behind.
+    foreach(auto path, unattachedFiles(true))
         QFile::remove(path);
 
     // It might be possible that our download directory contains empty
@@ -157,6 +239,15 @@ bool MapManager::downloadingGeoMapList() const
 }
 
 
+QList<QObject*> MapManager::downloadQueue() const
+{
+    QList<QObject*> result;
+    foreach(auto geoMapPtr, _geoMaps.queue())
+        result.append(geoMapPtr);
+    return result;
+}
+
+
 QString MapManager::geoMapUpdateSize() const
 {
     qint64 downloadSize = 0;
@@ -225,9 +316,274 @@ void MapManager::updateGeoMapList()
 
 void MapManager::updateGeoMaps()
 {
+    updateDownloadPriorities();
     foreach(auto geoMapPtr, _geoMaps.downloadables())
         if (geoMapPtr->updatable())
-            geoMapPtr->startFileDownload();
+            _geoMaps.queueDownload(geoMapPtr);
+}
+
+
+QSet<QString> MapManager::currentRegions() const
+{
+    // Find the names of the regions that contain the current position, by
+    // looking at the bounds of the installed base maps. Aviation maps and base
+    // maps of the same region have the same object name.
+    QSet<QString> result;
+    if (!_satNav.isNull()) {
+        auto position = _satNav->lastValidCoordinate();
+        foreach(auto geoMapPtr, baseMaps()) {
+            if (!geoMapPtr->hasFile())
+                continue;
+            auto bounds = _mbtilesBounds.constFind(geoMapPtr->fileName());
+            if (bounds == _mbtilesBounds.constEnd())
+                bounds = _mbtilesBounds.insert(geoMapPtr->fileName(), mbtilesBounds(geoMapPtr->fileName()));
+            if (bounds->contains(position))
+                result += geoMapPtr->objectName();
+        }
+    }
+    return result;
+}
+
+
+void MapManager::updateDownloadPriorities()
+{
+    auto regions = currentRegions();
+    foreach(auto geoMapPtr, _geoMaps.downloadables()) {
+        int priority = 0;
+        if (geoMapPtr->fileName().endsWith(".geojson", Qt::CaseInsensitive))
+            priority += 2;
+        if (regions.contains(geoMapPtr->objectName()))
+            priority += 1;
+        geoMapPtr->setPriority(priority);
+    }
+}
+
+
+void MapManager::setShareMaps(bool share)
+{
+    if (share == shareMaps())
+        return;
+
+    _mapShare.setSharingEnabled(share);
+    QSettings settings;
+    settings.setValue("MapManager/ShareMaps", shareMaps());
+    emit shareMapsChanged();
+}
+
+
+void MapManager::updateSharedMaps()
+{
+    // Maps that are not current, or no longer supported, are not shared.
+    // Neither are MBTiles files that have been rewritten by optimization or
+    // region extraction, because their checksum differs from the one in the
+    // list of maps. MBTiles::extract() records tile extents as well, so
+    // MBTiles::isOptimized() catches both.
+    QStringList fileNames;
+    foreach(auto geoMapPtr, _geoMaps.downloadables()) {
+        if (!geoMapPtr->url().isValid() || !geoMapPtr->hasFile() || geoMapPtr->updatable() || geoMapPtr->downloading())
+            continue;
+        if (geoMapPtr->fileName().endsWith(".mbtiles", Qt::CaseInsensitive) && MBTiles::isOptimized(geoMapPtr->fileName()))
+            continue;
+        fileNames += geoMapPtr->fileName();
+    }
+    _mapShare.setSharedFiles(downloadDirectory(), fileNames);
+}
+
+
+void MapManager::updatePeerURLs()
+{
+    foreach(auto geoMapPtr, _geoMaps.downloadables()) {
+        if (geoMapPtr->expectedSHA256().isEmpty())
+            continue;
+        geoMapPtr->setPeerURL(_mapShare.peerURL(geoMapPtr->expectedSHA256()));
+    }
+}
+
+
+void MapManager::setOptimizeBaseMaps(bool optimize)
+{
+    if (optimize == _optimizeBaseMaps)
+        return;
+
+    _optimizeBaseMaps = optimize;
+    QSettings settings;
+    settings.setValue("MapManager/OptimizeBaseMaps", _optimizeBaseMaps);
+    foreach(auto geoMapPtr, _geoMaps.downloadables())
+        applyBaseMapOptions(geoMapPtr);
+    emit optimizeBaseMapsChanged();
+}
+
+
+void MapManager::setBaseMapRegion(const QGeoRectangle& region)
+{
+    if (region == _baseMapRegion)
+        return;
+
+    _baseMapRegion = region;
+    QSettings settings;
+    if (_baseMapRegion.isValid())
+        settings.setValue("MapManager/BaseMapRegion", QVariantList({region.topLeft().longitude(), region.bottomRight().latitude(),
+                                                                   region.bottomRight().longitude(), region.topLeft().latitude()}));
+    else
+        settings.remove("MapManager/BaseMapRegion");
+    foreach(auto geoMapPtr, _geoMaps.downloadables())
+        applyBaseMapOptions(geoMapPtr);
+    emit baseMapRegionChanged();
+}
+
+
+void MapManager::setBaseMapMaxZoom(int maxZoom)
+{
+    if (maxZoom == _baseMapMaxZoom)
+        return;
+
+    _baseMapMaxZoom = maxZoom;
+    QSettings settings;
+    settings.setValue("MapManager/BaseMapMaxZoom", _baseMapMaxZoom);
+    foreach(auto geoMapPtr, _geoMaps.downloadables())
+        applyBaseMapOptions(geoMapPtr);
+    emit baseMapMaxZoomChanged();
+}
+
+
+void MapManager::applyBaseMapOptions(Downloadable *geoMapPtr)
+{
+    // Paranoid safety checks
+    if (geoMapPtr == nullptr)
+        return;
+
+    geoMapPtr->setOptimizeMBTiles(_optimizeBaseMaps);
+    QVector<QRectF> boxes;
+    if (_baseMapRegion.isValid())
+        boxes += QRectF(QPointF(_baseMapRegion.topLeft().longitude(), _baseMapRegion.bottomRight().latitude()),
+                        QPointF(_baseMapRegion.bottomRight().longitude(), _baseMapRegion.topLeft().latitude()));
+    geoMapPtr->setMBTilesRegion(boxes, 0, _baseMapMaxZoom);
+}
+
+
+void MapManager::setStorageBudget(qint64 storageBudget)
+{
+    storageBudget = qMax(static_cast<qint64>(0), storageBudget);
+    if (storageBudget == _storageBudget)
+        return;
+
+    _storageBudget = storageBudget;
+    QSettings settings;
+    settings.setValue("MapManager/StorageBudget", _storageBudget);
+    emit storageBudgetChanged();
+    emit evictionCandidatesChanged();
+}
+
+
+void MapManager::trackStorageOfGeoMap(Downloadable *geoMap)
+{
+    connect(geoMap, &Downloadable::hasFileChanged, this, &MapManager::updateStorageOfGeoMap);
+    connect(geoMap, &Downloadable::fileContentChanged, this, &MapManager::updateStorageOfGeoMap);
+
+    if (!geoMap->hasFile())
+        return;
+    auto &storage = _mapStorage[geoMap->fileName()];
+    _storageUsed -= storage.size;
+    storage.size = QFileInfo(geoMap->fileName()).size();
+    _storageUsed += storage.size;
+    emit storageUsedChanged();
+    emit evictionCandidatesChanged();
+}
+
+
+void MapManager::updateStorageOfGeoMap()
+{
+    auto geoMap = qobject_cast<Downloadable *>(sender());
+    if (geoMap == nullptr)
+        return;
+    _mbtilesBounds.remove(geoMap->fileName());
+
+    auto &storage = _mapStorage[geoMap->fileName()];
+    qint64 newSize = 0;
+    if (geoMap->hasFile())
+        newSize = QFileInfo(geoMap->fileName()).size();
+
+    // A freshly installed map counts as accessed
+    if ((storage.size == 0) && (newSize > 0))
+        storage.lastAccess = QDateTime::currentDateTimeUtc();
+
+    if (newSize == storage.size)
+        return;
+    _storageUsed += newSize-storage.size;
+    storage.size = newSize;
+    emit storageUsedChanged();
+    emit evictionCandidatesChanged();
+}
+
+
+void MapManager::recordMapAccess(const QString& fileName)
+{
+    auto iterator = _mapStorage.find(fileName);
+    if (iterator == _mapStorage.end())
+        return;
+    iterator->lastAccess = QDateTime::currentDateTimeUtc();
+    iterator->accessCount++;
+}
+
+
+QList<QObject*> MapManager::evictionCandidates() const
+{
+    QList<QObject*> result;
+    if ((_storageBudget == 0) || (_storageUsed <= _storageBudget))
+        return result;
+
+    // Group the installed maps by region
+    struct Region {
+        QList<Downloadable*> maps;
+        qint64 size {0};
+        QDateTime lastAccess;
+        qint64 accessCount {0};
+    };
+    QHash<QString, Region> regions;
+    auto excludedRegions = currentRegions();
+    foreach(auto geoMapPtr, _geoMaps.downloadables()) {
+        if (!geoMapPtr->hasFile() || geoMapPtr->downloading())
+            continue;
+        if (excludedRegions.contains(geoMapPtr->objectName()))
+            continue;
+        auto storage = _mapStorage.value(geoMapPtr->fileName());
+        auto &region = regions[geoMapPtr->objectName()];
+        region.maps += geoMapPtr;
+        region.size += storage.size;
+        region.accessCount += storage.accessCount;
+        if (!region.lastAccess.isValid() || (storage.lastAccess > region.lastAccess))
+            region.lastAccess = storage.lastAccess;
+    }
+
+    // Least recently used regions first
+    auto sortedRegions = regions.values();
+    std::sort(sortedRegions.begin(), sortedRegions.end(), [](const Region& a, const Region& b)
+    {
+        if (a.lastAccess != b.lastAccess)
+            return (a.lastAccess < b.lastAccess);
+        return (a.accessCount < b.accessCount);
+    }
+    );
+
+    auto excess = _storageUsed-_storageBudget;
+    foreach(auto region, sortedRegions) {
+        if (excess <= 0)
+            break;
+        foreach(auto geoMapPtr, region.maps)
+            result += geoMapPtr;
+        excess -= region.size;
+    }
+    return result;
+}
+
+
+void MapManager::evictLeastRecentlyUsedMaps()
+{
+    foreach(auto geoMapPtr, evictionCandidates()) {
+        auto downloadable = qobject_cast<Downloadable *>(geoMapPtr);
+        if (downloadable != nullptr)
+            downloadable->deleteFile();
+    }
 }
 
 
@@ -276,97 +632,198 @@ void MapManager::readGeoMapListFromJSONFile()
     if (!_maps_json->hasFile())
         return;
 
-    bool old_aviationMapUpdatesAvailable = geoMapUpdatesAvailable();
+    // If a reconciliation is already running, try again later. The result of
+    // the running reconciliation might be based on an older "maps.json".
+    if (_geoMapListWatcher.isRunning()) {
+        _readGeoMapListTimer.start();
+        return;
+    }
 
-    // List of maps as we have them now
-    QList<Downloadable *> oldMaps = _geoMaps.downloadables();
+    // Collect the object names and local file names of the maps as we have
+    // them now, so that the reconciliation thread does not need to touch the
+    // Downloadable objects
+    QSet<QString> existingObjectNames;
+    QSet<QString> attachedFileNames;
+    foreach(auto geoMapPtr, _geoMaps.downloadables()) {
+        existingObjectNames.insert(geoMapPtr->objectName());
+        attachedFileNames.insert(geoMapPtr->fileName());
+    }
 
-    // Alert all users that the list of maps is in an intermediate stage and that
-    // it should not be used for the moment
-    emit aboutToChangeAviationMapList();
+    _geoMapListWatcher.setFuture(QtConcurrent::run(&MapManager::reconcileGeoMapList, _maps_json->fileName(),
+                                                   existingObjectNames, attachedFileNames));
+}
+
+
+MapManager::GeoMapListDiff MapManager::reconcileGeoMapList(const QString& mapsJSONFileName,
+                                                           const QSet<QString>& existingObjectNames,
+                                                           QSet<QString> attachedFileNames)
+{
+    GeoMapListDiff result;
 
-    // To begin, we handle the maps described in the maps.json file. If these maps
-    // were already present in the old list, we re-use them. Otherwise, we create
-    // new Downloadable objects.
     QJsonParseError parseError{};
-    auto doc = QJsonDocument::fromJson(_maps_json->fileContent(), &parseError);
+    QJsonDocument doc;
+    {
+        FileView view(mapsJSONFileName);
+        doc = QJsonDocument::fromJson(view.bytes(), &parseError);
+    }
     if (parseError.error != QJsonParseError::NoError)
-        return;
+        return result;
 
     auto top = doc.object();
     auto baseURL = top.value("url").toString();
 
+    QSet<QString> listedObjectNames;
     foreach(auto map, top.value("maps").toArray()) {
         auto obj = map.toObject();
         auto mapFileName = obj.value("path").toString();
         auto mapName = mapFileName.section('.',-2,-2);
         auto mapUrlName = baseURL + "/"+ obj.value("path").toString();
-        auto fileModificationDateTime = QDateTime::fromString(obj.value("time").toString(), "yyyyMMdd");
-        auto fileSize = obj.value("size").toInt();
-
-        // If a map with the given name already exists, update that element, delete its entry in oldMaps
-        Downloadable *mapPtr = nullptr;
-        foreach(auto geoMapPtr, oldMaps) {
-            if (geoMapPtr->objectName() == mapName.section("/", -1 , -1)) {
-                mapPtr = geoMapPtr;
-                break;
-            }
-        }
 
-        if (mapPtr) {
-            // Map exists
-            oldMaps.removeAll(mapPtr);
-            mapPtr->setRemoteFileDate(fileModificationDateTime);
-            mapPtr->setRemoteFileSize(fileSize);
-        } else {
-            // Construct local file name
-            auto ending = mapUrlName.section(".", -1);
-            auto localFileName = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) +
-	      "/aviation_maps/"+mapFileName;
-            if (!ending.isEmpty())
-                localFileName += "."+ending;
-
-            // Construct a new downloadable object.
-            auto downloadable = new Downloadable(QUrl(mapUrlName), localFileName, _networkAccessManager, this);
-            downloadable->setObjectName(mapName.section("/", -1, -1));
-            downloadable->setSection(mapName.section("/", -2, -2));
-            downloadable->setRemoteFileDate(fileModificationDateTime);
-            downloadable->setRemoteFileSize(fileSize);
-            _geoMaps.addToGroup(downloadable);
+        GeoMapDescription description;
+        description.objectName = mapName.section("/", -1, -1);
+        description.section = mapName.section("/", -2, -2);
+        description.url = QUrl(mapUrlName);
+        description.remoteFileDate = QDateTime::fromString(obj.value("time").toString(), "yyyyMMdd");
+        description.remoteFileSize = obj.value("size").toInt();
+
+        // Deltas that update older versions of the map to this one
+        foreach(auto delta, obj.value("deltas").toArray()) {
+            auto deltaObj = delta.toObject();
+            auto baseDateTime = QDateTime::fromString(deltaObj.value("from").toString(), "yyyyMMdd");
+            if (!baseDateTime.isValid())
+                continue;
+            description.deltaURLs.insert(baseDateTime, QUrl(baseURL + "/" + deltaObj.value("path").toString()));
         }
 
+        // Block manifest, used to download only the changed parts of the map
+        if (obj.contains("blocks"))
+            description.blockManifestURL = QUrl(baseURL + "/" + obj.value("blocks").toString());
+
+        // Checksum and compressed copy of the map
+        description.sha256 = obj.value("sha256").toString().toLatin1();
+        if (obj.contains("gzip"))
+            description.compressedURL = QUrl(baseURL + "/" + obj.value("gzip").toString());
+
+        // Construct local file name
+        auto ending = mapUrlName.section(".", -1);
+        description.localFileName = downloadDirectory()+"/"+mapFileName;
+        if (!ending.isEmpty())
+            description.localFileName += "."+ending;
+        description.localFileName = QFileInfo(description.localFileName).absoluteFilePath();
+        attachedFileNames.insert(description.localFileName);
+
+        listedObjectNames.insert(description.objectName);
+        if (existingObjectNames.contains(description.objectName))
+            result.updated.append(description);
+        else
+            result.added.append(description);
+    }
+
+    foreach(auto objectName, existingObjectNames)
+        if (!listedObjectNames.contains(objectName))
+            result.removed.append(objectName);
+
+    result.unattachedFiles = unattachedFiles(attachedFileNames);
+    result.isValid = true;
+    return result;
+}
+
+
+void MapManager::applyGeoMapListDiff()
+{
+    auto diff = _geoMapListWatcher.result();
+    if (!diff.isValid)
+        return;
+
+    bool old_aviationMapUpdatesAvailable = geoMapUpdatesAvailable();
+    auto oldFiles = _geoMaps.files();
+    oldFiles.sort();
+    auto oldMbtileFiles = mbtileFiles();
+
+    // Alert all users that the list of maps is in an intermediate stage and that
+    // it should not be used for the moment
+    emit aboutToChangeAviationMapList();
+
+    // Index the maps as we have them now
+    QHash<QString, Downloadable *> mapsByObjectName;
+    QSet<QString> fileNames;
+    foreach(auto geoMapPtr, _geoMaps.downloadables()) {
+        mapsByObjectName.insert(geoMapPtr->objectName(), geoMapPtr);
+        fileNames.insert(geoMapPtr->fileName());
     }
 
-    // Now go through all the leftover objects in the old list of aviation
-    // maps. These are now aviation maps that are no longer supported. If they
+    // Maps that were already present in the old list are re-used. The list of
+    // maps might have changed while the reconciliation was running, so we
+    // check again. The remote metadata is set before the base map options,
+    // so that no optimization starts on a map whose metadata is not yet known.
+    foreach(auto description, diff.updated+diff.added) {
+        auto mapPtr = mapsByObjectName.value(description.objectName);
+        bool isNew = (mapPtr == nullptr);
+        if (isNew) {
+            mapPtr = new Downloadable(description.url, description.localFileName, _networkAccessManager, this);
+            mapPtr->setObjectName(description.objectName);
+            mapPtr->setSection(description.section);
+            mapsByObjectName.insert(description.objectName, mapPtr);
+            fileNames.insert(mapPtr->fileName());
+        }
+        mapPtr->setRemoteFileDate(description.remoteFileDate);
+        mapPtr->setRemoteFileSize(description.remoteFileSize);
+        mapPtr->setDeltaURLs(description.deltaURLs);
+        mapPtr->setBlockManifestURL(description.blockManifestURL);
+        mapPtr->setCompressedURL(description.compressedURL);
+        mapPtr->setExpectedSHA256(description.sha256);
+        if (isNew) {
+            _geoMaps.addToGroup(mapPtr);
+            trackStorageOfGeoMap(mapPtr);
+            applyBaseMapOptions(mapPtr);
+        }
+    }
+
+    // Now go through the aviation maps that are no longer supported. If they
     // have no local file to them, we simply delete them.  If they have a local
-    // file, we keep them, but set their QUrl to invalid; this will mark them as
-    // unsupported in the GUI.
-    foreach(auto geoMapPtr, oldMaps) {
-        if (geoMapPtr->hasFile())
+    // file, we keep them.
+    foreach(auto objectName, diff.removed) {
+        auto geoMapPtr = mapsByObjectName.value(objectName);
+        if ((geoMapPtr == nullptr) || geoMapPtr->hasFile())
             continue;
         delete geoMapPtr;
     }
 
     // Now it is still possible that the download directory contains files beloning
-    // to unsupported maps. Add those to newMaps.
-    foreach(auto path, unattachedFiles()) {
+    // to unsupported maps. Add those to the list.
+    foreach(auto path, diff.unattachedFiles) {
+        if (fileNames.contains(QFileInfo(path).absoluteFilePath()))
+            continue;
+
         // Generate proper object name from path
         QString objectName = path;
-        objectName = objectName.remove(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) +
-				       "/aviation_maps/").section('.', 0, 0);
+        objectName = objectName.remove(downloadDirectory()+"/").section('.', 0, 0);
 
         auto downloadable = new Downloadable(QUrl(), path, _networkAccessManager, this);
         downloadable->setSection("Unsupported Maps");
         downloadable->setObjectName(objectName);
         _geoMaps.addToGroup(downloadable);
+        trackStorageOfGeoMap(downloadable);
+        applyBaseMapOptions(downloadable);
     }
 
-    // Set the new maps and inform our users
+    // Checksums might have changed
+    updatePeerURLs();
+    updateSharedMaps();
+
+    // Set the new maps and inform our users. At startup, this is the first
+    // time that the installed files become known, so users of the files need
+    // to be told as well.
     if (old_aviationMapUpdatesAvailable != geoMapUpdatesAvailable())
         emit geoMapUpdatesAvailableChanged();
-
-    return;
+    auto newFiles = _geoMaps.files();
+    newFiles.sort();
+    if (oldFiles != newFiles) {
+        if (oldMbtileFiles != mbtileFiles())
+            emit mbtileFilesChanged(mbtileFiles(), "osm");
+        emit geoMapFilesChanged();
+        emit geoMapFileContentChanged();
+    }
 }
 
 
@@ -401,29 +858,55 @@ void MapManager::autoUpdateGeoMapList()
 }
 
 
-QList<QString> MapManager::unattachedFiles() const
+// Suffixes of files that belong to the local file of a map. Partially
+// downloaded files are kept, so that interrupted downloads can be resumed
+// later. The temporary files are only used while a map is being downloaded,
+// optimized or read.
+static const QStringList resumableFileSuffixes = {".part", ".delta.part"};
+static const QStringList temporaryFileSuffixes = {".lock", ".sync.part", ".sync.part.blocks", ".optimized.part", ".patched.part"};
+
+
+QList<QString> MapManager::unattachedFiles(bool includeTemporaryFiles) const
+{
+    QSet<QString> attachedFileNames;
+    foreach(auto geoMapPtr, _geoMaps.downloadables())
+        attachedFileNames.insert(geoMapPtr->fileName());
+    return unattachedFiles(attachedFileNames, includeTemporaryFiles);
+}
+
+
+QList<QString> MapManager::unattachedFiles(const QSet<QString>& attachedFileNames, bool includeTemporaryFiles)
 {
     QList<QString> result;
 
+    auto suffixes = resumableFileSuffixes;
+    if (!includeTemporaryFiles)
+        suffixes += temporaryFileSuffixes;
+
     // It might be possible for whatever reason that our download directory
     // contains files that we do not know whom they belong to. We hunt down those
     // files.
-    QDirIterator fileIterator(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation)+"/aviation_maps",
-			      QDir::Files, QDirIterator::Subdirectories);
+    QDirIterator fileIterator(downloadDirectory(), QDir::Files, QDirIterator::Subdirectories);
     while (fileIterator.hasNext()) {
         fileIterator.next();
 
-        // Now check if this file exists as the local file of some geographic map
-        bool isAttachedToAviationMap = false;
-        foreach(auto geoMapPtr, _geoMaps.downloadables()) {
-            if (geoMapPtr->fileName() == QFileInfo(fileIterator.filePath()).absoluteFilePath()) {
-                isAttachedToAviationMap = true;
-                break;
-            }
-        }
+        // Now check if this file exists as the local file of some geographic
+        // map, or if it is the local file of some map with one of the known
+        // suffixes
+        auto absoluteFilePath = QFileInfo(fileIterator.filePath()).absoluteFilePath();
+        bool isAttachedToAviationMap = attachedFileNames.contains(absoluteFilePath);
+        foreach(auto suffix, suffixes)
+            if (!isAttachedToAviationMap && absoluteFilePath.endsWith(suffix))
+                isAttachedToAviationMap = attachedFileNames.contains(absoluteFilePath.chopped(suffix.size()));
         if (!isAttachedToAviationMap)
             result.append(fileIterator.filePath());
     }
 
     return result;
 }
+
+
+QString MapManager::downloadDirectory()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation)+"/aviation_maps";
+}
@@ -21,9 +21,13 @@
 #ifndef MAPMANAGER_H
 #define MAPMANAGER_H
 
+#include <QFutureWatcher>
+#include <QGeoRectangle>
 #include <QTimer> 
 
 #include "DownloadableGroup.h"
+#include "MapShare.h"
+#include "SatNav.h"
 
 /*! \brief Manages the list of geographic maps
   
@@ -63,10 +67,13 @@ public:
     @param networkAccessManager Pointer to a QNetworkAccessManager that will be
     used for network access. The QNetworkAccessManager must not be deleted while
     this object exists.
+
+    @param satNav Pointer to a SatNav, used to find the maps of the current
+    region, which are downloaded first. The pointer may be a nullptr.
     
     @param parent The standard QObject parent pointer.
   */
-  explicit MapManager(QNetworkAccessManager *networkAccessManager, QObject *parent=nullptr);
+  explicit MapManager(QNetworkAccessManager *networkAccessManager, SatNav *satNav, QObject *parent=nullptr);
 
   // No copy constructor
   MapManager(MapManager const&) = delete;
@@ -156,6 +163,22 @@ public:
   */
   bool geoMapUpdatesAvailable() const { return _geoMaps.updatable(); }
 
+  /*! \brief Maps waiting for download
+
+    This property holds the maps that have been queued for download by
+    updateGeoMaps() and whose download has not yet started, in the order in
+    which they will be downloaded. At most two maps are downloaded at the same
+    time. Aviation maps are downloaded before base maps, and maps of the region
+    that contains the last known position are downloaded first.
+  */
+  Q_PROPERTY(QList<QObject*> downloadQueue READ downloadQueue NOTIFY downloadQueueChanged)
+
+  /*! \brief Getter function for the property with the same name
+
+    @returns Property downloadQueue
+  */
+  QList<QObject*> downloadQueue() const;
+
   /*! \brief Gives an estimate for the download size, as a localized string */
   Q_PROPERTY(QString geoMapUpdateSize READ geoMapUpdateSize NOTIFY geoMapUpdatesAvailableChanged)
 
@@ -198,6 +221,146 @@ public:
    */
   QSet<QString> mbtileFiles() const;
 
+  /*! \brief Optimize base maps after download
+
+    If true, base maps (which are MBTiles files) are rewritten in a background
+    pass after download, see Downloadable::setOptimizeMBTiles(). Optimized
+    base maps no longer agree with the checksums in the list of maps and are
+    therefore not shared on the local network, so this option and map sharing
+    exclude each other. The value is saved via QSettings. The default is
+    false.
+  */
+  Q_PROPERTY(bool optimizeBaseMaps READ optimizeBaseMaps WRITE setOptimizeBaseMaps NOTIFY optimizeBaseMapsChanged)
+
+  /*! \brief Getter function for the property with the same name
+
+    @returns Property optimizeBaseMaps
+  */
+  bool optimizeBaseMaps() const { return _optimizeBaseMaps; }
+
+  /*! \brief Setter function for the property with the same name
+
+    @param optimize Property optimizeBaseMaps
+  */
+  void setOptimizeBaseMaps(bool optimize);
+
+  /*! \brief Region to which base maps are cut
+
+    If valid, base maps are cut down to this region after download, see
+    Downloadable::setMBTilesRegion(). This saves storage and speeds up tile
+    lookups, if only a small part of a large base map is ever used. Tiles
+    outside the region are lost; if the region is enlarged or reset, the base
+    maps need to be downloaded again. As with optimizeBaseMaps, base maps that
+    have been cut are not shared on the local network. The value is saved via
+    QSettings. The default is an invalid rectangle, for no region.
+  */
+  Q_PROPERTY(QGeoRectangle baseMapRegion READ baseMapRegion WRITE setBaseMapRegion NOTIFY baseMapRegionChanged)
+
+  /*! \brief Getter function for the property with the same name
+
+    @returns Property baseMapRegion
+  */
+  QGeoRectangle baseMapRegion() const { return _baseMapRegion; }
+
+  /*! \brief Setter function for the property with the same name
+
+    @param region Property baseMapRegion
+  */
+  void setBaseMapRegion(const QGeoRectangle& region);
+
+  /*! \brief Largest zoom level kept when base maps are cut to baseMapRegion
+
+    The value is saved via QSettings. The default is -1, for all zoom levels.
+  */
+  Q_PROPERTY(int baseMapMaxZoom READ baseMapMaxZoom WRITE setBaseMapMaxZoom NOTIFY baseMapMaxZoomChanged)
+
+  /*! \brief Getter function for the property with the same name
+
+    @returns Property baseMapMaxZoom
+  */
+  int baseMapMaxZoom() const { return _baseMapMaxZoom; }
+
+  /*! \brief Setter function for the property with the same name
+
+    @param maxZoom Property baseMapMaxZoom
+  */
+  void setBaseMapMaxZoom(int maxZoom);
+
+  /*! \brief Share installed maps with other devices on the local network
+
+    If true, installed maps are offered to other devices on the local network,
+    see MapShare. Maps offered by other devices are used whether this property
+    is set or not, if their checksum matches the one in "maps.json". The value
+    is saved via QSettings. The default is false.
+  */
+  Q_PROPERTY(bool shareMaps READ shareMaps WRITE setShareMaps NOTIFY shareMapsChanged)
+
+  /*! \brief Getter function for the property with the same name
+
+    @returns Property shareMaps
+  */
+  bool shareMaps() const { return _mapShare.sharingEnabled(); }
+
+  /*! \brief Setter function for the property with the same name
+
+    @param share Property shareMaps
+  */
+  void setShareMaps(bool share);
+
+  /*! \brief Storage budget for geographic maps, in bytes
+
+    If the installed maps take more space than this, the maps of the least
+    recently used regions are listed in evictionCandidates. The value 0 means
+    that there is no limit. The value is saved via QSettings.
+  */
+  Q_PROPERTY(qint64 storageBudget READ storageBudget WRITE setStorageBudget NOTIFY storageBudgetChanged)
+
+  /*! \brief Getter function for the property with the same name
+
+    @returns Property storageBudget
+  */
+  qint64 storageBudget() const { return _storageBudget; }
+
+  /*! \brief Setter function for the property with the same name
+
+    @param storageBudget Property storageBudget. Negative values are treated as
+    0.
+  */
+  void setStorageBudget(qint64 storageBudget);
+
+  /*! \brief Space taken by the installed geographic maps, in bytes
+
+    This property is updated whenever the local file of a map changes, without
+    walking the download directory.
+  */
+  Q_PROPERTY(qint64 storageUsed READ storageUsed NOTIFY storageUsedChanged)
+
+  /*! \brief Getter function for the property with the same name
+
+    @returns Property storageUsed
+  */
+  qint64 storageUsed() const { return _storageUsed; }
+
+  /*! \brief Maps that should be removed to meet the storage budget
+
+    Maps are grouped into regions; aviation maps and base maps of the same
+    region have the same object name. The regions are ordered by the time of
+    last access, which is the last time that the tile server served a tile from
+    one of the maps of the region, or the time of installation if no tile has
+    been served since. Regions with few tile accesses go first among regions
+    with identical times. Regions that contain the current position are never
+    listed. This property holds the maps of the least recently used regions,
+    just enough so that removing them brings storageUsed below storageBudget.
+    The list is empty if the budget is met.
+  */
+  Q_PROPERTY(QList<QObject*> evictionCandidates READ evictionCandidates NOTIFY evictionCandidatesChanged)
+
+  /*! \brief Getter function for the property with the same name
+
+    @returns Property evictionCandidates
+  */
+  QList<QObject*> evictionCandidates() const;
+
 public slots:
   /*! \brief Triggers an update of the list of available maps
 
@@ -205,8 +368,24 @@ public slots:
   */
   void updateGeoMapList();
   
-  /*! \brief Triggers an update of every updatable map */
+  /*! \brief Triggers an update of every updatable map
+
+    The maps are not downloaded all at once, but queued, see the property
+    downloadQueue.
+  */
   void updateGeoMaps();
+
+  /*! \brief Records an access to the local file of a geographic map
+
+    This slot is connected to TileServer::tileServed(), so that the maps that
+    are actually used can be told apart from the maps that are only installed.
+
+    @param fileName Name of the local file of a map
+  */
+  void recordMapAccess(const QString& fileName);
+
+  /*! \brief Removes the maps listed in evictionCandidates */
+  void evictLeastRecentlyUsedMaps();
   
 signals:
   /*! \brief Warning that the list of available aviation maps is about to change
@@ -259,6 +438,12 @@ signals:
    */
   void geoMapFileContentChanged();
 
+  /*! \brief Emitted if data of a geoMap download arrives
+
+    @see Downloadable::downloadDataReceived()
+   */
+  void geoMapDownloadDataReceived(QString localFileName, qint64 offset, QByteArray data);
+
   /*! \brief Emitted if one of the local file of one of the geoMaps changes
       existence
 
@@ -266,6 +451,30 @@ signals:
    */
   void geoMapFilesChanged();
 
+  /*! \brief Notification signal for the property with the same name */
+  void downloadQueueChanged();
+
+  /*! \brief Notification signal for the property with the same name */
+  void optimizeBaseMapsChanged();
+
+  /*! \brief Notification signal for the property with the same name */
+  void baseMapRegionChanged();
+
+  /*! \brief Notification signal for the property with the same name */
+  void baseMapMaxZoomChanged();
+
+  /*! \brief Notification signal for the property with the same name */
+  void shareMapsChanged();
+
+  /*! \brief Notification signal for the property with the same name */
+  void storageBudgetChanged();
+
+  /*! \brief Notification signal for the property with the same name */
+  void storageUsedChanged();
+
+  /*! \brief Notification signal for the property with the same name */
+  void evictionCandidatesChanged();
+
 private slots:
   // Trivial method that re-sends the signal, but without the parameter
   // 'objectName'
@@ -281,14 +490,36 @@ private slots:
   // called by the constructor to interpret an existing "maps.json". It is also
   // connected to the signal &Downloadable::localFileChanged of
   // _availableMapsDescription, which is emitted whenever the file "maps.json"
-  // changes in the file system.
+  // changes in the file system. The file is parsed and compared to the current
+  // list of maps in a separate thread, by the method reconcileGeoMapList(). If
+  // a reconciliation is already running, the method starts the timer
+  // _readGeoMapListTimer and tries again later.
   void readGeoMapListFromJSONFile();
 
+  // This slot is called when reconcileGeoMapList() has finished. It applies the
+  // result to _geoMaps, in the GUI thread.
+  void applyGeoMapListDiff();
+
+  // Passes the installed maps that are current to _mapShare. MBTiles files
+  // that have been optimized or cut to a region are left out, because their
+  // checksum cannot agree with the list of maps and no peer would use them.
+  void updateSharedMaps();
+
+  // Sets the peer URL of every geo map, according to the files offered by
+  // peers. Connected to MapShare::peersChanged of _mapShare.
+  void updatePeerURLs();
+
+  // This slot is connected to the signals Downloadable::hasFileChanged and
+  // Downloadable::fileContentChanged of every geo map. It updates the entry of
+  // the sender in _mapStorage, and _storageUsed.
+  void updateStorageOfGeoMap();
+
   // This method records the current time as the time when the last update
   // succeeded, and sets the autoUpdateTimer to check again in one day. This
   // slot is connected to the signal &Downloadable::localFileChanged of
   // _availableMapsDescription, which is emitted whenever the file "maps.json"
-  // changes in the file system.
+  // changes in the file system, and to &Downloadable::localFileConfirmedCurrent,
+  // which is emitted when the server confirms that "maps.json" is current.
   void setTimeOfLastUpdateToNow();
 
   // This method calls 'updateGeoMapList()' if an automatic update is due. It
@@ -297,9 +528,63 @@ private slots:
   void autoUpdateGeoMapList();
   
 private:
+  // Description of one geographic map, as found in the file "maps.json"
+  struct GeoMapDescription {
+    QString objectName;
+    QString section;
+    QUrl url;
+    QString localFileName;
+    QDateTime remoteFileDate;
+    qint64 remoteFileSize {-1};
+    QMap<QDateTime, QUrl> deltaURLs;
+    QUrl blockManifestURL;
+    QUrl compressedURL;
+    QByteArray sha256;
+  };
+
+  // Difference between the list of maps in "maps.json" and the current list of
+  // maps, as computed by reconcileGeoMapList(). The member 'removed' contains
+  // the object names of maps that are no longer listed in "maps.json". The
+  // member 'unattachedFiles' contains files in the download directory that
+  // belong to none of the maps, old or new.
+  struct GeoMapListDiff {
+    bool isValid {false};
+    QVector<GeoMapDescription> added;
+    QVector<GeoMapDescription> updated;
+    QStringList removed;
+    QStringList unattachedFiles;
+  };
+
+  // Reads the file "maps.json" and compares it to the current list of maps,
+  // which is described by the object names and local file names of the maps.
+  // This method is static and does not touch any Downloadable, so it can run
+  // in a separate thread. Maps are matched by object name, using hash lookups.
+  static GeoMapListDiff reconcileGeoMapList(const QString& mapsJSONFileName,
+                                            const QSet<QString>& existingObjectNames,
+                                            QSet<QString> attachedFileNames);
+
   // This method returns a list of files in the download directory that have no
-  // corresponding entry in _aviationMaps.
-  QList<QString> unattachedFiles() const;
+  // corresponding entry in _aviationMaps, see the static method below.
+  QList<QString> unattachedFiles(bool includeTemporaryFiles=false) const;
+
+  // This method returns a list of files in the download directory that are
+  // not contained in attachedFileNames. Partially downloaded files
+  // (".part", ".delta.part") of an attached file count as attached, so that
+  // interrupted downloads can be resumed later. Temporary files (".lock",
+  // ".sync.part", ".optimized.part", etc.) of an attached file count as attached
+  // unless includeTemporaryFiles is true. All other files count as unattached.
+  // The file names in attachedFileNames must be absolute.
+  static QList<QString> unattachedFiles(const QSet<QString>& attachedFileNames, bool includeTemporaryFiles=false);
+
+  // Directory where geographic maps are stored
+  static QString downloadDirectory();
+
+  // Watches the reconciliation started by readGeoMapListFromJSONFile()
+  QFutureWatcher<GeoMapListDiff> _geoMapListWatcher;
+
+  // Timer used to start another run of readGeoMapListFromJSONFile() if
+  // "maps.json" changes while a reconciliation is running
+  QTimer _readGeoMapListTimer;
 
   // This timer is used to trigger automatic updates. Its signal QTimer::timeout
   // is connected to the slot autoUpdateGeoMapList.
@@ -319,6 +604,57 @@ private:
   // Pointer the QNetworkAccessManager that will be used for all Downloadable
   // objects constructed by this class
   QPointer<QNetworkAccessManager> _networkAccessManager;
+
+  // Storage and access statistics of a geo map
+  struct MapStorage {
+    qint64 size {0};
+    QDateTime lastAccess;
+    qint64 accessCount {0};
+  };
+
+  // Storage and access statistics, indexed by the name of the local file.
+  // Access statistics are saved via QSettings by the destructor.
+  QHash<QString, MapStorage> _mapStorage;
+
+  // Sum of the sizes in _mapStorage
+  qint64 _storageUsed {0};
+
+  // Storage budget in bytes, or 0 for no limit
+  qint64 _storageBudget {0};
+
+  // Value of the property optimizeBaseMaps
+  bool _optimizeBaseMaps {false};
+
+  // Values of the properties baseMapRegion and baseMapMaxZoom
+  QGeoRectangle _baseMapRegion;
+  int _baseMapMaxZoom {-1};
+
+  // Applies the properties optimizeBaseMaps, baseMapRegion and baseMapMaxZoom
+  // to a geo map
+  void applyBaseMapOptions(Downloadable *geoMapPtr);
+
+  // Shares installed maps with other devices, and finds maps offered by them
+  MapShare _mapShare;
+
+  // Connects the signals of a newly constructed geo map to
+  // updateStorageOfGeoMap(), and accounts for its local file
+  void trackStorageOfGeoMap(Downloadable *geoMap);
+
+  // Names of the regions that contain the current position, found by looking
+  // at the bounds of the installed base maps
+  QSet<QString> currentRegions() const;
+
+  // Bounds of installed base maps, by file name. Reading the bounds requires
+  // opening the database, so they are cached. updateStorageOfGeoMap() removes
+  // the entry of a map whose local file changes.
+  mutable QHash<QString, QGeoRectangle> _mbtilesBounds;
+
+  // Sets the download priority of all geo maps: aviation maps come before base
+  // maps, and within each kind, the maps of the current region come first
+  void updateDownloadPriorities();
+
+  // Pointer to the SatNav, used to determine the current region
+  QPointer<SatNav> _satNav;
 };
 
 #endif // MAPMANAGER_H
@@ -0,0 +1,383 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLocale>
+#include <QRandomGenerator>
+#include <QTcpSocket>
+
+#include "MapMirror.h"
+
+
+// Formats a time as required for HTTP headers, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+static QByteArray httpDate(const QDateTime& time)
+{
+    return QLocale::c().toString(time.toUTC(), "ddd, dd MMM yyyy hh:mm:ss").toLatin1()+" GMT";
+}
+
+
+// Reason phrase of the status codes that the server uses
+static QByteArray reasonPhrase(int statusCode)
+{
+    switch(statusCode) {
+    case 200:
+        return "OK";
+    case 206:
+        return "Partial Content";
+    case 304:
+        return "Not Modified";
+    case 400:
+        return "Bad Request";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 416:
+        return "Range Not Satisfiable";
+    case 500:
+        return "Internal Server Error";
+    case 503:
+        return "Service Unavailable";
+    default:
+        return "Error";
+    }
+}
+
+
+MapMirror::MapMirror(const QString& directory, QObject *parent)
+    : QObject(parent), _directory(QDir(directory).absolutePath())
+{
+    QDirIterator fileIterator(_directory, QStringList() << "*.geojson" << "*.mbtiles", QDir::Files, QDirIterator::Subdirectories);
+    while (fileIterator.hasNext()) {
+        fileIterator.next();
+        auto info = fileIterator.fileInfo();
+
+        MapFile map;
+        map.path = QDir(_directory).relativeFilePath(info.absoluteFilePath());
+        map.time = info.lastModified().toUTC().toString("yyyyMMdd");
+        map.size = info.size();
+        map.hasBlocks = QFile::exists(info.absoluteFilePath()+".blocks");
+        map.hasGzip = QFile::exists(info.absoluteFilePath()+".gz");
+
+        QFile file(info.absoluteFilePath());
+        if (!file.open(QIODevice::ReadOnly))
+            continue;
+        QCryptographicHash hash(QCryptographicHash::Sha256);
+        if (!hash.addData(&file))
+            continue;
+        map.sha256 = hash.result().toHex();
+
+        _maps.append(map);
+    }
+
+    _pumpTimer.setInterval(pumpInterval);
+    connect(&_pumpTimer, &QTimer::timeout, this, &MapMirror::pump);
+    connect(&_server, &QTcpServer::newConnection, this, &MapMirror::acceptConnections);
+}
+
+
+bool MapMirror::listen(const QHostAddress& address, quint16 port)
+{
+    return _server.listen(address, port);
+}
+
+
+QByteArray MapMirror::mapsJSON(const QString& baseURL) const
+{
+    QJsonArray maps;
+    foreach(auto map, _maps) {
+        QJsonObject obj;
+        obj.insert("path", map.path);
+        obj.insert("time", map.time);
+        obj.insert("size", map.size);
+        obj.insert("sha256", map.sha256);
+        if (map.hasBlocks)
+            obj.insert("blocks", map.path+".blocks");
+        if (map.hasGzip)
+            obj.insert("gzip", map.path+".gz");
+        maps.append(obj);
+    }
+
+    QJsonObject top;
+    top.insert("url", baseURL);
+    top.insert("maps", maps);
+    return QJsonDocument(top).toJson();
+}
+
+
+void MapMirror::acceptConnections()
+{
+    while (_server.hasPendingConnections()) {
+        auto socket = _server.nextPendingConnection();
+        _requests.insert(socket, QByteArray());
+
+        connect(socket, &QTcpSocket::readyRead, this, [this, socket]() {
+            if (!_requests.contains(socket))
+                return;
+            _requests[socket] += socket->readAll();
+            if (!_requests[socket].contains("\r\n\r\n"))
+                return;
+
+            // The request is complete. Answer it after the latency.
+            QTimer::singleShot(_latency, socket, [this, socket]() { respond(socket); });
+        });
+        connect(socket, &QTcpSocket::disconnected, this, [this, socket]() {
+            _requests.remove(socket);
+            if (_transfers.contains(socket))
+                finishTransfer(socket, false);
+            socket->deleteLater();
+        });
+    }
+}
+
+
+void MapMirror::respond(QTcpSocket *socket)
+{
+    // Paranoid safety checks
+    if (!_requests.contains(socket))
+        return;
+    auto request = _requests.take(socket);
+
+    // Parse request line and headers. Header names are case-insensitive.
+    auto lines = request.left(request.indexOf("\r\n\r\n")).split('\n');
+    auto requestLine = lines.takeFirst().trimmed().split(' ');
+    QHash<QByteArray, QByteArray> requestHeaders;
+    foreach(auto line, lines) {
+        auto colon = line.indexOf(':');
+        if (colon > 0)
+            requestHeaders.insert(line.left(colon).trimmed().toLower(), line.mid(colon+1).trimmed());
+    }
+
+    Transfer transfer;
+    if (requestLine.size() != 3) {
+        transfer.statusCode = 400;
+        startTransfer(socket, transfer, {});
+        return;
+    }
+    transfer.method = QString::fromLatin1(requestLine[0]);
+    transfer.path = QString::fromUtf8(QByteArray::fromPercentEncoding(requestLine[1].section('?', 0, 0)));
+    if ((transfer.method != "GET") && (transfer.method != "HEAD")) {
+        transfer.statusCode = 405;
+        startTransfer(socket, transfer, {{"Allow", "GET, HEAD"}});
+        return;
+    }
+
+    // Simulated server errors
+    if (randomNumber() < _errorRate) {
+        transfer.statusCode = _errorCode;
+        startTransfer(socket, transfer, {});
+        return;
+    }
+
+    // The file "maps.json" is generated. All other files are read from the
+    // directory; paths that leave the directory are rejected.
+    QList<QPair<QByteArray, QByteArray>> headers;
+    qint64 size = 0;
+    QDateTime lastModified;
+    QByteArray eTag;
+    if (transfer.path == "/maps.json") {
+        auto host = requestHeaders.value("host");
+        if (host.isEmpty())
+            host = "localhost:"+QByteArray::number(serverPort());
+        transfer.body = mapsJSON("http://"+QString::fromLatin1(host));
+        size = transfer.body.size();
+        headers.append({"Content-Type", "application/json"});
+    } else {
+        auto fileName = QDir::cleanPath(_directory+transfer.path);
+        if (!fileName.startsWith(_directory+"/") || !QFileInfo(fileName).isFile()) {
+            transfer.statusCode = 404;
+            startTransfer(socket, transfer, {});
+            return;
+        }
+        transfer.file = QSharedPointer<QFile>(new QFile(fileName));
+        if (!transfer.file->open(QIODevice::ReadOnly)) {
+            transfer.statusCode = 500;
+            transfer.file.clear();
+            startTransfer(socket, transfer, {});
+            return;
+        }
+        size = transfer.file->size();
+        lastModified = QFileInfo(fileName).lastModified();
+        lastModified = lastModified.addMSecs(-lastModified.time().msec());
+        eTag = "\""+QByteArray::number(size, 16)+"-"+QByteArray::number(lastModified.toSecsSinceEpoch(), 16)+"\"";
+        headers.append({"Content-Type", "application/octet-stream"});
+        headers.append({"Last-Modified", httpDate(lastModified)});
+        headers.append({"ETag", eTag});
+
+        // Conditional requests
+        bool notModified = false;
+        if (requestHeaders.contains("if-none-match"))
+            notModified = (requestHeaders.value("if-none-match") == eTag);
+        else if (requestHeaders.contains("if-modified-since")) {
+            auto since = QLocale::c().toDateTime(QString::fromLatin1(requestHeaders.value("if-modified-since")).section(' ', 0, 4),
+                                                 "ddd, dd MMM yyyy hh:mm:ss");
+            since.setTimeSpec(Qt::UTC);
+            notModified = since.isValid() && (lastModified <= since);
+        }
+        if (notModified) {
+            transfer.statusCode = 304;
+            transfer.file.clear();
+            startTransfer(socket, transfer, headers);
+            return;
+        }
+    }
+    headers.append({"Accept-Ranges", "bytes"});
+
+    // Byte ranges. Only single ranges are supported; requests for several
+    // ranges are answered with the full file.
+    qint64 first = 0;
+    qint64 last = size-1;
+    auto range = requestHeaders.value("range");
+    if (requestHeaders.contains("if-range")) {
+        auto ifRange = requestHeaders.value("if-range");
+        if ((ifRange != eTag) && (ifRange != httpDate(lastModified)))
+            range.clear();
+    }
+    if (range.startsWith("bytes=") && !range.contains(',')) {
+        auto spec = range.mid(6);
+        bool ok1 = true;
+        bool ok2 = true;
+        if (spec.startsWith('-')) {
+            first = qMax(static_cast<qint64>(0), size-spec.mid(1).toLongLong(&ok1));
+        } else {
+            first = spec.section('-', 0, 0).toLongLong(&ok1);
+            if (!spec.section('-', 1, 1).isEmpty())
+                last = qMin(last, spec.section('-', 1, 1).toLongLong(&ok2));
+        }
+        if (!ok1 || !ok2 || (first >= size) || (first > last)) {
+            transfer.statusCode = 416;
+            transfer.body.clear();
+            transfer.file.clear();
+            startTransfer(socket, transfer, {{"Content-Range", "bytes */"+QByteArray::number(size)}});
+            return;
+        }
+        transfer.statusCode = 206;
+        headers.append({"Content-Range", "bytes "+QByteArray::number(first)+"-"+QByteArray::number(last)+"/"+QByteArray::number(size)});
+    }
+
+    transfer.remaining = last-first+1;
+    if (transfer.file)
+        transfer.file->seek(first);
+    else
+        transfer.body = transfer.body.mid(static_cast<int>(first), static_cast<int>(transfer.remaining));
+    if ((transfer.remaining > 0) && (randomNumber() < _dropRate))
+        transfer.dropAfter = static_cast<qint64>(randomNumber()*static_cast<double>(transfer.remaining));
+    startTransfer(socket, transfer, headers);
+}
+
+
+void MapMirror::startTransfer(QTcpSocket *socket, Transfer transfer, const QList<QPair<QByteArray, QByteArray>>& headers)
+{
+    // Error responses and answers to HEAD requests have no body. The
+    // Content-Length of a HEAD request is that of the corresponding GET
+    // request.
+    auto contentLength = transfer.remaining;
+    if ((transfer.statusCode != 200) && (transfer.statusCode != 206)) {
+        contentLength = 0;
+        transfer.remaining = 0;
+    }
+    if (transfer.method == "HEAD")
+        transfer.remaining = 0;
+
+    QByteArray response = "HTTP/1.1 "+QByteArray::number(transfer.statusCode)+" "+reasonPhrase(transfer.statusCode)+"\r\n";
+    foreach(auto header, headers)
+        response += header.first+": "+header.second+"\r\n";
+    if (transfer.statusCode != 304)
+        response += "Content-Length: "+QByteArray::number(contentLength)+"\r\n";
+    response += "Date: "+httpDate(QDateTime::currentDateTimeUtc())+"\r\n";
+    response += "Connection: close\r\n\r\n";
+    socket->write(response);
+
+    _transfers.insert(socket, transfer);
+    if (transfer.remaining == 0) {
+        finishTransfer(socket, false);
+        return;
+    }
+    if (!_pumpTimer.isActive())
+        _pumpTimer.start();
+}
+
+
+void MapMirror::pump()
+{
+    if (_transfers.isEmpty()) {
+        _pumpTimer.stop();
+        return;
+    }
+
+    // Without bandwidth limit, we still send no more than 1 MiB per connection
+    // and tick, so that the socket buffers stay small
+    qint64 budget = 1024*1024;
+    if (_bandwidth > 0)
+        budget = qMax(static_cast<qint64>(1), _bandwidth*pumpInterval/1000/_transfers.size());
+
+    foreach(auto socket, _transfers.keys()) {
+        auto &transfer = _transfers[socket];
+        if (socket->bytesToWrite() > budget)
+            continue;
+
+        auto chunkSize = qMin(budget, transfer.remaining);
+        if (transfer.dropAfter >= 0)
+            chunkSize = qMin(chunkSize, transfer.dropAfter-transfer.sent);
+
+        QByteArray chunk;
+        if (transfer.file)
+            chunk = transfer.file->read(chunkSize);
+        else
+            chunk = transfer.body.mid(static_cast<int>(transfer.sent), static_cast<int>(chunkSize));
+        socket->write(chunk);
+        transfer.sent += chunk.size();
+        transfer.remaining -= chunk.size();
+
+        if ((transfer.dropAfter >= 0) && (transfer.sent >= transfer.dropAfter)) {
+            finishTransfer(socket, true);
+            continue;
+        }
+        if ((transfer.remaining <= 0) || chunk.isEmpty())
+            finishTransfer(socket, false);
+    }
+}
+
+
+void MapMirror::finishTransfer(QTcpSocket *socket, bool dropped)
+{
+    // Paranoid safety checks
+    if (!_transfers.contains(socket))
+        return;
+
+    auto transfer = _transfers.take(socket);
+    emit requestServed(transfer.method, transfer.path, transfer.statusCode, transfer.sent, dropped);
+    if (dropped)
+        socket->abort();
+    else
+        socket->disconnectFromHost();
+}
+
+
+double MapMirror::randomNumber()
+{
+    return QRandomGenerator::global()->generateDouble();
+}
@@ -0,0 +1,220 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef MAPMIRROR_H
+#define MAPMIRROR_H
+
+#include <QFile>
+#include <QHash>
+#include <QSharedPointer>
+#include <QTcpServer>
+#include <QTimer>
+
+
+/*! \brief Local stand-in for the enroute download server
+ *
+ * This class implements a minimal HTTP/1.1 server that serves the map files
+ * found in a directory, together with a file "maps.json" that is generated
+ * from the directory content. It is meant for testing and benchmarking the
+ * download code of the app without the real server, and it is used by the
+ * command "serve" of the maptool.
+ *
+ * Map files are files with the endings "geojson" and "mbtiles". The first
+ * level of subdirectories is used as the section of the map, exactly as on the
+ * real server. If a file FILE.blocks or FILE.gz exists next to a map file, it
+ * is advertised as block manifest or as compressed copy of the map. The server
+ * answers GET and HEAD requests, honours single byte ranges and the headers
+ * If-None-Match, If-Modified-Since and If-Range, and closes the connection
+ * after every response.
+ *
+ * To simulate bad network conditions, the server can limit the bandwidth, can
+ * delay every response, can drop connections in the middle of a transfer and
+ * can answer requests with an error code.
+ */
+
+class MapMirror : public QObject
+{
+    Q_OBJECT
+
+public:
+    /*! \brief Constructs a server for the map files in a directory
+     *
+     * The directory is scanned, and the SHA-256 checksums of all map files
+     * are computed, when the constructor runs. Files that are added later
+     * are not served.
+     *
+     * @param directory Directory that contains the map files
+     *
+     * @param parent The standard QObject parent pointer
+     */
+    explicit MapMirror(const QString& directory, QObject *parent=nullptr);
+
+    // No copy constructor
+    MapMirror(MapMirror const&) = delete;
+
+    // No assign operator
+    MapMirror& operator =(MapMirror const&) = delete;
+
+    // No move constructor
+    MapMirror(MapMirror&&) = delete;
+
+    // No move assignment operator
+    MapMirror& operator=(MapMirror&&) = delete;
+
+    /*! \brief Starts listening for connections
+     *
+     * @param address Address to listen on
+     *
+     * @param port Port to listen on, or 0 to pick any free port
+     *
+     * @returns True on success
+     */
+    bool listen(const QHostAddress& address, quint16 port);
+
+    /*! \brief Port that the server listens on
+     *
+     * @returns Port, or 0 if the server is not listening
+     */
+    quint16 serverPort() const { return _server.serverPort(); }
+
+    /*! \brief Number of map files served
+     *
+     * @returns Number of map files that are listed in "maps.json"
+     */
+    int numberOfMaps() const { return _maps.size(); }
+
+    /*! \brief Sets the bandwidth
+     *
+     * The bandwidth is shared among all running transfers.
+     *
+     * @param bytesPerSecond Bandwidth in bytes per second, or 0 for no limit
+     */
+    void setBandwidth(qint64 bytesPerSecond) { _bandwidth = qMax(static_cast<qint64>(0), bytesPerSecond); }
+
+    /*! \brief Sets the latency
+     *
+     * @param milliseconds Time between the arrival of a request and the
+     * start of the response
+     */
+    void setLatency(int milliseconds) { _latency = qMax(0, milliseconds); }
+
+    /*! \brief Sets the probability that a transfer is dropped
+     *
+     * A dropped transfer is aborted at a random position of the response
+     * body, without any notice to the client.
+     *
+     * @param probability Number between 0 and 1
+     */
+    void setDropRate(double probability) { _dropRate = qBound(0.0, probability, 1.0); }
+
+    /*! \brief Sets the probability that a request fails
+     *
+     * @param probability Number between 0 and 1
+     *
+     * @param statusCode HTTP status code of the failed requests
+     */
+    void setErrorRate(double probability, int statusCode = 503) { _errorRate = qBound(0.0, probability, 1.0); _errorCode = statusCode; }
+
+    /*! \brief Generates the file "maps.json"
+     *
+     * @param baseURL URL of the server, such as "http://localhost:8080"
+     *
+     * @returns Content of the file "maps.json"
+     */
+    QByteArray mapsJSON(const QString& baseURL) const;
+
+signals:
+    /*! \brief Emitted when the server is done with a request
+     *
+     * @param method HTTP method of the request
+     *
+     * @param path Path of the request
+     *
+     * @param statusCode HTTP status code of the response
+     *
+     * @param bytesSent Number of bytes of the response body that were sent
+     *
+     * @param dropped True if the transfer was dropped on purpose
+     */
+    void requestServed(QString method, QString path, int statusCode, qint64 bytesSent, bool dropped);
+
+private slots:
+    // Accepts new connections and starts reading the request
+    void acceptConnections();
+
+    // Sends the next chunk of every running transfer, as far as the bandwidth
+    // permits. Connected to the timeout of _pumpTimer.
+    void pump();
+
+private:
+    // Map file, as listed in "maps.json"
+    struct MapFile {
+        QString path;
+        QString time;
+        qint64 size {0};
+        QString sha256;
+        bool hasBlocks {false};
+        bool hasGzip {false};
+    };
+
+    // Running transfer of a response body
+    struct Transfer {
+        QString method;
+        QString path;
+        int statusCode {200};
+        QByteArray body;                 // Response body, if not read from a file
+        QSharedPointer<QFile> file;      // File that contains the response body
+        qint64 remaining {0};            // Number of bytes still to send
+        qint64 sent {0};                 // Number of bytes sent so far
+        qint64 dropAfter {-1};           // Abort after this many bytes, or -1
+    };
+
+    // Parses the request that is buffered for the socket, and answers it
+    void respond(QTcpSocket *socket);
+
+    // Writes the status line and the headers of a response, and registers
+    // the transfer of the body
+    void startTransfer(QTcpSocket *socket, Transfer transfer, const QList<QPair<QByteArray, QByteArray>>& headers);
+
+    // Ends the transfer, emits requestServed() and closes the connection
+    void finishTransfer(QTcpSocket *socket, bool dropped);
+
+    // Returns a random number between 0 and 1
+    static double randomNumber();
+
+    QString _directory;
+    QList<MapFile> _maps;
+
+    qint64 _bandwidth {0};
+    int _latency {0};
+    double _dropRate {0.0};
+    double _errorRate {0.0};
+    int _errorCode {503};
+
+    QTcpServer _server;
+    QHash<QTcpSocket*, QByteArray> _requests;
+    QHash<QTcpSocket*, Transfer> _transfers;
+
+    // Interval of the timer _pumpTimer, in milliseconds
+    static const int pumpInterval = 10;
+    QTimer _pumpTimer;
+};
+
+#endif // MAPMIRROR_H
@@ -0,0 +1,296 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QNetworkDatagram>
+#include <QRandomGenerator>
+#include <QSettings>
+#include <QtConcurrent/QtConcurrentRun>
+
+#include <qhttpengine/filesystemhandler.h>
+#include <qhttpengine/socket.h>
+
+#include "MapShare.h"
+
+
+// Handler that answers requests for the shared files only, and serves them
+// with a FilesystemHandler. All other requests, for instance for partially
+// downloaded files or lock files, are answered with 'not found'.
+class SharedFilesHandler : public QHttpEngine::Handler
+{
+public:
+    SharedFilesHandler(const QString& directory, QObject *parent)
+        : QHttpEngine::Handler(parent), _fileSystemHandler(new QHttpEngine::FilesystemHandler(directory, this))
+    {
+    }
+
+    // Sets the shared files, as paths relative to the directory
+    void setPaths(const QSet<QString>& paths) { _paths = paths; }
+
+protected:
+    void process(QHttpEngine::Socket *socket, const QString &path) override
+    {
+        auto relativePath = path;
+        while (relativePath.startsWith('/'))
+            relativePath.remove(0, 1);
+        if (!_paths.contains(relativePath)) {
+            socket->writeError(QHttpEngine::Socket::NotFound);
+            socket->close();
+            return;
+        }
+        _fileSystemHandler->route(socket, relativePath);
+    }
+
+private:
+    QHttpEngine::FilesystemHandler *_fileSystemHandler;
+    QSet<QString> _paths;
+};
+
+
+MapShare::MapShare(QObject *parent)
+    : QObject(parent)
+{
+    _instanceID = QByteArray::number(QRandomGenerator::global()->generate64(), 16);
+
+    // Restore cached checksums
+    QSettings settings;
+    auto hashes = settings.value("MapShare/Hashes").toMap();
+    for(auto iterator = hashes.constBegin(); iterator != hashes.constEnd(); ++iterator) {
+        auto values = iterator.value().toList();
+        if (values.size() != 3)
+            continue;
+        FileHash fileHash;
+        fileHash.lastModified = values[0].toDateTime();
+        fileHash.size = values[1].toLongLong();
+        fileHash.sha256 = values[2].toByteArray();
+        _fileHashes.insert(iterator.key(), fileHash);
+    }
+
+    // Several instances on the same host must be able to receive
+    // advertisements, so the port is shared
+    _socket.bind(QHostAddress::AnyIPv4, discoveryPort, QUdpSocket::ShareAddress|QUdpSocket::ReuseAddressHint);
+    connect(&_socket, &QUdpSocket::readyRead, this, &MapShare::readDatagrams);
+
+    connect(&_hashWatcher, &QFutureWatcher<QHash<QString, FileHash>>::finished, this, &MapShare::hashingFinished);
+
+    _advertisementTimer.setInterval(advertisementInterval);
+    connect(&_advertisementTimer, &QTimer::timeout, this, &MapShare::advertise);
+    _advertisementTimer.start();
+}
+
+
+void MapShare::setSharingEnabled(bool enabled)
+{
+    if (enabled == _sharingEnabled)
+        return;
+    _sharingEnabled = enabled;
+    updateServer();
+}
+
+
+void MapShare::setSharedFiles(const QString& directory, const QStringList& fileNames)
+{
+    // The server needs to be restarted for a new directory
+    auto absoluteDirectory = QDir(directory).absolutePath();
+    if (absoluteDirectory != _directory)
+        delete _server;
+    _directory = absoluteDirectory;
+
+    _sharedFiles.clear();
+    foreach(auto fileName, fileNames) {
+        if (fileName.startsWith(_directory+"/"))
+            _sharedFiles += fileName;
+    }
+    updateServer();
+}
+
+
+void MapShare::updateServer()
+{
+    // Never serve anything before we know which directory to serve
+    if (!_sharingEnabled || _directory.isEmpty()) {
+        delete _server;
+        return;
+    }
+
+    if (_server.isNull()) {
+        _server = new QHttpEngine::Server(this);
+        _handler = new SharedFilesHandler(_directory, _server);
+        _server->setHandler(_handler);
+        if (!_server->listen(QHostAddress::Any)) {
+            delete _server;
+            return;
+        }
+    }
+
+    QSet<QString> paths;
+    foreach(auto fileName, _sharedFiles)
+        paths += fileName.mid(_directory.size()+1);
+    _handler->setPaths(paths);
+
+    hashFiles();
+    advertise();
+}
+
+
+QUrl MapShare::peerURL(const QByteArray& sha256) const
+{
+    return _peerFiles.value(sha256.toLower()).url;
+}
+
+
+void MapShare::readDatagrams()
+{
+    bool changed = false;
+    while (_socket.hasPendingDatagrams()) {
+        auto datagram = _socket.receiveDatagram();
+        auto advertisement = QJsonDocument::fromJson(datagram.data()).object();
+        if (advertisement.value("app").toString() != "enroute-map-share")
+            continue;
+        if (advertisement.value("id").toString().toLatin1() == _instanceID)
+            continue;
+
+        auto address = datagram.senderAddress();
+        bool isIPv4 = false;
+        auto ipv4Address = address.toIPv4Address(&isIPv4);
+        if (isIPv4)
+            address = QHostAddress(ipv4Address);
+
+        auto maps = advertisement.value("maps").toObject();
+        foreach(auto sha256, maps.keys()) {
+            QUrl url;
+            url.setScheme("http");
+            url.setHost(address.toString());
+            url.setPort(advertisement.value("port").toInt());
+            url.setPath("/"+maps.value(sha256).toString());
+
+            auto &peerFile = _peerFiles[sha256.toLatin1().toLower()];
+            if (peerFile.url != url) {
+                peerFile.url = url;
+                changed = true;
+            }
+            peerFile.lastSeen = QDateTime::currentDateTimeUtc();
+        }
+    }
+
+    if (changed)
+        emit peersChanged();
+}
+
+
+void MapShare::advertise()
+{
+    // Forget peers that have not been heard of for three intervals
+    auto expiry = QDateTime::currentDateTimeUtc().addMSecs(-3*advertisementInterval);
+    bool changed = false;
+    for(auto iterator = _peerFiles.begin(); iterator != _peerFiles.end(); ) {
+        if (iterator->lastSeen < expiry) {
+            iterator = _peerFiles.erase(iterator);
+            changed = true;
+        } else
+            ++iterator;
+    }
+    if (changed)
+        emit peersChanged();
+
+    if (_server.isNull())
+        return;
+
+    // Advertise the shared files whose checksum is known and current
+    QJsonObject maps;
+    foreach(auto fileName, _sharedFiles) {
+        QFileInfo info(fileName);
+        auto fileHash = _fileHashes.value(fileName);
+        if (fileHash.sha256.isEmpty() || (info.lastModified() != fileHash.lastModified) || (info.size() != fileHash.size))
+            continue;
+        maps.insert(QString::fromLatin1(fileHash.sha256), fileName.mid(_directory.size()+1));
+    }
+
+    QJsonObject advertisement;
+    advertisement.insert("app", "enroute-map-share");
+    advertisement.insert("id", QString::fromLatin1(_instanceID));
+    advertisement.insert("port", _server->serverPort());
+    advertisement.insert("maps", maps);
+    auto datagram = QJsonDocument(advertisement).toJson(QJsonDocument::Compact);
+    _socket.writeDatagram(datagram, QHostAddress::Broadcast, discoveryPort);
+    _socket.writeDatagram(datagram, QHostAddress::LocalHost, discoveryPort);
+}
+
+
+void MapShare::hashFiles()
+{
+    if (_server.isNull() || _hashWatcher.isRunning())
+        return;
+
+    QStringList fileNames;
+    foreach(auto fileName, _sharedFiles) {
+        QFileInfo info(fileName);
+        auto fileHash = _fileHashes.value(fileName);
+        if ((info.lastModified() != fileHash.lastModified) || (info.size() != fileHash.size))
+            fileNames += fileName;
+    }
+    if (fileNames.isEmpty())
+        return;
+
+    _hashWatcher.setFuture(QtConcurrent::run([fileNames]() {
+        QHash<QString, FileHash> result;
+        foreach(auto fileName, fileNames) {
+            // Files that cannot be read are recorded without checksum, so
+            // that they are not tried again until they change
+            QFileInfo info(fileName);
+            FileHash fileHash;
+            fileHash.lastModified = info.lastModified();
+            fileHash.size = info.size();
+            QFile file(fileName);
+            QCryptographicHash hash(QCryptographicHash::Sha256);
+            if (file.open(QIODevice::ReadOnly) && hash.addData(&file))
+                fileHash.sha256 = hash.result().toHex();
+            result.insert(fileName, fileHash);
+        }
+        return result;
+    }));
+}
+
+
+void MapShare::hashingFinished()
+{
+    auto result = _hashWatcher.result();
+    for(auto iterator = result.constBegin(); iterator != result.constEnd(); ++iterator)
+        _fileHashes.insert(iterator.key(), iterator.value());
+
+    // Save checksums of files that still exist
+    QVariantMap hashes;
+    for(auto iterator = _fileHashes.constBegin(); iterator != _fileHashes.constEnd(); ++iterator) {
+        if (!QFile::exists(iterator.key()))
+            continue;
+        hashes.insert(iterator.key(), QVariantList() << iterator.value().lastModified << iterator.value().size << iterator.value().sha256);
+    }
+    QSettings settings;
+    settings.setValue("MapShare/Hashes", hashes);
+
+    advertise();
+
+    // Files might have changed while the checksums were computed
+    hashFiles();
+}
@@ -0,0 +1,184 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef MAPSHARE_H
+#define MAPSHARE_H
+
+#include <QDateTime>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QPointer>
+#include <QTimer>
+#include <QUdpSocket>
+#include <QUrl>
+
+#include <qhttpengine/server.h>
+
+class SharedFilesHandler;
+
+
+/*! \brief Shares installed maps with other devices on the local network
+ *
+ * This class allows devices on the same local network, such as the tablets of
+ * a flying club, to download maps from each other instead of downloading them
+ * again over a slow internet connection.
+ *
+ * If sharing is enabled with setSharingEnabled(), the files set with
+ * setSharedFiles() are served by a QHttpEngine::Server that listens on all
+ * network interfaces. The server answers requests for the shared files only,
+ * and does not run before setSharedFiles() has set a directory. The files are
+ * advertised every few seconds by a UDP datagram that
+ * is sent to the broadcast address and to the local host, at port
+ * discoveryPort. The datagram is a JSON object that contains an instance ID,
+ * the port of the HTTP server, and an object that maps the SHA-256 checksums
+ * of the shared files to their paths on the server. The checksums are
+ * computed in a separate thread and cached via QSettings, so that every file
+ * is hashed only once.
+ *
+ * Advertisements of other instances are always received, whether sharing is
+ * enabled or not. Use peerURL() to find a peer that offers a file with a given
+ * checksum. Peers that have not been heard of for a while are forgotten.
+ *
+ * Since files are identified by their checksum, a peer is only used if it
+ * offers exactly the file that the server would send.
+ */
+
+class MapShare : public QObject
+{
+    Q_OBJECT
+
+public:
+    /*! \brief UDP port used for advertisements */
+    static const quint16 discoveryPort = 45781;
+
+    /*! \brief Interval between two advertisements, in milliseconds */
+    static const int advertisementInterval = 5*1000;
+
+    /*! \brief Constructs a MapShare, with sharing disabled
+     *
+     * @param parent The standard QObject parent pointer
+     */
+    explicit MapShare(QObject *parent=nullptr);
+
+    // No copy constructor
+    MapShare(MapShare const&) = delete;
+
+    // No assign operator
+    MapShare& operator =(MapShare const&) = delete;
+
+    // No move constructor
+    MapShare(MapShare&&) = delete;
+
+    // No move assignment operator
+    MapShare& operator=(MapShare&&) = delete;
+
+    /*! \brief Getter function for the property set with setSharingEnabled()
+     *
+     * @returns True if local maps are shared
+     */
+    bool sharingEnabled() const { return _sharingEnabled; }
+
+    /*! \brief Enables or disables sharing of local maps
+     *
+     * @param enabled If true, the HTTP server is started and the shared
+     * files are advertised, as soon as setSharedFiles() has set a directory
+     */
+    void setSharingEnabled(bool enabled);
+
+    /*! \brief Sets the files that are shared
+     *
+     * @param directory Directory that the HTTP server serves. Files outside
+     * of this directory are ignored.
+     *
+     * @param fileNames Absolute names of the shared files
+     */
+    void setSharedFiles(const QString& directory, const QStringList& fileNames);
+
+    /*! \brief URL of a peer that offers a file
+     *
+     * @param sha256 SHA-256 checksum of the file, hex-encoded
+     *
+     * @returns URL of the file on a peer, or an invalid URL if no peer offers
+     * the file
+     */
+    QUrl peerURL(const QByteArray& sha256) const;
+
+signals:
+    /*! \brief Emitted when the files offered by peers change */
+    void peersChanged();
+
+private slots:
+    // Reads advertisements of peers
+    void readDatagrams();
+
+    // Sends an advertisement, and forgets peers that are no longer heard of.
+    // Connected to the timeout of _advertisementTimer.
+    void advertise();
+
+    // Starts hashing the shared files whose checksum is not yet known
+    void hashFiles();
+
+    // Stores the checksums computed by hashFiles()
+    void hashingFinished();
+
+private:
+    // Starts or stops the HTTP server, depending on _sharingEnabled and
+    // _directory, and tells the server which files it may serve
+    void updateServer();
+
+    // Checksum of a shared file, together with the modification time and size
+    // of the file when the checksum was computed
+    struct FileHash {
+        QDateTime lastModified;
+        qint64 size {-1};
+        QByteArray sha256;
+    };
+
+    // File offered by a peer
+    struct PeerFile {
+        QUrl url;
+        QDateTime lastSeen;
+    };
+
+    // Random ID, used to ignore our own advertisements
+    QByteArray _instanceID;
+
+    // Value of the property set with setSharingEnabled()
+    bool _sharingEnabled {false};
+
+    // HTTP server, or nullptr if it is not running, and its handler
+    QPointer<QHttpEngine::Server> _server;
+    QPointer<SharedFilesHandler> _handler;
+
+    QString _directory;
+    QStringList _sharedFiles;
+
+    // Checksums of the shared files, indexed by file name
+    QHash<QString, FileHash> _fileHashes;
+    QFutureWatcher<QHash<QString, FileHash>> _hashWatcher;
+
+    // Files offered by peers, indexed by checksum
+    QHash<QByteArray, PeerFile> _peerFiles;
+
+    QUdpSocket _socket;
+    QTimer _advertisementTimer;
+};
+
+#endif // MAPSHARE_H
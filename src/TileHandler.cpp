@@ -25,9 +25,12 @@
 #include <QRegularExpression>
 #include <QSqlError>
 #include <QSqlQuery>
+#include <QThread>
+#include <QtConcurrent/QtConcurrent>
 
 #include <qhttpengine/socket.h>
 
+#include "MBTiles.h"
 #include "TileHandler.h"
 
 
@@ -44,6 +47,10 @@ TileHandler::TileHandler(const QSet<QString>& mbtileFileNames, const QString& ba
     _minzoom     = 0;
     _tiles       = baseURL+"/{z}/{x}/{y}."+_format;
 
+    // Threads are kept alive, because the database connections of a thread
+    // cannot be used by any other thread
+    threadPool.setExpiryTimeout(-1);
+
     // Go through mbtile files and find real values
     foreach (auto mbtileFileName, mbtileFileNames) {
         // Check that file really exists
@@ -62,6 +69,7 @@ TileHandler::TileHandler(const QSet<QString>& mbtileFileNames, const QString& ba
             return;
         }
         databaseConnections += databaseConnectionName;
+        databaseFileNames.insert(databaseConnectionName, mbtileFileName);
 
         // Read metadata from database
         QSqlQuery query(db);
@@ -85,6 +93,17 @@ TileHandler::TileHandler(const QSet<QString>& mbtileFileNames, const QString& ba
                 _maxzoom = query.value(1).toInt();
             if (key == "minzoom")
                 _minzoom = query.value(1).toInt();
+            if (key == MBTiles::tileExtentMetadataName) {
+                auto extents = QJsonDocument::fromJson(query.value(1).toByteArray()).object();
+                foreach(auto zoomLevel, extents.keys()) {
+                    auto extent = extents.value(zoomLevel).toArray();
+                    if (extent.size() != 4)
+                        continue;
+                    tileExtents[databaseConnectionName].insert(zoomLevel.toInt(),
+                                                              QRect(QPoint(extent[0].toInt(), extent[2].toInt()),
+                                                                    QPoint(extent[1].toInt(), extent[3].toInt())));
+                }
+            }
         }
         _tiles = baseURL+"/{z}/{x}/{y}."+_format;
 
@@ -99,6 +118,11 @@ TileHandler::TileHandler(const QSet<QString>& mbtileFileNames, const QString& ba
 
 TileHandler::~TileHandler()
 {
+    // Wait for running lookups. Their results are discarded.
+    threadPool.waitForDone();
+
+    foreach(auto databaseConnectionName, threadConnections)
+        QSqlDatabase::removeDatabase(databaseConnectionName);
     foreach(auto databaseConnectionName, databaseConnections)
         QSqlDatabase::removeDatabase(databaseConnectionName);
 }
@@ -120,25 +144,16 @@ void TileHandler::process(QHttpEngine::Socket *socket, const QString &path)
     QRegularExpression tileQueryPattern("[0-9]{1,2}/[0-9]{1,4}/[0-9]{1,4}");
     QRegularExpressionMatch match = tileQueryPattern.match(path);
     if (match.hasMatch()) {
-        // Retrieve tile data from the database
-        qint32  z       = path.section('/', 1, 1).toInt();
-        QString x       = path.section('/', 2, 2);
-        qint32  y       = path.section('/', 3, 3).section('.', 0, 0).toInt();
-        qint32 yflipped = ((1<<z)-1)-y;
-        QString queryString = QString("select zoom_level, tile_column, tile_row, tile_data from tiles where zoom_level=%1 and tile_column=%2 and tile_row=%3;").arg(z).arg(x).arg(yflipped);
-
-        foreach(auto databaseConnection, databaseConnections) {
-            auto db = QSqlDatabase::database(databaseConnection);
-
-            QSqlQuery query(db);
-            query.exec(queryString);
-
-            // Error handling
-            if (!query.first())
-                continue;
-
-            // Get data
-            QByteArray tileData = query.value(3).toByteArray();
+        qint32 z = path.section('/', 1, 1).toInt();
+        qint32 x = path.section('/', 2, 2).toInt();
+        qint32 y = path.section('/', 3, 3).section('.', 0, 0).toInt();
+        requestTile(z, x, y, socket, [socket](const QByteArray& tileData) {
+            // Unknown tile, responding with 'not found'
+            if (tileData.isEmpty()) {
+                socket->writeError(QHttpEngine::Socket::NotFound);
+                socket->close();
+                return;
+            }
 
             // Set the headers and write the content
             socket->setHeader("Content-Type", "application/octet-stream");
@@ -146,8 +161,8 @@ void TileHandler::process(QHttpEngine::Socket *socket, const QString &path)
             socket->setHeader("Content-Length", QByteArray::number(tileData.length()));
             socket->write(tileData);
             socket->close();
-            return;
-        }
+        });
+        return;
     }
 
     // Unknown request, responding with 'not found'
@@ -156,6 +171,91 @@ void TileHandler::process(QHttpEngine::Socket *socket, const QString &path)
 }
 
 
+void TileHandler::requestTile(int zoomLevel, int x, int y, QObject *context, const std::function<void(const QByteArray&)>& callback)
+{
+    // Paranoid safety checks
+    if ((zoomLevel < 0) || (zoomLevel > 30)) {
+        QMetaObject::invokeMethod(context, [callback]() { callback(QByteArray()); }, Qt::QueuedConnection);
+        return;
+    }
+
+    qint32 yflipped = ((1<<zoomLevel)-1)-y;
+    _numberOfTileRequests++;
+
+    // If the tile is already being looked up, wait for that lookup
+    auto tileKey = QString("%1/%2/%3").arg(zoomLevel).arg(x).arg(yflipped);
+    auto lookUpRunning = pendingRequests.contains(tileKey);
+    pendingRequests[tileKey] += PendingRequest{context, callback};
+    if (lookUpRunning)
+        return;
+
+    // Otherwise, look the tile up in a separate thread
+    _numberOfTileLookups++;
+    auto watcher = new QFutureWatcher<Tile>(this);
+    connect(watcher, &QFutureWatcher<Tile>::finished, this, [this, watcher, tileKey]() {
+        deliverTile(tileKey, watcher->result());
+        watcher->deleteLater();
+    });
+    watcher->setFuture(QtConcurrent::run(&threadPool, this, &TileHandler::lookUpTile, zoomLevel, x, yflipped));
+}
+
+
+TileHandler::Tile TileHandler::lookUpTile(int zoomLevel, int column, int row)
+{
+    foreach(auto databaseConnection, databaseConnections) {
+        // Skip optimized files that do not cover the tile
+        if (tileExtents.contains(databaseConnection)
+                && !tileExtents[databaseConnection].value(zoomLevel).contains(column, row))
+            continue;
+
+        auto db = threadDatabase(databaseConnection);
+        QSqlQuery query(db);
+        query.prepare("select tile_data from tiles where zoom_level=? and tile_column=? and tile_row=?;");
+        query.addBindValue(zoomLevel);
+        query.addBindValue(column);
+        query.addBindValue(row);
+
+        // Error handling
+        if (!query.exec() || !query.first())
+            continue;
+
+        return {query.value(0).toByteArray(), db.databaseName()};
+    }
+    return {};
+}
+
+
+QSqlDatabase TileHandler::threadDatabase(const QString& databaseConnectionName)
+{
+    auto threadConnectionName = QString("%1-%2").arg(databaseConnectionName).arg(reinterpret_cast<quintptr>(QThread::currentThread()));
+    if (QSqlDatabase::contains(threadConnectionName))
+        return QSqlDatabase::database(threadConnectionName);
+
+    auto db = QSqlDatabase::addDatabase("QSQLITE", threadConnectionName);
+    db.setDatabaseName(databaseFileNames.value(databaseConnectionName));
+    db.setConnectOptions("QSQLITE_OPEN_READONLY");
+    db.open();
+
+    QMutexLocker locker(&threadConnectionsMutex);
+    threadConnections += threadConnectionName;
+    return db;
+}
+
+
+void TileHandler::deliverTile(const QString& tileKey, const Tile& tile)
+{
+    foreach(auto request, pendingRequests.take(tileKey)) {
+        // Paranoid safety checks
+        if (request.context.isNull())
+            continue;
+
+        request.callback(tile.data);
+        if (!tile.data.isEmpty())
+            emit tileServed(tile.fileName);
+    }
+}
+
+
 QByteArray TileHandler::tileJSON() const
 {
     QJsonObject result;
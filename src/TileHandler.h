@@ -21,8 +21,15 @@
 #ifndef TILEHANDLER_H
 #define TILEHANDLER_H
 
+#include <QFutureWatcher>
+#include <QHash>
+#include <QMutex>
+#include <QPointer>
+#include <QRect>
 #include <QSet>
 #include <QSqlDatabase>
+#include <QThreadPool>
+#include <functional>
 
 #include <qhttpengine/handler.h>
 
@@ -35,6 +42,14 @@
   TileJSON Specification 2.2.0 found
   https://github.com/mapbox/tilejson-spec/tree/master/2.2.0) is served at the
   URL whose names is set in the baseURLName argument of the constructor.
+
+  Tiles are looked up in the databases by the threads of a private thread
+  pool, so that the handler does not block the event loop and can serve
+  several requests at the same time. Every thread uses its own database
+  connections. Requests for a tile that is already being looked up do not
+  start a second lookup; they wait for the running lookup, and the result is
+  handed to all waiting requests. Besides HTTP, tiles can be requested with
+  requestTile().
 */
 
 class TileHandler : public QHttpEngine::Handler
@@ -184,7 +199,51 @@ public:
     @returns Property version
   */
   QString version() const {return _version;}
+
+  /*! \brief Number of tile requests received so far
+
+    @returns Number of tile requests
+  */
+  qint64 numberOfTileRequests() const {return _numberOfTileRequests;}
+
+  /*! \brief Number of tile lookups in the databases so far
+
+    Requests for a tile that is already being looked up share the running
+    lookup, so that this number is smaller than numberOfTileRequests() if
+    identical tiles are requested concurrently.
+
+    @returns Number of tile lookups
+  */
+  qint64 numberOfTileLookups() const {return _numberOfTileLookups;}
+
+  /*! \brief Looks up a tile asynchronously
+
+    This method allows to retrieve tiles without going through HTTP, for
+    instance from a TileNetworkAccessManager. The tile is looked up exactly as
+    for an HTTP request, and concurrent requests for the same tile share one
+    lookup. This method must be called from the thread of the handler.
+
+    @param zoomLevel Zoom level of the tile
+
+    @param x Column of the tile
+
+    @param y Row of the tile, counted from the north as in the URL of the tile
+
+    @param context The callback is not called if this object has been deleted
+    in the meantime. The context must live in the thread of the handler.
+
+    @param callback Called in the thread of the handler with the tile data,
+    once the lookup is done. The data is empty if the tile does not exist.
+  */
+  void requestTile(int zoomLevel, int x, int y, QObject *context, const std::function<void(const QByteArray&)>& callback);
   
+signals:
+  /*! \brief Emitted whenever a tile has been served
+
+    @param mbtileFileName Name of the mbtile file that contained the tile
+  */
+  void tileServed(QString mbtileFileName);
+
 protected:
   /*
    * @brief Reimplementation of
@@ -208,6 +267,54 @@ private:
   int _minzoom {-1};
   
   bool hasDBError {false};
+
+  // Tile extents of the database connections, as read from the metadata entry
+  // MBTiles::tileExtentMetadataName of optimized files. For every zoom level,
+  // the rectangle contains the tile columns in x and the tile rows in y.
+  // Connections without entry contain tiles anywhere.
+  QHash<QString, QHash<int, QRect>> tileExtents;
+
+  // Result of a tile lookup: the tile data, and the name of the mbtile file
+  // that contained the tile. The data is empty if no file contains the tile.
+  struct Tile {
+    QByteArray data;
+    QString fileName;
+  };
+
+  // Looks up a tile in the databases. This method runs in the threads of
+  // threadPool and uses the connections returned by threadDatabase().
+  Tile lookUpTile(int zoomLevel, int column, int row);
+
+  // Database connection to the same file as the connection
+  // databaseConnectionName, for use by the current thread. The connection is
+  // opened on first use.
+  QSqlDatabase threadDatabase(const QString& databaseConnectionName);
+
+  // Hands the result of a lookup to all requests waiting for the tile
+  void deliverTile(const QString& tileKey, const Tile& tile);
+
+  // Names of the mbtile files, by database connection name
+  QHash<QString, QString> databaseFileNames;
+
+  // Threads that look up tiles, and the names of the database connections
+  // opened by them
+  QThreadPool threadPool;
+  QMutex threadConnectionsMutex;
+  QSet<QString> threadConnections;
+
+  // Request waiting for a tile, see requestTile()
+  struct PendingRequest {
+    QPointer<QObject> context;
+    std::function<void(const QByteArray&)> callback;
+  };
+
+  // Requests waiting for a tile, by "z/column/row". A tile is being looked up
+  // if and only if it appears in this hash.
+  QHash<QString, QList<PendingRequest>> pendingRequests;
+
+  // Statistics, see numberOfTileRequests() and numberOfTileLookups()
+  qint64 _numberOfTileRequests {0};
+  qint64 _numberOfTileLookups {0};
 };
 
 #endif // TILEHANDLER
@@ -0,0 +1,222 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFutureInterface>
+#include <QFutureWatcher>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QNetworkReply>
+#include <QPointer>
+#include <QRegularExpression>
+
+#include "TileHandler.h"
+#include "TileNetworkAccessManager.h"
+
+
+const QString TileNetworkAccessManager::scheme = "enroute-tiles";
+const QString TileNetworkAccessManager::baseURL = "enroute-tiles://local";
+
+
+// QNetworkReply that is answered by a TileHandler or from the Qt resource
+// system. The reply is constructed in the thread of the
+// TileNetworkAccessManager, while the TileServer and its TileHandlers are
+// called in the thread of the TileServer. The result travels back through a
+// QFutureInterface, which may be used from any thread. The QFutureWatcher
+// lives in the thread of the reply and is deleted with it, so the thread of
+// the TileServer never needs to know whether the reply still exists.
+class TileReply : public QNetworkReply
+{
+public:
+    TileReply(const QNetworkRequest& request, TileServer *tileServer, TileNetworkAccessManager *manager)
+        : QNetworkReply(manager), _manager(manager)
+    {
+        _latencyTimer.start();
+        setRequest(request);
+        setUrl(request.url());
+        setOperation(QNetworkAccessManager::GetOperation);
+        open(QIODevice::ReadOnly|QIODevice::Unbuffered);
+
+        // Find out what is requested. The path is either of the form
+        // "/PATH/z/x/y.pbf", or "/PATH" for TileJSON, or the path of a file in
+        // the Qt resource system.
+        auto path = request.url().path();
+        auto tileSetPath = path.section('/', 1, 1);
+        QRegularExpression tileQueryPattern("^/[^/]+/([0-9]{1,2})/([0-9]{1,7})/([0-9]{1,7})");
+        auto match = tileQueryPattern.match(path);
+        _isTile = match.hasMatch();
+        _contentType = (_isTile || (path.contains('.') && !path.endsWith(".json", Qt::CaseInsensitive))) ? "application/octet-stream" : "application/json";
+
+        // Wait for the result in the thread of the reply
+        QFutureInterface<QByteArray> promise;
+        promise.reportStarted();
+        QObject::connect(&_watcher, &QFutureWatcher<QByteArray>::finished, this, [this]() {
+            finish(_watcher.result(), _isTile ? "gzip" : QByteArray());
+        });
+        _watcher.setFuture(promise.future());
+
+        // Ask the tile handler, in the thread of the tile server
+        QMetaObject::invokeMethod(tileServer, [promise, tileServer, tileSetPath, path, match]() mutable {
+            auto handler = tileServer->tileHandler(tileSetPath);
+
+            // Files from the Qt resource system
+            if (handler == nullptr) {
+                QFile file(":"+path);
+                QByteArray data;
+                if (file.open(QIODevice::ReadOnly))
+                    data = file.readAll();
+                promise.reportResult(data);
+                promise.reportFinished();
+                return;
+            }
+
+            // Tiles
+            if (match.hasMatch()) {
+                handler->requestTile(match.captured(1).toInt(), match.captured(2).toInt(), match.captured(3).toInt(), tileServer, [promise](const QByteArray& data) mutable {
+                    promise.reportResult(data);
+                    promise.reportFinished();
+                });
+                return;
+            }
+
+            // TileJSON, pointing to this URL scheme rather than to the server
+            auto tileJSON = QJsonDocument::fromJson(handler->tileJSON()).object();
+            tileJSON.insert("tiles", QJsonArray({TileNetworkAccessManager::baseURL+"/"+tileSetPath+"/{z}/{x}/{y}."+handler->format()}));
+            promise.reportResult(QJsonDocument(tileJSON).toJson());
+            promise.reportFinished();
+        }, Qt::QueuedConnection);
+    }
+
+    // No copy constructor
+    TileReply(TileReply const&) = delete;
+
+    // No assign operator
+    TileReply& operator =(TileReply const&) = delete;
+
+    // No move constructor
+    TileReply(TileReply&&) = delete;
+
+    // No move assignment operator
+    TileReply& operator=(TileReply&&) = delete;
+
+    // Standard destructor
+    ~TileReply() override = default;
+
+    void abort() override
+    {
+        if (isFinished())
+            return;
+        finish(QByteArray(), QByteArray(), OperationCanceledError);
+    }
+
+    qint64 bytesAvailable() const override
+    {
+        return _data.size()-_offset+QNetworkReply::bytesAvailable();
+    }
+
+    bool isSequential() const override
+    {
+        return true;
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override
+    {
+        auto size = qMin(maxSize, static_cast<qint64>(_data.size())-_offset);
+        if (size <= 0)
+            return isFinished() ? -1 : 0;
+        memcpy(data, _data.constData()+_offset, static_cast<size_t>(size));
+        _offset += size;
+        return size;
+    }
+
+private:
+    // Sets the content of the reply and emits the appropriate signals. Empty
+    // data means that nothing was found.
+    void finish(const QByteArray& data, const QByteArray& contentEncoding, NetworkError errorCode = ContentNotFoundError)
+    {
+        if (isFinished())
+            return;
+
+        _data = data;
+        _offset = 0;
+        if (_data.isEmpty()) {
+            setAttribute(QNetworkRequest::HttpStatusCodeAttribute, (errorCode == ContentNotFoundError) ? 404 : 0);
+            setError(errorCode, (errorCode == ContentNotFoundError) ? QObject::tr("Not found") : QObject::tr("Operation canceled"));
+        } else {
+            setAttribute(QNetworkRequest::HttpStatusCodeAttribute, 200);
+            setHeader(QNetworkRequest::ContentTypeHeader, _contentType);
+            if (!contentEncoding.isEmpty())
+                setRawHeader("Content-Encoding", contentEncoding);
+        }
+        setHeader(QNetworkRequest::ContentLengthHeader, _data.size());
+        setFinished(true);
+
+        if (_isTile && !_data.isEmpty() && !_manager.isNull())
+            _manager->recordTileLatency(url(), _latencyTimer.nsecsElapsed()/1000);
+
+        emit metaDataChanged();
+        if (error() != NoError)
+            emit error(error());
+        if (!_data.isEmpty()) {
+            emit downloadProgress(_data.size(), _data.size());
+            emit readyRead();
+        }
+        emit finished();
+    }
+
+    QPointer<TileNetworkAccessManager> _manager;
+    QFutureWatcher<QByteArray> _watcher;
+    QElapsedTimer _latencyTimer;
+    bool _isTile {false};
+    QString _contentType;
+    QByteArray _data;
+    qint64 _offset {0};
+};
+
+
+TileNetworkAccessManager::TileNetworkAccessManager(TileServer *tileServer, QObject *parent)
+    : QNetworkAccessManager(parent), _tileServer(tileServer)
+{
+}
+
+
+QNetworkReply *TileNetworkAccessManager::createRequest(Operation op, const QNetworkRequest& request, QIODevice *outgoingData)
+{
+    if ((op != GetOperation) || (request.url().scheme() != scheme) || (_tileServer == nullptr))
+        return QNetworkAccessManager::createRequest(op, request, outgoingData);
+    return new TileReply(request, _tileServer, this);
+}
+
+
+void TileNetworkAccessManager::recordTileLatency(const QUrl& url, qint64 latency)
+{
+    _numberOfTiles++;
+    _totalTileLatency += latency;
+    emit tileDelivered(url, latency);
+}
+
+
+QNetworkAccessManager *TileNetworkAccessManagerFactory::create(QObject *parent)
+{
+    return new TileNetworkAccessManager(_tileServer, parent);
+}
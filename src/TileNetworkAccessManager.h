@@ -0,0 +1,158 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef TILENETWORKACCESSMANAGER_H
+#define TILENETWORKACCESSMANAGER_H
+
+#include <QNetworkAccessManager>
+#include <QQmlNetworkAccessManagerFactory>
+
+#include "TileServer.h"
+
+
+/*! \brief QNetworkAccessManager that retrieves tiles without TCP loopback
+ *
+ * This class serves the content of a TileServer in-process, under URLs of the
+ * form "enroute-tiles://local/PATH", where PATH is the path used with the
+ * TileServer. Tiles and TileJSON are obtained directly from the TileHandler
+ * that serves the path, so that no socket, no HTTP parsing and no kernel copy
+ * is involved. Tile requests share the lookup and the request coalescing of
+ * TileHandler::requestTile(). Paths that do not belong to a set of tile files
+ * are served from the Qt resource system, as the TileServer does. All other
+ * URLs are handled by QNetworkAccessManager as usual.
+ *
+ * The TileServer remains available for clients that use HTTP. It must live in
+ * the main thread, while the TileNetworkAccessManager may live in any
+ * thread.
+ *
+ * For every tile, the time between request and reply is measured and
+ * reported by the signal tileDelivered().
+ */
+
+class TileNetworkAccessManager : public QNetworkAccessManager
+{
+    Q_OBJECT
+
+public:
+    /*! \brief URL scheme handled by this class */
+    static const QString scheme;
+
+    /*! \brief URL that corresponds to TileServer::serverUrl() */
+    static const QString baseURL;
+
+    /*! \brief Constructs a TileNetworkAccessManager
+     *
+     * @param tileServer TileServer whose content is served. The TileServer
+     * is used from other threads and must outlive the
+     * TileNetworkAccessManager.
+     *
+     * @param parent The standard QObject parent pointer
+     */
+    explicit TileNetworkAccessManager(TileServer *tileServer, QObject *parent=nullptr);
+
+    // No copy constructor
+    TileNetworkAccessManager(TileNetworkAccessManager const&) = delete;
+
+    // No assign operator
+    TileNetworkAccessManager& operator =(TileNetworkAccessManager const&) = delete;
+
+    // No move constructor
+    TileNetworkAccessManager(TileNetworkAccessManager&&) = delete;
+
+    // No move assignment operator
+    TileNetworkAccessManager& operator=(TileNetworkAccessManager&&) = delete;
+
+    // Standard destructor
+    ~TileNetworkAccessManager() override = default;
+
+    /*! \brief Number of tiles delivered so far
+     *
+     * @returns Number of tiles
+     */
+    qint64 numberOfTiles() const { return _numberOfTiles; }
+
+    /*! \brief Average time between request and reply of a tile
+     *
+     * @returns Average latency in microseconds, or 0 if no tile has been
+     * delivered
+     */
+    qint64 averageTileLatency() const { return (_numberOfTiles == 0) ? 0 : _totalTileLatency/_numberOfTiles; }
+
+signals:
+    /*! \brief Emitted whenever a tile has been delivered
+     *
+     * @param url URL of the tile
+     *
+     * @param latency Time between request and reply, in microseconds
+     */
+    void tileDelivered(QUrl url, qint64 latency);
+
+protected:
+    // Reimplementation of QNetworkAccessManager::createRequest(). Answers GET
+    // requests with the scheme "enroute-tiles".
+    QNetworkReply *createRequest(Operation op, const QNetworkRequest& request, QIODevice *outgoingData = nullptr) override;
+
+private:
+    friend class TileReply;
+
+    // Called by TileReply once a tile has been delivered
+    void recordTileLatency(const QUrl& url, qint64 latency);
+
+    // Not a QPointer, because the TileServer lives in a different thread
+    TileServer *_tileServer;
+
+    // Statistics, see numberOfTiles() and averageTileLatency()
+    qint64 _numberOfTiles {0};
+    qint64 _totalTileLatency {0};
+};
+
+
+/*! \brief Factory that equips a QML engine with TileNetworkAccessManagers
+ *
+ * Install the factory with QQmlEngine::setNetworkAccessManagerFactory(), so
+ * that URLs of the form "enroute-tiles://local/PATH" can be used in QML.
+ */
+
+class TileNetworkAccessManagerFactory : public QQmlNetworkAccessManagerFactory
+{
+public:
+    /*! \brief Constructs a factory
+     *
+     * @param tileServer TileServer whose content is served by the
+     * TileNetworkAccessManagers. The TileServer must outlive the factory and
+     * all TileNetworkAccessManagers.
+     */
+    explicit TileNetworkAccessManagerFactory(TileServer *tileServer) : _tileServer(tileServer) {}
+
+    /*! \brief Creates a TileNetworkAccessManager
+     *
+     * This method may be called from several threads at the same time.
+     *
+     * @param parent The standard QObject parent pointer
+     *
+     * @returns A new TileNetworkAccessManager
+     */
+    QNetworkAccessManager *create(QObject *parent) override;
+
+private:
+    TileServer *_tileServer;
+};
+
+#endif
@@ -40,6 +40,12 @@ QString TileServer::serverUrl() const
 }
 
 
+TileHandler *TileServer::tileHandler(const QString& path) const
+{
+    return tileHandlers.value(path);
+}
+
+
 void TileServer::addMbtilesFileSet(const QSet<QString>& fileNames, const QString& path)
 {
     mbtileFileNameSets[path] = fileNames;
@@ -64,6 +70,7 @@ void TileServer::setUpTileHandlers()
     currentFileSystemHandler = newFileSystemHandler;
 
     // Now add subhandlers for each tile
+    tileHandlers.clear();
     QMapIterator<QString, QSet<QString>> iterator(mbtileFileNameSets);
     while (iterator.hasNext()) {
         iterator.next();
@@ -76,7 +83,9 @@ void TileServer::setUpTileHandlers()
             URL = _baseUrl.toString()+"/"+iterator.key();
 
         auto handler = new TileHandler(iterator.value(), URL, newFileSystemHandler);
+        connect(handler, &TileHandler::tileServed, this, &TileServer::tileServed);
         newFileSystemHandler->addSubHandler(QRegExp("^"+iterator.key()), handler);
+        tileHandlers.insert(iterator.key(), handler);
     }
 
 }
@@ -26,6 +26,8 @@
 
 #include <QPointer>
 
+class TileHandler;
+
 
 /*! \brief HTTP server for mapbox' MBTiles files
   
@@ -96,6 +98,15 @@ public:
     @returns URL under which this server is presently reachable
   */
   QString serverUrl() const;
+
+  /*! \brief Handler that serves a set of tile files
+
+    @param path Path of the set of tile files, as in addMbtilesFileSet()
+
+    @returns Handler that serves the set, or nullptr if no set was added
+    under the path
+  */
+  TileHandler *tileHandler(const QString& path) const;
 			   
 public slots:
   /*! \brief Add a new set of tile files
@@ -124,6 +135,13 @@ public slots:
     @param path Path of tiles to remove
    */
   void removeMbtilesFileSet(const QString& path);
+
+signals:
+  /*! \brief Emitted whenever a tile has been served
+
+    @param mbtileFileName Name of the mbtile file that contained the tile
+  */
+  void tileServed(QString mbtileFileName);
   
 private:
   void setUpTileHandlers();
@@ -131,6 +149,9 @@ private:
   QPointer<QHttpEngine::FilesystemHandler> currentFileSystemHandler;
   
   QMap<QString,QSet<QString>> mbtileFileNameSets;
+
+  // Tile handlers that serve the sets, by path
+  QMap<QString, QPointer<TileHandler>> tileHandlers;
   
   QUrl _baseUrl;
 };
@@ -28,6 +28,7 @@
 #include <QSettings>
 
 #include "Aircraft.h"
+#include "AirspaceLookahead.h"
 #include "FlightRoute.h"
 #include "GeoMapProvider.h"
 #include "GlobalSettings.h"
@@ -35,6 +36,7 @@
 #include "MobileAdaptor.h"
 #include "SatNav.h"
 #include "ScaleQuickItem.h"
+#include "TileNetworkAccessManager.h"
 #include "Wind.h"
 
 int main(int argc, char *argv[])
@@ -86,15 +88,24 @@ int main(int argc, char *argv[])
 
     // Attach map manager
     auto networkAccessManager = new QNetworkAccessManager();
-    auto mapManager = new MapManager(networkAccessManager);
+    auto mapManager = new MapManager(networkAccessManager, navEngine);
     engine->rootContext()->setContextProperty("mapManager", mapManager);
 
     // Attach geo map provider
     auto geoMapProvider = new GeoMapProvider(mapManager, globalSettings, mapManager);
     engine->rootContext()->setContextProperty("geoMapProvider", geoMapProvider);
 
+    // Allow QML to retrieve tiles from the geo map provider without TCP
+    // loopback, see TileNetworkAccessManager
+    auto tileNetworkAccessManagerFactory = new TileNetworkAccessManagerFactory(geoMapProvider->tileServer());
+    engine->setNetworkAccessManagerFactory(tileNetworkAccessManagerFactory);
+
+    // Attach airspace lookahead
+    auto airspaceLookahead = new AirspaceLookahead(navEngine, geoMapProvider, engine);
+    engine->rootContext()->setContextProperty("airspaceLookahead", airspaceLookahead);
+
     // Attach flight route
-    auto flightroute = new FlightRoute(aircraft, wind, engine);
+    auto flightroute = new FlightRoute(aircraft, wind, geoMapProvider, engine);
     engine->rootContext()->setContextProperty("flightRoute", flightroute);
 
     /*
@@ -163,6 +174,7 @@ int main(int argc, char *argv[])
 
     // Ensure that things get deleted in the right order
     delete engine;
+    delete tileNetworkAccessManagerFactory;
     delete mapManager; // This will also delete geoMapProvider
     delete networkAccessManager;
 
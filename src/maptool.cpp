@@ -0,0 +1,212 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Stefan Kebekus                                  *
+ *   stefan.kebekus@gmail.com                                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QFile>
+#include <QHostAddress>
+#include <QTextStream>
+
+#include "BlockManifest.h"
+#include "MBTiles.h"
+#include "MapMirror.h"
+
+
+/* This is a small command line tool that prepares map files for the
+ * enroute download server. It is not part of the app. The following commands
+ * are supported.
+ *
+ * - "delta OLD NEW DELTA" creates a tile-level delta for mbtiles files, as
+ *   described in the class MBTiles.
+ *
+ * - "blocks FILE MANIFEST [BLOCKSIZE]" creates the block manifest for a file
+ *   of any type, as described in the class BlockManifest.
+ *
+ * - "optimize FILE [OUTPUT]" writes an optimized copy of an mbtiles file, as
+ *   described in MBTiles::optimize(). Without OUTPUT, the file is replaced.
+ *
+ * - "extract FILE OUTPUT" writes the part of an mbtiles file that covers a
+ *   region, as described in MBTiles::extract(). The region is given by one
+ *   or more options --bbox WEST,SOUTH,EAST,NORTH, or by a route with
+ *   --route "LON,LAT;LON,LAT;..." and a corridor width in kilometers with
+ *   --corridor. The options --minzoom and --maxzoom restrict the zoom levels.
+ *
+ * - "serve DIRECTORY [PORT]" serves the map files in DIRECTORY, together with a
+ *   generated "maps.json", as described in the class MapMirror. The options
+ *   --bandwidth, --latency, --drop-rate, --error-rate and --error-code
+ *   simulate bad network conditions. Every request is logged to stdout. Set
+ *   the environment variable ENROUTE_MAPS_JSON_URL to
+ *   "http://localhost:PORT/maps.json" to point the app to the server.
+ */
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("enroute-maptool");
+    QCoreApplication::setApplicationVersion(PROJECT_VERSION);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Prepares map files for the enroute download server.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+    parser.addPositionalArgument("command", "Command to run: delta, blocks, optimize, extract, serve");
+    parser.addPositionalArgument("arguments", "Arguments of the command", "[arguments...]");
+    QCommandLineOption bandwidthOption("bandwidth", "serve: Bandwidth in bytes per second, 0 for no limit.", "bytes", "0");
+    QCommandLineOption latencyOption("latency", "serve: Delay before every response, in milliseconds.", "ms", "0");
+    QCommandLineOption dropRateOption("drop-rate", "serve: Probability that a transfer is dropped.", "probability", "0");
+    QCommandLineOption errorRateOption("error-rate", "serve: Probability that a request fails.", "probability", "0");
+    QCommandLineOption errorCodeOption("error-code", "serve: HTTP status code of failed requests.", "code", "503");
+    QCommandLineOption bboxOption("bbox", "extract: Bounding box in degrees, can be repeated.", "west,south,east,north");
+    QCommandLineOption routeOption("route", "extract: Route in degrees.", "lon,lat;lon,lat;...");
+    QCommandLineOption corridorOption("corridor", "extract: Width of the corridor around the route, in kilometers.", "km", "20");
+    QCommandLineOption minZoomOption("minzoom", "extract: Smallest zoom level.", "zoom", "0");
+    QCommandLineOption maxZoomOption("maxzoom", "extract: Largest zoom level, -1 for all.", "zoom", "-1");
+    parser.addOptions({bandwidthOption, latencyOption, dropRateOption, errorRateOption, errorCodeOption,
+                       bboxOption, routeOption, corridorOption, minZoomOption, maxZoomOption});
+    parser.process(app);
+
+    QTextStream err(stderr);
+    auto arguments = parser.positionalArguments();
+    if (arguments.isEmpty())
+        parser.showHelp(1);
+    auto command = arguments.takeFirst();
+
+    if (command == "delta") {
+        if (arguments.size() != 3) {
+            err << "Usage: enroute-maptool delta OLD.mbtiles NEW.mbtiles DELTA" << endl;
+            return 1;
+        }
+        QString errorMessage;
+        if (!MBTiles::createDelta(arguments[0], arguments[1], arguments[2], &errorMessage)) {
+            err << errorMessage << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (command == "blocks") {
+        if ((arguments.size() < 2) || (arguments.size() > 3)) {
+            err << "Usage: enroute-maptool blocks FILE MANIFEST [BLOCKSIZE]" << endl;
+            return 1;
+        }
+        int blockSize = BlockManifest::defaultBlockSize;
+        if (arguments.size() == 3)
+            blockSize = arguments[2].toInt();
+        auto manifest = BlockManifest::create(arguments[0], blockSize);
+        if (manifest.isEmpty()) {
+            err << "Cannot read " << arguments[0] << endl;
+            return 1;
+        }
+        QFile manifestFile(arguments[1]);
+        if (!manifestFile.open(QIODevice::WriteOnly) || (manifestFile.write(manifest) != manifest.size())) {
+            err << "Cannot write " << arguments[1] << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (command == "optimize") {
+        if ((arguments.size() < 1) || (arguments.size() > 2)) {
+            err << "Usage: enroute-maptool optimize FILE.mbtiles [OUTPUT.mbtiles]" << endl;
+            return 1;
+        }
+        auto outputFileName = (arguments.size() == 2) ? arguments[1] : arguments[0]+".optimized";
+        QString errorMessage;
+        if (!MBTiles::optimize(arguments[0], outputFileName, &errorMessage)) {
+            err << errorMessage << endl;
+            return 1;
+        }
+        if (arguments.size() == 1) {
+            QFile::remove(arguments[0]);
+            if (!QFile::rename(outputFileName, arguments[0])) {
+                err << "Cannot replace " << arguments[0] << endl;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    if (command == "extract") {
+        if (arguments.size() != 2) {
+            err << "Usage: enroute-maptool extract FILE.mbtiles OUTPUT.mbtiles --bbox W,S,E,N | --route \"LON,LAT;...\" [--corridor KM]" << endl;
+            return 1;
+        }
+        QVector<QRectF> boxes;
+        foreach(auto bbox, parser.values(bboxOption)) {
+            auto coordinates = bbox.split(',');
+            if (coordinates.size() != 4) {
+                err << "Invalid bounding box " << bbox << endl;
+                return 1;
+            }
+            boxes += QRectF(QPointF(coordinates[0].toDouble(), coordinates[1].toDouble()),
+                            QPointF(coordinates[2].toDouble(), coordinates[3].toDouble())).normalized();
+        }
+        if (parser.isSet(routeOption)) {
+            QVector<QPointF> route;
+            foreach(auto waypoint, parser.value(routeOption).split(';', QString::SkipEmptyParts)) {
+                auto coordinates = waypoint.split(',');
+                if (coordinates.size() != 2) {
+                    err << "Invalid waypoint " << waypoint << endl;
+                    return 1;
+                }
+                route += QPointF(coordinates[0].toDouble(), coordinates[1].toDouble());
+            }
+            boxes += MBTiles::corridor(route, parser.value(corridorOption).toDouble());
+        }
+        QString errorMessage;
+        if (!MBTiles::extract(arguments[0], arguments[1], boxes, parser.value(minZoomOption).toInt(), parser.value(maxZoomOption).toInt(), &errorMessage)) {
+            err << errorMessage << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (command == "serve") {
+        if ((arguments.size() < 1) || (arguments.size() > 2)) {
+            err << "Usage: enroute-maptool serve DIRECTORY [PORT]" << endl;
+            return 1;
+        }
+        quint16 port = 8080;
+        if (arguments.size() == 2)
+            port = static_cast<quint16>(arguments[1].toUInt());
+
+        MapMirror mirror(arguments[0]);
+        mirror.setBandwidth(parser.value(bandwidthOption).toLongLong());
+        mirror.setLatency(parser.value(latencyOption).toInt());
+        mirror.setDropRate(parser.value(dropRateOption).toDouble());
+        mirror.setErrorRate(parser.value(errorRateOption).toDouble(), parser.value(errorCodeOption).toInt());
+        if (!mirror.listen(QHostAddress::Any, port)) {
+            err << "Cannot listen on port " << port << endl;
+            return 1;
+        }
+
+        QTextStream out(stdout);
+        out << "Serving " << mirror.numberOfMaps() << " maps at http://localhost:" << mirror.serverPort() << "/maps.json" << endl;
+        QObject::connect(&mirror, &MapMirror::requestServed, [&out](const QString& method, const QString& path, int statusCode, qint64 bytesSent, bool dropped) {
+            out << QDateTime::currentDateTime().toString(Qt::ISODateWithMs) << " " << method << " " << path << " "
+                << statusCode << " " << bytesSent << (dropped ? " dropped" : "") << endl;
+        });
+        return QCoreApplication::exec();
+    }
+
+    err << "Unknown command "<< command << endl;
+    return 1;
+}